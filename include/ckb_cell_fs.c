@@ -19,7 +19,6 @@ int get_file(const CellFileSystem *fs, const char *filename, FSFile **f) {
         for (uint32_t i = 0; i < node->count; i++) {
             FSEntry entry = node->files[i];
             if (strcmp(filename, node->start + entry.filename.offset) == 0) {
-                // TODO: check the memory addresses are legal
                 file->filename = filename;
                 file->size = entry.content.length;
                 file->content = node->start + entry.content.offset;
@@ -42,8 +41,36 @@ int ckb_get_file(const char *filename, FSFile **file) {
     return get_file(CELL_FILE_SYSTEM, filename, file);
 }
 
+static int check_blob(FSBlob blob, uint64_t size) {
+    return blob.offset <= size && blob.length <= size - blob.offset;
+}
+
+// Check that the entries of the file system in `buf` are within `buflen`
+// bytes, and that file names are null-terminated.
+static int check_fs(const void *buf, uint64_t buflen) {
+    if (buflen < sizeof(uint32_t)) {
+        return -1;
+    }
+    uint32_t count = *(uint32_t *)buf;
+    if (count > (buflen - sizeof(uint32_t)) / sizeof(FSEntry)) {
+        return -1;
+    }
+    uint64_t size = buflen - sizeof(uint32_t) - sizeof(FSEntry) * count;
+    const FSEntry *entries = (const FSEntry *)((char *)buf + sizeof(uint32_t));
+    const char *start = (const char *)(entries + count);
+    for (uint32_t i = 0; i < count; i++) {
+        FSEntry entry = entries[i];
+        if (!check_blob(entry.filename, size) ||
+            !check_blob(entry.content, size) || entry.filename.length == 0 ||
+            start[entry.filename.offset + entry.filename.length - 1] != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 int load_fs(CellFileSystem **fs, void *buf, uint64_t buflen) {
-    if (fs == NULL || buf == NULL) {
+    if (fs == NULL || buf == NULL || check_fs(buf, buflen) != 0) {
         return -1;
     }
 
@@ -62,7 +89,7 @@ int load_fs(CellFileSystem **fs, void *buf, uint64_t buflen) {
     node->count = *(uint32_t *)buf;
     if (node->count == 0) {
         node->files = NULL;
-        node->start = NULL;
+        node->start = buf + sizeof(node->count);
         newfs->next = *fs;
         newfs->current = node;
         *fs = newfs;
@@ -94,4 +121,28 @@ int ckb_load_fs(void *buf, uint64_t buflen) {
     return ret;
 }
 
+// Remove the file system loaded from `buf` from the mounted ones. Files
+// opened from it still refer to `buf`.
+int unload_fs(CellFileSystem **fs, const void *buf) {
+    for (CellFileSystem **link = fs; link != NULL && *link != NULL;
+         link = &(*link)->next) {
+        CellFileSystemNode *node = (*link)->current;
+        if ((char *)node->start - sizeof(FSEntry) * node->count -
+                sizeof(node->count) ==
+            buf) {
+            CellFileSystem *unloaded = *link;
+            *link = unloaded->next;
+            free(node->files);
+            free(node);
+            free(unloaded);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int ckb_unload_fs(const void *buf) {
+    return unload_fs(&CELL_FILE_SYSTEM, buf);
+}
+
 void ckb_reset_fs() { CELL_FILE_SYSTEM = NULL; }
@@ -40,6 +40,10 @@ int load_fs(CellFileSystem **fs, void *buf, uint64_t buflen);
 
 int ckb_load_fs(void *buf, uint64_t buflen);
 
+int unload_fs(CellFileSystem **fs, const void *buf);
+
+int ckb_unload_fs(const void *buf);
+
 void ckb_reset_fs();
 
 #endif
@@ -0,0 +1,179 @@
+// Allocation profiler of the standalone loader, enabled with -h[bytes] or bit
+// 16 of the lua loader args. It wraps the allocator of the lua state, and
+// attributes allocated bytes to the lua function and line running when they
+// were allocated, found with lua_getinfo.
+//
+// Looking up the line costs more than the allocation itself, so allocations
+// are sampled: once every `bytes` allocated (ALLOC_SAMPLE_BYTES by default),
+// the bytes and allocations since the previous sample are attributed to the
+// line of the current allocation. Totals, the peak of the live heap, and the
+// histogram of allocations by size are exact.
+//
+// When the script ends, including when it runs out of memory, the profile is
+// printed, each line prefixed with "ALLOC ": the totals, the ALLOC_TOP_SITES
+// lines that allocated the most bytes, and the histogram by size.
+//
+// Allocations made by C functions are attributed to the lua function that
+// called them, and allocations made in coroutines to the function resuming
+// them, as the profiler only sees the stack of the main thread.
+
+#define ALLOC_SAMPLE_BYTES 1024
+#define ALLOC_MAX_SITES 256 /* more sites are counted as "other" */
+#define ALLOC_TOP_SITES 10
+#define ALLOC_SIZE_CLASSES 13 /* up to 16 bytes, 32, ..., 32 KiB, more */
+
+typedef struct alloc_site_t {
+    char source[LUA_IDSIZE]; /* empty for a free entry */
+    int line;
+    size_t bytes, count;
+} alloc_site_t;
+
+typedef struct alloc_profiler_t {
+    lua_State *L;
+    lua_Alloc f; /* allocator of the state */
+    void *ud;
+    size_t sample_bytes;
+    size_t pending_bytes, pending_count; /* since the last sample */
+    size_t live, peak, allocs, failed, largest_failed;
+    size_t sizes[ALLOC_SIZE_CLASSES];
+    alloc_site_t sites[ALLOC_MAX_SITES];
+    alloc_site_t other;
+} alloc_profiler_t;
+
+static alloc_profiler_t s_alloc_profiler;
+
+static alloc_site_t *alloc_site(alloc_profiler_t *p, const char *source,
+                                int line) {
+    size_t h = (size_t)line;
+    for (const char *c = source; *c != '\0'; c++) {
+        h = h * 31 + (unsigned char)*c;
+    }
+    for (int i = 0; i < ALLOC_MAX_SITES; i++) {
+        alloc_site_t *s = &p->sites[(h + i) % ALLOC_MAX_SITES];
+        if (s->source[0] == '\0') {
+            strcpy(s->source, source);
+            s->line = line;
+            return s;
+        }
+        if (s->line == line && strcmp(s->source, source) == 0) {
+            return s;
+        }
+    }
+    return &p->other;
+}
+
+static void alloc_sample(alloc_profiler_t *p) {
+    lua_Debug ar;
+    const char *source = "[C]";
+    int line = 0;
+    // The first lua function of the stack: "S" and "l" only read the call
+    // infos, so they are safe while lua is allocating.
+    for (int level = 0; lua_getstack(p->L, level, &ar); level++) {
+        lua_getinfo(p->L, "Sl", &ar);
+        if (ar.currentline >= 0) {
+            source = ar.short_src;
+            line = ar.currentline;
+            break;
+        }
+    }
+    alloc_site_t *s = alloc_site(p, source, line);
+    s->bytes += p->pending_bytes;
+    s->count += p->pending_count;
+    p->pending_bytes = 0;
+    p->pending_count = 0;
+}
+
+static void *alloc_profile(void *ud, void *ptr, size_t osize, size_t nsize) {
+    alloc_profiler_t *p = (alloc_profiler_t *)ud;
+    void *block = p->f(p->ud, ptr, osize, nsize);
+    size_t old = ptr != NULL ? osize : 0;
+    if (nsize == 0) {
+        p->live -= old;
+        return block;
+    }
+    if (block == NULL) {
+        p->failed++;
+        if (nsize > p->largest_failed) {
+            p->largest_failed = nsize;
+        }
+        return NULL;
+    }
+    p->live += nsize - old;
+    if (p->live > p->peak) {
+        p->peak = p->live;
+    }
+    if (nsize > old) {
+        int c = 0;
+        while (c < ALLOC_SIZE_CLASSES - 1 && nsize > ((size_t)16 << c)) {
+            c++;
+        }
+        p->sizes[c]++;
+        p->allocs++;
+        p->pending_bytes += nsize - old;
+        p->pending_count++;
+        if (p->pending_bytes >= p->sample_bytes) {
+            alloc_sample(p);
+        }
+    }
+    return block;
+}
+
+// Profile the allocations of `L`, sampled every `sample_bytes` bytes
+// (ALLOC_SAMPLE_BYTES if 0). Does nothing if it is already profiled.
+static void start_alloc_profile(lua_State *L, size_t sample_bytes) {
+    alloc_profiler_t *p = &s_alloc_profiler;
+    void *ud;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    if (f == alloc_profile) {
+        return;
+    }
+    p->f = f;
+    p->ud = ud;
+    size_t used, peak, size;
+    get_heap_usage(L, &used, &peak, &size);
+    p->L = L;
+    p->sample_bytes = sample_bytes > 0 ? sample_bytes : ALLOC_SAMPLE_BYTES;
+    p->live = used;
+    p->peak = used;
+    lua_setallocf(L, alloc_profile, p);
+}
+
+// Print the allocation profile, see above. Does nothing if the profiler is
+// not running.
+static void finish_alloc_profile(void) {
+    alloc_profiler_t *p = &s_alloc_profiler;
+    if (p->L == NULL) {
+        return;
+    }
+    lua_setallocf(p->L, p->f, p->ud);
+    p->L = NULL;
+    printf("ALLOC live %zu peak %zu allocs %zu failed %zu largest failed %zu\n",
+           p->live, p->peak, p->allocs, p->failed, p->largest_failed);
+    for (int n = 0; n < ALLOC_TOP_SITES; n++) {
+        alloc_site_t *top = NULL;
+        for (int i = 0; i < ALLOC_MAX_SITES; i++) {
+            alloc_site_t *s = &p->sites[i];
+            if (s->bytes > 0 && (top == NULL || s->bytes > top->bytes)) {
+                top = s;
+            }
+        }
+        if (top == NULL) {
+            break;
+        }
+        printf("ALLOC site %s:%d bytes %zu allocs %zu\n", top->source,
+               top->line, top->bytes, top->count);
+        top->bytes = 0;
+    }
+    if (p->other.bytes > 0) {
+        printf("ALLOC site other bytes %zu allocs %zu\n", p->other.bytes,
+               p->other.count);
+    }
+    for (int c = 0; c < ALLOC_SIZE_CLASSES; c++) {
+        if (p->sizes[c] != 0) {
+            printf("ALLOC size %s%zu allocs %zu\n",
+                   c < ALLOC_SIZE_CLASSES - 1 ? "<=" : ">",
+                   (size_t)16 << (c < ALLOC_SIZE_CLASSES - 1 ? c : c - 1),
+                   p->sizes[c]);
+        }
+    }
+}
@@ -2,7 +2,9 @@
 
 int dochunk(lua_State *L, int status);
 
+#ifndef CKB_SIMULATOR
 int exit(int c);
+#endif
 
 FSFile *ckb_must_get_file(char *filename) {
     FSFile *file = 0;
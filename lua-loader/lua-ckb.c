@@ -7,6 +7,7 @@
 #include <stdarg.h>
 
 #include "blockchain.h"
+#include "lua-syscall-record.c"
 
 typedef const char *string;
 typedef int syscall3(void *, uint64_t *, size_t);
@@ -78,22 +79,36 @@ void lua_pushsegment(lua_State *L, mol_seg_t seg) {
 }
 
 int call_syscall(struct syscall_function_t *f, uint8_t *buf) {
+    uint64_t size = f->length != NULL ? *f->length : 0;
+    int ret;
     switch (f->num_extra_arguments) {
         case 1:
-            return f->function.f3(buf, f->length, f->extra_arguments[0]);
+            ret = f->function.f3(buf, f->length, f->extra_arguments[0]);
+            break;
         case 3:
-            return f->function.f5(buf, f->length, f->extra_arguments[0],
-                                  f->extra_arguments[1], f->extra_arguments[2]);
+            ret = f->function.f5(buf, f->length, f->extra_arguments[0],
+                                 f->extra_arguments[1], f->extra_arguments[2]);
+            break;
         case 4:
-            return f->function.f6(buf, f->length, f->extra_arguments[0],
-                                  f->extra_arguments[1], f->extra_arguments[2],
-                                  f->extra_arguments[3]);
+            ret = f->function.f6(buf, f->length, f->extra_arguments[0],
+                                 f->extra_arguments[1], f->extra_arguments[2],
+                                 f->extra_arguments[3]);
+            break;
+        default: {
+            PANIC("invalid number of extra arguments %d",
+                  f->num_extra_arguments);
+            return -1;
+        }
     }
-    PANIC("invalid number of extra arguments %d", f->num_extra_arguments);
-    return -1;
+    trace_syscall(f, buf, size, ret);
+    return ret;
 }
 
-int call_syscall_get_result(BUFFER_T *result, struct syscall_function_t *f) {
+// Run the syscall and store its result into `result`. The buffer of the
+// result is a userdata left on the stack of L, so that it is allocated in the
+// lua heap and collected when it is no longer used.
+int call_syscall_get_result(lua_State *L, BUFFER_T *result,
+                            struct syscall_function_t *f) {
     int ret = 0;
     /* Only obtain the minimal buffer length required */
     if (f->length != NULL && *f->length == 0) {
@@ -105,8 +120,8 @@ int call_syscall_get_result(BUFFER_T *result, struct syscall_function_t *f) {
     }
 
     size_t buflen = 0;
+    uint64_t templen = 0; /* in scope as long as f->length points to it */
     if (f->length == NULL) {
-        size_t templen = 0;
         f->length = &templen;
         ret = call_syscall(f, NULL);
         if (ret != 0) {
@@ -115,14 +130,11 @@ int call_syscall_get_result(BUFFER_T *result, struct syscall_function_t *f) {
     }
     // Save current length, as syscall will update it
     buflen = *f->length;
-    uint8_t *buf = malloc(buflen);
-    if (buf == NULL) {
-        return LUA_ERROR_OUT_OF_MEMORY;
-    }
+    uint8_t *buf = lua_newuserdatauv(L, buflen, 0);
 
     ret = call_syscall(f, buf);
     if (ret != 0) {
-        free(buf);
+        lua_pop(L, 1);
         return ret;
     }
 
@@ -137,7 +149,7 @@ int call_syscall_get_result(BUFFER_T *result, struct syscall_function_t *f) {
 
 int call_syscall_push_result(lua_State *L, struct syscall_function_t *f) {
     BUFFER_T result = {.buffer = NULL, .length = 0};
-    int ret = call_syscall_get_result(&result, f);
+    int ret = call_syscall_get_result(L, &result, f);
     if (ret != 0) {
         lua_pushnil(L);
         lua_pushinteger(L, ret);
@@ -149,7 +161,6 @@ int call_syscall_push_result(lua_State *L, struct syscall_function_t *f) {
         return 2;
     }
     lua_pushlstring(L, (char *)result.buffer, result.length);
-    free(result.buffer);
     lua_pushnil(L);
     return 2;
 }
@@ -673,6 +684,7 @@ int lua_get_int_code(lua_State *L) {
 int lua_ckb_exit(lua_State *L) {
     if (s_lua_exit_enabled) {
         int code = lua_get_int_code(L);
+        print_exit_reports(L);
         ckb_exit(code);
     } else {
         luaL_error(L, "exit in ckb-lua is not enabled");
@@ -689,23 +701,29 @@ int lua_ckb_exit_script(lua_State *L) {
     return lua_error(L);
 }
 
-int ckb_load_fs_from_source_and_index(uint64_t source, uint64_t index) {
-    char *buf = NULL;
-    size_t buflen = 0;
-    int ret = ckb_load_cell_data(NULL, &buflen, 0, index, source);
+// Mount the file system in a cell. Its data are kept in the lua heap as long
+// as the instance lives.
+int ckb_load_fs_from_source_and_index(lua_State *L, uint64_t source,
+                                      uint64_t index) {
+    struct syscall_function_t f = {
+        .num_extra_arguments = 3,
+        .function.f5 = ckb_load_cell_data,
+        .length = NULL,
+    };
+    f.extra_arguments[0] = 0;
+    f.extra_arguments[1] = index;
+    f.extra_arguments[2] = source;
+    BUFFER_T result = {.buffer = NULL, .length = 0};
+    int ret = call_syscall_get_result(L, &result, &f);
     if (ret) {
         return ret;
     }
-    buf = malloc(buflen);
-    if (buf == NULL) {
-        return LUA_ERROR_OUT_OF_MEMORY;
-    }
-    ret = ckb_load_cell_data(buf, &buflen, 0, index, source);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    ret = ckb_load_fs(result.buffer, result.length);
     if (ret) {
-        free(buf);
-        return ret;
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
     }
-    return ckb_load_fs(buf, buflen);
+    return ret;
 }
 
 int lua_ckb_mount(lua_State *L) {
@@ -713,7 +731,7 @@ int lua_ckb_mount(lua_State *L) {
     GET_FIELDS_WITH_CHECK(L, fields, 2, 2);
     int source = fields[0].arg.integer;
     int index = fields[1].arg.integer;
-    int ret = ckb_load_fs_from_source_and_index(source, index);
+    int ret = ckb_load_fs_from_source_and_index(L, source, index);
     if (ret != 0) {
         lua_pushinteger(L, ret);
         return 1;
@@ -748,7 +766,7 @@ int lua_ckb_load_and_unpack_script(lua_State *L) {
         goto fail;
     }
     BUFFER_T result = {.buffer = NULL, .length = 0};
-    ret = call_syscall_get_result(&result, &f);
+    ret = call_syscall_get_result(L, &result, &f);
     if (ret != 0) {
         goto fail;
     }
@@ -845,16 +863,64 @@ int lua_ckb_set_content(lua_State *L) {
     return 1;
 }
 
-int lua_ckb_get_memory_limit(lua_State *L) {
-    int ret = ckb_get_memory_limit();
-    if (ret != 0) {
-        lua_pushinteger(L, ret);
-        return 1;
+// Memory of a VM, and unit of the memory limit of spawned VMs.
+#define CKB_MEMORY_SIZE (4 * 1024 * 1024)
+#define CKB_MEMORY_LIMIT_UNIT (512 * 1024)
+
+// Hash type of the running script, read from the start of the Script table
+// (see MolReader_Script_get_hash_type), or -1 if it can not be loaded.
+static int ckb_script_hash_type(void) {
+    uint8_t script[64];
+    uint64_t len = sizeof(script);
+    if (ckb_load_script(script, &len, 0) != 0 || len < MOL_NUM_T_SIZE * 3) {
+        return -1;
+    }
+    size_t loaded = len < sizeof(script) ? len : sizeof(script);
+    mol_num_t offset = mol_unpack_number(script + MOL_NUM_T_SIZE * 2);
+    return offset < loaded ? script[offset] : -1;
+}
+
+// Bytes of memory the VM was spawned with, or 0 if it has the CKB_MEMORY_SIZE
+// of a script. Only VMs of version 2 have spawn, and ckb_get_memory_limit,
+// which returns units of 512 KiB. Scripts of hash type data and data1 run in
+// VMs of version 0 and 1, the former without even ckb_vm_version, so the
+// syscalls are only made for scripts of hash type type and data2.
+size_t ckb_memory_limit(void) {
+    static int known = 0;
+    static size_t memory_limit = 0;
+    if (!known) {
+        int hash_type = ckb_script_hash_type();
+        if ((hash_type == 1 || hash_type == 4) && ckb_vm_version() >= 2) {
+            int units = ckb_get_memory_limit();
+            memory_limit =
+                units > 0 ? (size_t)units * CKB_MEMORY_LIMIT_UNIT : 0;
+        }
+        known = 1;
     }
-    lua_pushnil(L);
+    return memory_limit;
+}
+
+int lua_ckb_get_memory_limit(lua_State *L) {
+    size_t memory_limit = ckb_memory_limit();
+    lua_pushinteger(L, (lua_Integer)(memory_limit > 0 ? memory_limit
+                                                      : CKB_MEMORY_SIZE));
     return 1;
 }
 
+int lua_ckb_current_cycles(lua_State *L) {
+    lua_pushinteger(L, (lua_Integer)ckb_current_cycles());
+    return 1;
+}
+
+int lua_ckb_get_heap_usage(lua_State *L) {
+    size_t used, peak, size;
+    get_heap_usage(L, &used, &peak, &size);
+    lua_pushinteger(L, (lua_Integer)used);
+    lua_pushinteger(L, (lua_Integer)peak);
+    lua_pushinteger(L, (lua_Integer)size);
+    return 3;
+}
+
 static const luaL_Reg ckb_syscall[] = {
     {"dump", lua_ckb_dump},
     {"exit", lua_ckb_exit},
@@ -887,11 +953,15 @@ static const luaL_Reg ckb_syscall[] = {
     {"spawn_cell", lua_ckb_spawn_cell},
     {"set_content", lua_ckb_set_content},
     {"get_memory_limit", lua_ckb_get_memory_limit},
+    {"get_heap_usage", lua_ckb_get_heap_usage},
+    {"current_cycles", lua_ckb_current_cycles},
+    {"heap_snapshot", lua_ckb_heap_snapshot},
     {NULL, NULL}};
 
 LUAMOD_API int luaopen_ckb(lua_State *L) {
     // create ckb table
     luaL_newlib(L, ckb_syscall);
+    open_perf(L);
 
     SET_FIELD(L, CKB_SUCCESS, "SUCCESS")
     SET_FIELD(L, CKB_INDEX_OUT_OF_BOUND, "INDEX_OUT_OF_BOUND")
@@ -15,4 +15,20 @@
 const char *CKB_RETURN_CODE_KEY = "_ckb_return_code";
 
 static int s_lua_exit_enabled = 0;
+
+// Store the bytes used by the lua heap of `L`, the most it has used, and its
+// size, or 0 for the ones that are not known. Defined in lua-loader.c.
+static void get_heap_usage(lua_State *L, size_t *used, size_t *peak,
+                           size_t *size);
+// Print the reports asked for before the script exits: profiles, heap
+// snapshot, perf counters of `L` (if not NULL). Defined in lua-loader.c.
+static void print_exit_reports(lua_State *L);
+// Add table perf to the table on the top of the stack. Defined in lua-perf.c.
+static void open_perf(lua_State *L);
+// Defined in lua-heap-snapshot.c.
+static int lua_ckb_heap_snapshot(lua_State *L);
+// Count a syscall made by call_syscall. Defined in lua-syscall-trace.c.
+struct syscall_function_t;
+static void trace_syscall(const struct syscall_function_t *f, const void *buf,
+                          uint64_t size, int ret);
 #endif
@@ -0,0 +1,166 @@
+// Heap snapshot of a lua state, returned by ckb.heap_snapshot() and printed
+// when the script ends with -d or bit 32 of the lua loader args. It is a text
+// meant to be diffed between releases, giving the objects and bytes of each
+// type, then the bytes retained by the largest roots:
+//
+//   type table 310 40960
+//   type string 2801 98304
+//   total 4520 190000
+//   root _G.msgpack 25000
+//   root registry._CLIBS 120
+//   root other 3500
+//
+// A full collection runs first, so that only live objects are counted. The
+// roots are the fields of _G, then of package.loaded, then of the registry,
+// and an object is retained by the first root that reaches it, so that the
+// roots split the heap between them. "other" is what no root reaches, such
+// as the names of metamethods and reserved words. Only the HEAP_TOP_ROOTS
+// largest roots are listed.
+
+#define HEAP_TOP_ROOTS 16
+#define HEAP_ROOT_NAME_SIZE 48
+
+typedef struct heap_root_t {
+    char name[HEAP_ROOT_NAME_SIZE];
+    size_t bytes;
+} heap_root_t;
+
+typedef struct heap_snapshot_t {
+    heap_root_t roots[HEAP_TOP_ROOTS]; /* largest first once sorted */
+    int nroots;
+    size_t reached; /* bytes retained by all the roots */
+} heap_snapshot_t;
+
+static lua_State *s_heap_snapshot_state = NULL;
+
+// Keep the root with key at index -2 in `table`, if among the largest.
+static void heap_add_root(lua_State *L, heap_snapshot_t *s, const char *table,
+                          size_t bytes) {
+    heap_root_t *root = &s->roots[s->nroots];
+    if (s->nroots < HEAP_TOP_ROOTS) {
+        s->nroots++;
+    } else {
+        root = &s->roots[0];
+        for (int i = 1; i < HEAP_TOP_ROOTS; i++) {
+            if (s->roots[i].bytes < root->bytes) {
+                root = &s->roots[i];
+            }
+        }
+        if (bytes <= root->bytes) {
+            return;
+        }
+    }
+    root->bytes = bytes;
+    if (lua_type(L, -2) == LUA_TSTRING) {
+        snprintf_(root->name, HEAP_ROOT_NAME_SIZE, "%s.%s", table,
+                  lua_tostring(L, -2));
+    } else if (lua_isinteger(L, -2)) {
+        snprintf_(root->name, HEAP_ROOT_NAME_SIZE, "%s.[%ld]", table,
+                  (long)lua_tointeger(L, -2));
+    } else {
+        snprintf_(root->name, HEAP_ROOT_NAME_SIZE, "%s.[%s]", table,
+                  luaL_typename(L, -2));
+    }
+}
+
+// Walk the fields of the table on the top of the stack, and pop it.
+static void heap_walk_roots(lua_State *L, heap_snapshot_t *s,
+                            const char *table) {
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        size_t bytes = lua_heapwalk(L, 1);
+        lua_pushvalue(L, -2);
+        bytes += lua_heapwalk(L, 1);
+        lua_pop(L, 1);
+        if (bytes > 0) {
+            s->reached += bytes;
+            heap_add_root(L, s, table, bytes);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+static int lua_ckb_heap_snapshot(lua_State *L) {
+    size_t counts[LUA_HEAPTYPES], bytes[LUA_HEAPTYPES];
+    size_t count = 0, total = 0;
+    heap_snapshot_t s;
+    s.nroots = 0;
+    s.reached = 0;
+    lua_gc(L, LUA_GCCOLLECT);
+    lua_heapcount(L, counts, bytes);
+    // The tables themselves first, so that they are not retained by one of
+    // their fields.
+    lua_pushvalue(L, LUA_REGISTRYINDEX);
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+    lua_pushglobaltable(L);
+    for (int i = 1; i <= 3; i++) {
+        lua_pushvalue(L, -i);
+        s.reached += lua_heapwalk(L, 0);
+        lua_pop(L, 1);
+    }
+    heap_walk_roots(L, &s, "_G");
+    heap_walk_roots(L, &s, "package.loaded");
+    heap_walk_roots(L, &s, "registry");
+    lua_heapwalkend(L);
+
+    luaL_Buffer b;
+    char line[HEAP_ROOT_NAME_SIZE + 64];
+    luaL_buffinit(L, &b);
+    for (int t = 0; t < LUA_HEAPTYPES; t++) {
+        if (counts[t] == 0) {
+            continue;
+        }
+        snprintf_(line, sizeof(line), "type %s %zu %zu\n",
+                  t < LUA_NUMTYPES ? lua_typename(L, t)
+                  : t == LUA_NUMTYPES ? "upvalue"
+                                      : "proto",
+                  counts[t], bytes[t]);
+        luaL_addstring(&b, line);
+        count += counts[t];
+        total += bytes[t];
+    }
+    snprintf_(line, sizeof(line), "total %zu %zu\n", count, total);
+    luaL_addstring(&b, line);
+    while (s.nroots > 0) {
+        heap_root_t *root = &s.roots[0];
+        for (int i = 1; i < s.nroots; i++) {
+            if (s.roots[i].bytes > root->bytes) {
+                root = &s.roots[i];
+            }
+        }
+        snprintf_(line, sizeof(line), "root %s %zu\n", root->name,
+                  root->bytes);
+        luaL_addstring(&b, line);
+        *root = s.roots[--s.nroots];
+    }
+    snprintf_(line, sizeof(line), "root other %zu\n",
+              total > s.reached ? total - s.reached : 0);
+    luaL_addstring(&b, line);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static void start_heap_snapshot(lua_State *L) { s_heap_snapshot_state = L; }
+
+// Print the heap snapshot, each line prefixed with "HEAP ", if asked to.
+static void finish_heap_snapshot(void) {
+    lua_State *L = s_heap_snapshot_state;
+    if (L == NULL) {
+        return;
+    }
+    s_heap_snapshot_state = NULL;
+    lua_pushcfunction(L, lua_ckb_heap_snapshot);
+    if (lua_pcall(L, 0, 1, 0) != LUA_OK) {
+        printf("Error while taking heap snapshot: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return;
+    }
+    const char *text = lua_tostring(L, -1);
+    while (*text != '\0') {
+        const char *end = strchr(text, '\n');
+        printf("HEAP %.*s\n", (int)(end - text), text);
+        text = end + 1;
+    }
+    lua_pop(L, 1);
+}
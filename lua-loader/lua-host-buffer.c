@@ -0,0 +1,161 @@
+// Byte views of host memory, created by lua_push_host_buffer. A view refers
+// to the memory of the host program, which is read (and written, unless the
+// view is readonly) in place, so the host must keep it alive while the view is
+// used.
+
+#define HOST_BUFFER_METATABLE "ckb.host_buffer"
+
+typedef struct {
+    uint8_t *ptr;
+    size_t len;
+    int readonly;
+} host_buffer_t;
+
+static host_buffer_t *check_host_buffer(lua_State *L) {
+    return luaL_checkudata(L, 1, HOST_BUFFER_METATABLE);
+}
+
+// Check that `size` bytes at the 1-based offset in argument 2 are in the view,
+// and return a pointer to them.
+static uint8_t *host_buffer_at(lua_State *L, host_buffer_t *hb, size_t size) {
+    lua_Integer offset = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, offset >= 1 && (size_t)(offset - 1) <= hb->len &&
+                         size <= hb->len - (size_t)(offset - 1),
+                  2, "out of bounds");
+    return hb->ptr + (offset - 1);
+}
+
+// Read a little endian integer of `size` bytes, sign extended if `is_signed`.
+static int host_buffer_read(lua_State *L, size_t size, int is_signed) {
+    host_buffer_t *hb = check_host_buffer(L);
+    const uint8_t *p = host_buffer_at(L, hb, size);
+    uint64_t v = 0;
+    for (size_t i = size; i > 0; i--) {
+        v = (v << 8) | p[i - 1];
+    }
+    if (is_signed && size < 8 && (v >> (size * 8 - 1)) != 0) {
+        v |= ~(uint64_t)0 << (size * 8);
+    }
+    lua_pushinteger(L, (lua_Integer)v);
+    return 1;
+}
+
+static int host_buffer_u8(lua_State *L) { return host_buffer_read(L, 1, 0); }
+static int host_buffer_u16(lua_State *L) { return host_buffer_read(L, 2, 0); }
+static int host_buffer_u32(lua_State *L) { return host_buffer_read(L, 4, 0); }
+static int host_buffer_u64(lua_State *L) { return host_buffer_read(L, 8, 0); }
+static int host_buffer_i8(lua_State *L) { return host_buffer_read(L, 1, 1); }
+static int host_buffer_i16(lua_State *L) { return host_buffer_read(L, 2, 1); }
+static int host_buffer_i32(lua_State *L) { return host_buffer_read(L, 4, 1); }
+static int host_buffer_i64(lua_State *L) { return host_buffer_read(L, 8, 1); }
+
+static int host_buffer_len(lua_State *L) {
+    host_buffer_t *hb = check_host_buffer(L);
+    lua_pushinteger(L, (lua_Integer)hb->len);
+    return 1;
+}
+
+// view:sub(i [, j]) copies bytes i to j to a string, like string.sub.
+static int host_buffer_sub(lua_State *L) {
+    host_buffer_t *hb = check_host_buffer(L);
+    lua_Integer len = (lua_Integer)hb->len;
+    lua_Integer i = luaL_checkinteger(L, 2);
+    lua_Integer j = luaL_optinteger(L, 3, -1);
+    if (i < 0) i = i < -len ? 1 : len + i + 1;
+    if (i == 0) i = 1;
+    if (j < 0) j = j < -len ? 0 : len + j + 1;
+    if (j > len) j = len;
+    if (i > j) {
+        lua_pushliteral(L, "");
+    } else {
+        lua_pushlstring(L, (const char *)hb->ptr + (i - 1),
+                        (size_t)(j - i + 1));
+    }
+    return 1;
+}
+
+// view:write(i, s) copies the string s to the view at offset i.
+static int host_buffer_write(lua_State *L) {
+    host_buffer_t *hb = check_host_buffer(L);
+    size_t size;
+    const char *s = luaL_checklstring(L, 3, &size);
+    if (hb->readonly) {
+        return luaL_error(L, "host buffer is readonly");
+    }
+    memcpy(host_buffer_at(L, hb, size), s, size);
+    return 0;
+}
+
+// view[i] is the byte at offset i, or nil if i is out of bounds.
+static int host_buffer_index(lua_State *L) {
+    host_buffer_t *hb = check_host_buffer(L);
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        lua_Integer i = luaL_checkinteger(L, 2);
+        if (i >= 1 && (lua_Unsigned)i <= hb->len) {
+            lua_pushinteger(L, hb->ptr[i - 1]);
+        } else {
+            lua_pushnil(L);
+        }
+        return 1;
+    }
+    lua_getmetatable(L, 1);
+    lua_getfield(L, -1, "methods");
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    return 1;
+}
+
+static int host_buffer_newindex(lua_State *L) {
+    host_buffer_t *hb = check_host_buffer(L);
+    lua_Integer v = luaL_checkinteger(L, 3);
+    if (hb->readonly) {
+        return luaL_error(L, "host buffer is readonly");
+    }
+    luaL_argcheck(L, v >= 0 && v <= 0xff, 3, "not a byte");
+    *host_buffer_at(L, hb, 1) = (uint8_t)v;
+    return 0;
+}
+
+static int host_buffer_tostring(lua_State *L) {
+    host_buffer_t *hb = check_host_buffer(L);
+    lua_pushfstring(L, "host buffer (%p, %I bytes)", hb->ptr,
+                    (lua_Integer)hb->len);
+    return 1;
+}
+
+static const luaL_Reg host_buffer_methods[] = {
+    {"len", host_buffer_len},     {"sub", host_buffer_sub},
+    {"write", host_buffer_write}, {"u8", host_buffer_u8},
+    {"u16", host_buffer_u16},     {"u32", host_buffer_u32},
+    {"u64", host_buffer_u64},     {"i8", host_buffer_i8},
+    {"i16", host_buffer_i16},     {"i32", host_buffer_i32},
+    {"i64", host_buffer_i64},     {NULL, NULL}};
+
+static const luaL_Reg host_buffer_metamethods[] = {
+    {"__index", host_buffer_index},
+    {"__newindex", host_buffer_newindex},
+    {"__len", host_buffer_len},
+    {"__tostring", host_buffer_tostring},
+    {NULL, NULL}};
+
+// Create a view of the host memory (ptr, len, readonly) in arguments 1 to 3,
+// and set it as the global named by argument 4 if it is not nil.
+static int new_host_buffer(lua_State *L) {
+    host_buffer_t *hb = lua_newuserdatauv(L, sizeof(host_buffer_t), 0);
+    hb->ptr = lua_touserdata(L, 1);
+    hb->len = (size_t)lua_tointeger(L, 2);
+    hb->readonly = lua_toboolean(L, 3);
+    if (luaL_newmetatable(L, HOST_BUFFER_METATABLE)) {
+        luaL_setfuncs(L, host_buffer_metamethods, 0);
+        luaL_newlib(L, host_buffer_methods);
+        lua_setfield(L, -2, "methods");
+        lua_pushliteral(L, "host buffer");
+        lua_setfield(L, -2, "__metatable");
+    }
+    lua_setmetatable(L, -2);
+    if (!lua_isnil(L, 4)) {
+        lua_pushvalue(L, -1);
+        lua_setglobal(L, lua_touserdata(L, 4));
+    }
+    return 1;
+}
@@ -0,0 +1,81 @@
+// Native functions of the host program, registered by
+// lua_register_host_function. They use a calling convention that does not
+// depend on lua: every argument is passed as a buffer, and the result is
+// written to a buffer.
+//
+//   int fn(int nargs, const void *const *args, const size_t *arg_sizes,
+//          void *result, size_t *result_size);
+//
+// Strings and host buffers are passed in place, integers as 8 bytes little
+// endian. On input, `*result_size` is the size of `result`; `fn` sets it to
+// the size of its result, and returns 0. In lua, the function returns the
+// result as a string, or nil and the error code returned by `fn`.
+
+#define HOST_FUNCTION_MAX_ARGS 16
+
+typedef int (*host_function_t)(int nargs, const void *const *args,
+                               const size_t *arg_sizes, void *result,
+                               size_t *result_size);
+
+static int call_host_function(lua_State *L) {
+    host_function_t fn =
+        (host_function_t)lua_touserdata(L, lua_upvalueindex(1));
+    int nargs = lua_gettop(L);
+    const void *args[HOST_FUNCTION_MAX_ARGS];
+    size_t arg_sizes[HOST_FUNCTION_MAX_ARGS];
+    int64_t integers[HOST_FUNCTION_MAX_ARGS];
+    luaL_argcheck(L, nargs <= HOST_FUNCTION_MAX_ARGS,
+                  HOST_FUNCTION_MAX_ARGS + 1, "too many arguments");
+    for (int i = 0; i < nargs; i++) {
+        host_buffer_t *hb;
+        if (lua_type(L, i + 1) == LUA_TSTRING) {
+            args[i] = lua_tolstring(L, i + 1, &arg_sizes[i]);
+        } else if (lua_isinteger(L, i + 1)) {
+            integers[i] = lua_tointeger(L, i + 1);
+            args[i] = &integers[i];
+            arg_sizes[i] = sizeof(int64_t);
+        } else if ((hb = luaL_testudata(L, i + 1, HOST_BUFFER_METATABLE))) {
+            args[i] = hb->ptr;
+            arg_sizes[i] = hb->len;
+        } else {
+            return luaL_typeerror(L, i + 1, "string, integer or host buffer");
+        }
+    }
+    // The result is written to the buffer's initial storage, which is on the
+    // C stack, so that small results are not allocated twice.
+    luaL_Buffer b;
+    void *result = luaL_buffinitsize(L, &b, LUAL_BUFFERSIZE);
+    size_t result_size = LUAL_BUFFERSIZE;
+    int ret = fn(nargs, args, arg_sizes, result, &result_size);
+    if (ret != 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L, ret);
+        return 2;
+    }
+    if (result_size > LUAL_BUFFERSIZE) {
+        return luaL_error(L, "host function result too large");
+    }
+    luaL_pushresultsize(&b, result_size);
+    return 1;
+}
+
+// Set the host function (fn, name, module) in arguments 1 to 3. Functions
+// without a module are globals; otherwise they are fields of the global table
+// `module`, or of the loaded module `module`, which is created if needed.
+static int register_host_function(lua_State *L) {
+    const char *name = lua_touserdata(L, 2);
+    const char *module = lua_touserdata(L, 3);
+    if (module == NULL) {
+        lua_pushglobaltable(L);
+    } else if (lua_getglobal(L, module) != LUA_TTABLE) {
+        luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+        if (!luaL_getsubtable(L, -1, module)) {
+            lua_pushvalue(L, -1);
+            lua_setglobal(L, module);
+        }
+    }
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, call_host_function, 1);
+    lua_setfield(L, -2, name);
+    return 0;
+}
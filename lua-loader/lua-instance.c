@@ -0,0 +1,356 @@
+// Instances of the shared library. Each instance owns the memory [min, max)
+// passed to lua_create_instance, which holds an instance_t header, the lua
+// heap, and at its end a small heap for the library malloc, which serves the
+// allocations made outside of lua (opened files, mounted file systems).
+//
+// The lua heap is a region allocator used as the lua_Alloc of the instance.
+// As lua passes the size of the blocks it frees, blocks have no header: free
+// blocks of up to REGION_SMALL_MAX bytes are kept in lists by size, and larger
+// ones in a list sorted by address, where they are merged with their
+// neighbours. New blocks are cut from the top of the region.
+
+#define REGION_ALIGN 16
+#define REGION_SMALL_MAX 256
+#define REGION_SMALL_CLASSES (REGION_SMALL_MAX / REGION_ALIGN)
+// One in REGION_MALLOC_SHARE bytes of an instance goes to the library malloc.
+#define REGION_MALLOC_SHARE 32
+
+typedef struct region_block_t {
+    size_t size;
+    struct region_block_t *next;
+} region_block_t;
+
+typedef struct region_t {
+    char *top;   /* start of the memory never allocated */
+    char *limit; /* end of the region */
+    size_t used; /* bytes allocated */
+    size_t peak; /* highest value of 'used' */
+    size_t cap;  /* limit of 'used' */
+    region_block_t *small[REGION_SMALL_CLASSES]; /* free blocks by size */
+    region_block_t *large; /* larger free blocks, by decreasing address */
+} region_t;
+
+static size_t region_round(size_t n) {
+    return (n + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+}
+
+// Give back free blocks at the top of the region.
+static void region_trim(region_t *r) {
+    while (r->large != NULL &&
+           (char *)r->large + r->large->size == r->top) {
+        r->top = (char *)r->large;
+        r->large = r->large->next;
+    }
+}
+
+static void region_insert_large(region_t *r, char *p, size_t n) {
+    region_block_t **link = &r->large, **above = NULL, *b;
+    while (*link != NULL && (char *)*link > p) {
+        above = link;
+        link = &(*link)->next;
+    }
+    if (*link != NULL && (char *)*link + (*link)->size == p) {
+        b = *link; /* merge with the block below */
+        b->size += n;
+    } else {
+        b = (region_block_t *)p;
+        b->size = n;
+        b->next = *link;
+        *link = b;
+    }
+    if (above != NULL && (char *)b + b->size == (char *)*above) {
+        b->size += (*above)->size; /* merge with the block above */
+        *above = b;
+    }
+}
+
+// Free the block of `n` bytes (a multiple of REGION_ALIGN) at `p`.
+static void region_release(region_t *r, char *p, size_t n) {
+    if (p + n == r->top) {
+        r->top = p;
+        region_trim(r);
+    } else if (n <= REGION_SMALL_MAX) {
+        region_block_t *b = (region_block_t *)p;
+        b->next = r->small[n / REGION_ALIGN - 1];
+        r->small[n / REGION_ALIGN - 1] = b;
+    } else {
+        region_insert_large(r, p, n);
+    }
+}
+
+static void *region_take_large(region_t *r, size_t n) {
+    for (region_block_t **link = &r->large; *link != NULL;
+         link = &(*link)->next) {
+        region_block_t *b = *link;
+        if (b->size > n) { /* cut the block from its end */
+            b->size -= n;
+            return (char *)b + b->size;
+        } else if (b->size == n) {
+            *link = b->next;
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void *region_take(region_t *r, size_t n) {
+    region_block_t *b;
+    if (n <= REGION_SMALL_MAX && (b = r->small[n / REGION_ALIGN - 1])) {
+        r->small[n / REGION_ALIGN - 1] = b->next;
+        return b;
+    }
+    if (n > REGION_SMALL_MAX && (b = region_take_large(r, n))) {
+        return b;
+    }
+    if ((size_t)(r->limit - r->top) >= n) {
+        b = (region_block_t *)r->top;
+        r->top += n;
+        return b;
+    }
+    return n <= REGION_SMALL_MAX ? region_take_large(r, n) : NULL;
+}
+
+static region_block_t *region_sort(region_block_t *list) {
+    region_block_t *slow = list, *fast, *other, *sorted = NULL,
+                   **tail = &sorted;
+    if (list == NULL || list->next == NULL) {
+        return list;
+    }
+    for (fast = list->next; fast != NULL && fast->next != NULL;
+         fast = fast->next->next) {
+        slow = slow->next;
+    }
+    other = slow->next;
+    slow->next = NULL;
+    list = region_sort(list);
+    other = region_sort(other);
+    while (list != NULL && other != NULL) {
+        region_block_t **first = list > other ? &list : &other;
+        *tail = *first;
+        tail = &(*first)->next;
+        *first = (*first)->next;
+    }
+    *tail = list != NULL ? list : other;
+    return sorted;
+}
+
+// Merge all adjacent free blocks, small ones included, when the region is
+// too fragmented to serve an allocation.
+static void region_compact(region_t *r) {
+    region_block_t *all = r->large;
+    for (int i = 0; i < REGION_SMALL_CLASSES; i++) {
+        while (r->small[i] != NULL) {
+            region_block_t *b = r->small[i];
+            r->small[i] = b->next;
+            b->size = (size_t)(i + 1) * REGION_ALIGN;
+            b->next = all;
+            all = b;
+        }
+    }
+    all = region_sort(all);
+    r->large = NULL;
+    region_block_t **tail = &r->large;
+    while (all != NULL) {
+        region_block_t *b = all;
+        all = all->next;
+        while (all != NULL && (char *)all + all->size == (char *)b) {
+            all->size += b->size; /* b is right above all */
+            b = all;
+            all = all->next;
+        }
+        if (b->size <= REGION_SMALL_MAX) {
+            b->next = r->small[b->size / REGION_ALIGN - 1];
+            r->small[b->size / REGION_ALIGN - 1] = b;
+        } else {
+            *tail = b;
+            tail = &b->next;
+        }
+    }
+    *tail = NULL;
+    region_trim(r);
+}
+
+static void *region_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    region_t *r = (region_t *)ud;
+    size_t on = ptr == NULL ? 0 : region_round(osize);
+    size_t nn = region_round(nsize);
+    if (nsize == 0) {
+        if (ptr != NULL) {
+            region_release(r, ptr, on);
+            r->used -= on;
+        }
+        return NULL;
+    }
+    if (nn <= on) { /* shrink in place */
+        if (nn < on) {
+            region_release(r, (char *)ptr + nn, on - nn);
+            r->used -= on - nn;
+        }
+        return ptr;
+    }
+    if (r->used + (nn - on) > r->cap) {
+        return NULL;
+    }
+    if (ptr != NULL && (char *)ptr + on == r->top &&
+        (size_t)(r->limit - r->top) >= nn - on) {
+        r->top += nn - on; /* grow in place */
+    } else {
+        void *block = region_take(r, nn);
+        if (block == NULL) {
+            region_compact(r);
+            block = region_take(r, nn);
+            if (block == NULL) {
+                return NULL;
+            }
+        }
+        if (ptr != NULL) {
+            memcpy(block, ptr, osize);
+            region_release(r, ptr, on);
+        }
+        ptr = block;
+    }
+    r->used += nn - on;
+    if (r->used > r->peak) {
+        r->peak = r->used;
+    }
+    return ptr;
+}
+
+// Library globals that each instance has its own copy of. The ones of the
+// running instance are live, the others are saved in their instance_t.
+typedef struct instance_t {
+    region_t heap;
+    struct {
+        uintptr_t program_break, brk_min, brk_max;
+        __typeof__(mal) mal;
+    } malloc_state;
+    CellFileSystem *fs;
+    int exit_enabled;
+    // Copy of the instance recorded by instance_checkpoint. The used memory of
+    // the lua heap and of the library malloc is copied to `data`, at the end
+    // of the lua heap.
+    struct {
+        char *data; /* NULL if there is no checkpoint */
+        size_t heap_size, malloc_size;
+        region_t heap;
+        uintptr_t program_break;
+        __typeof__(mal) mal;
+        CellFileSystem *fs;
+        int exit_enabled;
+    } checkpoint;
+} instance_t;
+
+static instance_t *s_current_instance = NULL;
+
+static char *instance_heap_base(instance_t *instance) {
+    return (char *)instance + region_round(sizeof(instance_t));
+}
+
+// Lay out an instance in [min, max), or return NULL if it is too small.
+static instance_t *instance_new(uintptr_t min, uintptr_t max) {
+    uintptr_t base = region_round(min);
+    if (max < base || max - base < sizeof(instance_t) * 2) {
+        return NULL;
+    }
+    uintptr_t malloc_base =
+        (max - (max - base) / REGION_MALLOC_SHARE) & ~(uintptr_t)15;
+    instance_t *instance = (instance_t *)base;
+    memset(instance, 0, sizeof(instance_t));
+    instance->heap.top = instance_heap_base(instance);
+    instance->heap.limit = (char *)malloc_base;
+    instance->heap.cap = instance->heap.limit - instance->heap.top;
+    instance->malloc_state.brk_min = malloc_base;
+    instance->malloc_state.brk_max = max;
+    return instance;
+}
+
+// Make `instance` the running instance, switching the library globals.
+static void instance_enter(instance_t *instance) {
+    instance_t *current = s_current_instance;
+    if (instance == current) {
+        return;
+    }
+    if (current != NULL) {
+        current->malloc_state.program_break = s_program_break;
+        current->malloc_state.brk_min = s_brk_min;
+        current->malloc_state.brk_max = s_brk_max;
+        current->malloc_state.mal = mal;
+        current->fs = CELL_FILE_SYSTEM;
+        current->exit_enabled = s_lua_exit_enabled;
+    }
+    s_program_break = instance->malloc_state.program_break;
+    s_brk_min = instance->malloc_state.brk_min;
+    s_brk_max = instance->malloc_state.brk_max;
+    mal = instance->malloc_state.mal;
+    CELL_FILE_SYSTEM = instance->fs;
+    s_lua_exit_enabled = instance->exit_enabled;
+    s_current_instance = instance;
+}
+
+// Forget the running instance, whose memory is given back to the host.
+static void instance_leave(void) {
+    memset(&mal, 0, sizeof(mal));
+    malloc_config(0, 0);
+    CELL_FILE_SYSTEM = NULL;
+    s_lua_exit_enabled = 0;
+    s_current_instance = NULL;
+}
+
+// Record the state of the running `instance`, replacing its previous
+// checkpoint. Returns 0, or -1 if the heap has no room for the copy.
+static int instance_checkpoint(instance_t *instance) {
+    region_t *r = &instance->heap;
+    char *base = instance_heap_base(instance);
+    r->limit = (char *)s_brk_min; /* drop the previous copy */
+    instance->checkpoint.data = NULL;
+    size_t heap_size = r->top - base;
+    size_t malloc_size = s_program_break ? s_program_break - s_brk_min : 0;
+    size_t size = region_round(heap_size + malloc_size);
+    if ((size_t)(r->limit - r->top) < size) {
+        return -1;
+    }
+    r->limit -= size;
+    if (r->cap > (size_t)(r->limit - base)) {
+        r->cap = r->limit - base;
+    }
+    memcpy(r->limit, base, heap_size);
+    memcpy(r->limit + heap_size, (void *)s_brk_min, malloc_size);
+    instance->checkpoint.data = r->limit;
+    instance->checkpoint.heap_size = heap_size;
+    instance->checkpoint.malloc_size = malloc_size;
+    instance->checkpoint.heap = *r;
+    instance->checkpoint.program_break = s_program_break;
+    instance->checkpoint.mal = mal;
+    instance->checkpoint.fs = CELL_FILE_SYSTEM;
+    instance->checkpoint.exit_enabled = s_lua_exit_enabled;
+    return 0;
+}
+
+// Bring the running `instance` back to its checkpoint. Only the memory used
+// at that time is copied back: what was allocated since is above the restored
+// top of the heap, or in free blocks. The peak usage and the cap are kept.
+// Returns 0, or -1 if there is no checkpoint.
+static int instance_reset(instance_t *instance) {
+    region_t *r = &instance->heap;
+    if (instance->checkpoint.data == NULL) {
+        return -1;
+    }
+    size_t peak = r->peak, cap = r->cap;
+    *r = instance->checkpoint.heap;
+    r->peak = peak;
+    r->cap = cap;
+    memcpy(instance_heap_base(instance), instance->checkpoint.data,
+           instance->checkpoint.heap_size);
+    memcpy((void *)s_brk_min,
+           instance->checkpoint.data + instance->checkpoint.heap_size,
+           instance->checkpoint.malloc_size);
+    s_program_break = instance->checkpoint.program_break;
+    mal = instance->checkpoint.mal;
+    CELL_FILE_SYSTEM = instance->checkpoint.fs;
+    s_lua_exit_enabled = instance->checkpoint.exit_enabled;
+    return 0;
+}
+
+static instance_t *instance_of(lua_State *L) {
+    return *(instance_t **)lua_getextraspace(L);
+}
@@ -8,6 +8,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef CKB_SIMULATOR
+#include "lua-simulator.h"
+#endif
+
 #include "lauxlib.h"
 #include "lprefix.h"
 #include "lua.h"
@@ -17,6 +21,16 @@
 #include "lua-ckb.c"
 
 #include "lua-cell-fs.c"
+#include "lua-host-buffer.c"
+#include "lua-host-function.c"
+#include "lua-instance.c"
+#include "lua-pool.c"
+#include "lua-profiler.c"
+#include "lua-perf.c"
+#include "lua-alloc-profiler.c"
+#include "lua-heap-snapshot.c"
+#include "lua-syscall-trace.c"
+#include "lua-opcount.c"
 
 #include "blockchain.h"
 #include "ckb_syscalls.h"
@@ -24,15 +38,57 @@
 #define LUA_LOADER_ARGS_SIZE 2
 #define BLAKE2B_BLOCK_SIZE 32
 
+/*
+** The lua loader args are 2 bytes: the first holds these bits, the second is
+** the percentage of the heap allocated in bump mode (0 for the default of
+** lua-pool.c).
+*/
+#define LUA_LOADER_ARGS_IMAGE 1   /* initialized state from a heap image */
+#define LUA_LOADER_ARGS_LAZY 2    /* compile function bodies on first use */
+#define LUA_LOADER_ARGS_BUMP 4    /* collect no garbage, see lua-pool.c */
+#define LUA_LOADER_ARGS_PROFILE 8 /* print a cycle profile, lua-profiler.c */
+/* print an allocation profile, see lua-alloc-profiler.c */
+#define LUA_LOADER_ARGS_ALLOC_PROFILE 16
+/* print a heap snapshot, see lua-heap-snapshot.c */
+#define LUA_LOADER_ARGS_HEAP_SNAPSHOT 32
+/* count the syscalls of the ckb module, see lua-syscall-trace.c */
+#define LUA_LOADER_ARGS_SYSCALL_TRACE 64
+/* record the syscalls to replay them, see lua-syscall-record.c */
+#define LUA_LOADER_ARGS_SYSCALL_RECORD 128
+
+/* scratch memory used to build a heap image */
+#define LUA_IMAGE_SCRATCH_SIZE (1024 * 512)
+
+/* print the statistics of the pool allocator at exit, see -m */
+static int s_print_pool_stats = 0;
+
+static void print_exit_reports(lua_State *L) {
+    finish_profile();
+    finish_alloc_profile();
+    finish_heap_snapshot();
+    finish_syscall_trace();
+    print_perf(L);
+    print_opcount();
+    if (s_print_pool_stats) {
+        s_print_pool_stats = 0;
+        print_pool_stats(&s_pool);
+    }
+}
+
+#ifndef CKB_SIMULATOR
 int exit(int c) {
+    print_exit_reports(NULL);
     ckb_exit(c);
     return 0;
 }
+#endif
 void enable_local_access(int b);
 void enable_fs_access(int b);
 int fs_access_enabled();
 
+#ifndef CKB_SIMULATOR
 void abort() { ckb_exit(-1); }
+#endif
 
 #if !defined(LUA_PROGNAME)
 #define LUA_PROGNAME "lua"
@@ -193,9 +249,15 @@ static int dostring(lua_State *L, const char *s, const char *name) {
     return dochunk(L, luaL_loadbuffer(L, s, strlen(s), name));
 }
 
-int load_lua_code(lua_State *L, char *buf, size_t buflen) {
+// The cell data in 'buf' is never freed, so bytecode is loaded in place
+// (mode "B"), without copying code and strings to the lua heap, and the
+// source of functions can be kept to compile them on first use (mode "L").
+int load_lua_code(lua_State *L, uint16_t lua_loader_args, char *buf,
+                  size_t buflen) {
+    const char *mode =
+        (lua_loader_args & LUA_LOADER_ARGS_LAZY) ? "btBL" : "btB";
     if (!fs_access_enabled()) {
-        return dochunk(L, luaL_loadbuffer(L, buf, buflen, __func__));
+        return dochunk(L, luaL_loadbufferx(L, buf, buflen, __func__, mode));
     }
 
     int ret = ckb_load_fs(buf, buflen);
@@ -205,7 +267,15 @@ int load_lua_code(lua_State *L, char *buf, size_t buflen) {
     }
 
     static const char *FILENAME = "main.lua";
-    return dochunk(L, luaL_loadfile(L, FILENAME));
+    FSFile *file = NULL;
+    ret = ckb_get_file(FILENAME, &file);
+    if (ret) {
+        printf("Error while opening %s: %d\n", FILENAME, ret);
+        return -LUA_ERROR_INVALID_ARGUMENT;
+    }
+    ret = luaL_loadbufferx(L, file->content, file->size, "@main.lua", mode);
+    free(file);
+    return dochunk(L, ret);
 }
 
 int load_lua_code_from_source(lua_State *L, uint16_t lua_loader_args,
@@ -226,7 +296,7 @@ int load_lua_code_from_source(lua_State *L, uint16_t lua_loader_args,
         printf("Error while loading cell data: %d\n", ret);
         return -LUA_ERROR_SYSCALL;
     }
-    return load_lua_code(L, buf, buflen);
+    return load_lua_code(L, lua_loader_args, buf, buflen);
 }
 
 int load_lua_code_with_hash(lua_State *L, uint16_t lua_loader_args,
@@ -268,7 +338,25 @@ int load_lua_code_from_cell_data(lua_State *L) {
     if (args_bytes_seg.size < LUA_LOADER_ARGS_SIZE) {
         return -LUA_ERROR_INVALID_ARGUMENT;
     }
+    // Only the first byte holds bits, see LUA_LOADER_ARGS_IMAGE.
     uint16_t lua_loader_args = *(args_bytes_seg.ptr);
+    if (lua_loader_args & LUA_LOADER_ARGS_BUMP) {
+        // The second byte is the percentage of the heap allocated before
+        // collecting garbage.
+        pool_start_bump(L, args_bytes_seg.ptr[1]);
+    }
+    if (lua_loader_args & LUA_LOADER_ARGS_PROFILE) {
+        start_profile(L);
+    }
+    if (lua_loader_args & LUA_LOADER_ARGS_ALLOC_PROFILE) {
+        start_alloc_profile(L, 0);
+    }
+    if (lua_loader_args & LUA_LOADER_ARGS_HEAP_SNAPSHOT) {
+        start_heap_snapshot(L);
+    }
+    if (lua_loader_args & LUA_LOADER_ARGS_SYSCALL_TRACE) {
+        start_syscall_trace(0);
+    }
 
     // Loading lua code from dependent cell with code hash and hash type
     // The script arguments are in the following format
@@ -283,6 +371,175 @@ int load_lua_code_from_cell_data(lua_State *L) {
     return load_lua_code_with_hash(L, lua_loader_args, code_hash, hash_type);
 }
 
+static void get_heap_usage(lua_State *L, size_t *used, size_t *peak,
+                           size_t *size) {
+    void *ud;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    if (f == alloc_profile) {
+        f = ((alloc_profiler_t *)ud)->f;
+        ud = ((alloc_profiler_t *)ud)->ud;
+    }
+    if (f == region_alloc) {
+        region_t *r = (region_t *)ud;
+        *used = r->used;
+        *peak = r->peak;
+        *size = r->cap;
+    } else if (f == pool_alloc) {
+        pool_t *p = (pool_t *)ud;
+        *used = p->stats.used;
+        *peak = p->stats.peak;
+        *size = s_brk_max - s_brk_min;
+    } else {
+        *used = (size_t)lua_gc(L, LUA_GCCOUNT) * 1024 + lua_gc(L, LUA_GCCOUNTB);
+        *peak = 0;
+        *size = 0;
+    }
+}
+
+// Collect garbage in generational mode. Smaller heaps can not wait as long
+// before collecting: the heap of a script in a 4 MiB VM uses the defaults.
+static void set_gc_mode(lua_State *L) {
+    size_t used, peak, size;
+    get_heap_usage(L, &used, &peak, &size);
+    if (size == 0 || size >= 2 * 1024 * 1024) {
+        lua_gc(L, LUA_GCGEN, 0, 0); /* minor 20%, major 100% */
+    } else if (size >= 1024 * 1024) {
+        lua_gc(L, LUA_GCGEN, 15, 60);
+    } else {
+        lua_gc(L, LUA_GCGEN, 10, 30);
+    }
+}
+
+/*
+** Open the libraries of a fresh state. Also used to build heap images, so
+** everything done here ends up in the image.
+*/
+static int openlibs(lua_State *L) {
+    luaL_openlibs(L); /* open standard libraries */
+    luaopen_ckb(L);
+    set_gc_mode(L);
+    return 0;
+}
+
+/*
+** Create a state from the heap image in the dependent cell given by the
+** script arguments, if the lua loader args ask for it. The script
+** arguments are then in the following format
+** <lua loader args, 2 bytes> <code hash of lua code, 32 bytes>
+** <hash type of lua code, 1 byte> <code hash of image, 32 bytes>
+** <hash type of image, 1 byte>
+** Returns NULL if the state should be built from scratch.
+*/
+static lua_State *load_lua_image_from_cell_data(void) {
+    unsigned char script[SCRIPT_SIZE];
+    uint64_t len = SCRIPT_SIZE;
+    int ret = ckb_load_script(script, &len, 0);
+    if (ret || len > SCRIPT_SIZE) {
+        return NULL;
+    }
+    mol_seg_t script_seg;
+    script_seg.ptr = (uint8_t *)script;
+    script_seg.size = len;
+    if (MolReader_Script_verify(&script_seg, false) != MOL_OK) {
+        return NULL;
+    }
+    mol_seg_t args_seg = MolReader_Script_get_args(&script_seg);
+    mol_seg_t args_bytes_seg = MolReader_Bytes_raw_bytes(&args_seg);
+    // This is the first syscall of the loader, so the record starts here,
+    // with the script loaded again to be in it.
+    if (args_bytes_seg.size >= LUA_LOADER_ARGS_SIZE &&
+        (*args_bytes_seg.ptr & LUA_LOADER_ARGS_SYSCALL_RECORD)) {
+        start_syscall_record();
+        ckb_load_script(script, &len, 0);
+    }
+    const size_t image_hash_offset =
+        LUA_LOADER_ARGS_SIZE + BLAKE2B_BLOCK_SIZE + 1;
+    if (args_bytes_seg.size < image_hash_offset + BLAKE2B_BLOCK_SIZE + 1) {
+        return NULL;
+    }
+    uint16_t lua_loader_args = *(args_bytes_seg.ptr);
+    if (!(lua_loader_args & LUA_LOADER_ARGS_IMAGE)) {
+        return NULL;
+    }
+    uint8_t *code_hash = args_bytes_seg.ptr + image_hash_offset;
+    uint8_t hash_type = *(code_hash + BLAKE2B_BLOCK_SIZE);
+    size_t index = 0;
+    ret = ckb_look_for_dep_with_hash2(code_hash, hash_type, &index);
+    if (ret) {
+        printf("Error while looking for image dep: %d\n", ret);
+        return NULL;
+    }
+    size_t buflen = 0;
+    ret = ckb_load_cell_data(NULL, &buflen, 0, index, CKB_SOURCE_CELL_DEP);
+    if (ret) {
+        printf("Error while loading image: %d\n", ret);
+        return NULL;
+    }
+    char *buf = malloc(buflen);
+    if (buf == NULL) {
+        return NULL;
+    }
+    ret = ckb_load_cell_data(buf, &buflen, 0, index, CKB_SOURCE_CELL_DEP);
+    lua_State *L = NULL;
+    if (ret == 0) {
+        L = luaL_newstatefromimagealloc(buf, buflen, pool_alloc, &s_pool);
+    }
+    if (L == NULL) {
+        printf("Image not loadable, initializing lua state instead\n");
+    }
+    free(buf);
+    return L;
+}
+
+/*
+** Print 'data' in hex, one line per 64 bytes, each line prefixed with
+** 'prefix' (at most 8 characters).
+*/
+static void print_hex(const char *prefix, const unsigned char *data,
+                      size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    char line[8 + 128 + 1];
+    size_t prefix_len = strlen(prefix);
+    memcpy(line, prefix, prefix_len);
+    for (size_t i = 0; i < len; i += 64) {
+        char *p = line + prefix_len;
+        for (size_t j = i; j < len && j < i + 64; j++) {
+            *p++ = hex[data[j] >> 4];
+            *p++ = hex[data[j] & 0xf];
+        }
+        *p = '\0';
+        ckb_debug(line);
+    }
+}
+
+/*
+** Build a heap image of a freshly initialized state and print it in hex,
+** one line per 64 bytes, each line prefixed with "IMAGE ".
+*/
+static int dump_image(void) {
+    void *scratch = malloc(LUA_IMAGE_SCRATCH_SIZE);
+    size_t len = 0;
+    if (scratch == NULL) {
+        return -LUA_ERROR_OUT_OF_MEMORY;
+    }
+    int status = luaL_makeimage(openlibs, scratch, LUA_IMAGE_SCRATCH_SIZE,
+                                NULL, &len);
+    unsigned char *image = status == LUA_OK ? malloc(len) : NULL;
+    if (image != NULL) {
+        status = luaL_makeimage(openlibs, scratch, LUA_IMAGE_SCRATCH_SIZE,
+                                image, &len);
+    }
+    free(scratch);
+    if (image == NULL || status != LUA_OK) {
+        printf("Error while building image: %d\n", status);
+        free(image);
+        return -LUA_ERROR_INTERNAL;
+    }
+    print_hex("IMAGE ", image, len);
+    free(image);
+    return 0;
+}
+
 /*
 ** Receives 'globname[=modname]' and runs 'globname = require(modname)'.
 */
@@ -324,6 +581,19 @@ static int pushargs(lua_State *L) {
 #define has_f 16    /* -f, to enable file system support */
 #define has_t 32    /* -t, for file system tests */
 #define has_l 64 /* -l, to run scripts, without ability to load local files */
+#define has_s 128 /* -s, to dump a heap image of the initialized state */
+#define has_c 256 /* -c, to compile a script to bytecode loaded in place */
+#define has_z 512 /* -z, to compile function bodies of a script on first use */
+#define has_a 1024 /* -a, to allocate lua objects with malloc, see lua-pool.c */
+#define has_m 2048 /* -m, to print allocation statistics */
+#define has_b 4096 /* -b[percent], to collect no garbage, see lua-pool.c */
+#define has_p 8192 /* -p, to print a cycle profile, see lua-profiler.c */
+/* -h[bytes], to print an allocation profile, see lua-alloc-profiler.c */
+#define has_h 16384
+#define has_d 32768 /* -d, to print a heap snapshot, see lua-heap-snapshot.c */
+/* -k[t], to count syscalls, see lua-syscall-trace.c, or -kr, to record them,
+   see lua-syscall-record.c */
+#define has_k 65536
 /*
 ** Traverses all arguments from 'argv', returning a mask with those
 ** needed before running any Lua code (or an error code if it finds
@@ -353,6 +623,36 @@ static int collectargs(char **argv, int *first) {
             case 't':
                 args |= has_t;
                 break;
+            case 's':
+                args |= has_s;
+                break;
+            case 'c':
+                args |= has_c;
+                break;
+            case 'z':
+                args |= has_z;
+                break;
+            case 'a':
+                args |= has_a;
+                break;
+            case 'm':
+                args |= has_m;
+                break;
+            case 'b':
+                args |= has_b;
+                break;
+            case 'p':
+                args |= has_p;
+                break;
+            case 'h':
+                args |= has_h;
+                break;
+            case 'd':
+                args |= has_d;
+                break;
+            case 'k':
+                args |= has_k;
+                break;
             default: /* invalid option */
                 return has_error;
         }
@@ -376,8 +676,9 @@ int read_file(char *buf, int size) {
 }
 
 // Load the file given from syscall, may optionally enable access to local files
-// by setting local_access_enabled to non-zero.
-static int run_from_file(lua_State *L, int local_access_enabled) {
+// by setting local_access_enabled to non-zero, and compile function bodies on
+// first use by setting lazy to non-zero.
+static int run_from_file(lua_State *L, int local_access_enabled, int lazy) {
     enable_local_access(local_access_enabled);
     char buf[1024 * 512];
     int count = read_file(buf, sizeof(buf));
@@ -390,10 +691,67 @@ static int run_from_file(lua_State *L, int local_access_enabled) {
         return -LUA_ERROR_INVALID_STATE;
     }
     buf[count] = 0;
+    if (buf[0] == LUA_SIGNATURE[0] || lazy) {
+        // Keep bytecode alive with the state, so that it is loaded in place,
+        // and source too, as functions are compiled from it later. The copy
+        // is a userdata of the registry, freed when the state is closed.
+        char *chunk = lua_newuserdatauv(L, count, 0);
+        memcpy(chunk, buf, count);
+        luaL_ref(L, LUA_REGISTRYINDEX);
+        return dochunk(L, luaL_loadbufferx(L, chunk, count, "=(read file)",
+                                           lazy ? "btBL" : "bB"));
+    }
     int status = dochunk(L, luaL_loadbuffer(L, buf, count, "=(read file)"));
     return status;
 }
 
+typedef struct ChunkWriter {
+    int init;
+    luaL_Buffer b;
+} ChunkWriter;
+
+static int chunk_writer(lua_State *L, const void *p, size_t size, void *ud) {
+    ChunkWriter *w = (ChunkWriter *)ud;
+    if (!w->init) {
+        // Initialize the buffer here, as lua_dump needs the function on top.
+        w->init = 1;
+        luaL_buffinit(L, &w->b);
+    }
+    luaL_addlstring(&w->b, (const char *)p, size);
+    return 0;
+}
+
+// Compile the file given from syscall to bytecode in the format loaded in
+// place, see LUA_DUMPFIXED, and print it with the prefix "CHUNK ".
+static int compile_file(lua_State *L) {
+    const int size = 1024 * 512;
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        return -LUA_ERROR_OUT_OF_MEMORY;
+    }
+    int count = read_file(buf, size);
+    if (count < 0 || count == size) {
+        printf("Error while reading from file: %d\n", count);
+        free(buf);
+        return -LUA_ERROR_INVALID_STATE;
+    }
+    int status = luaL_loadbufferx(L, buf, count, "=(read file)", "t");
+    free(buf);
+    if (status != LUA_OK) {
+        return check_status_and_top_of_stack(L, status);
+    }
+    ChunkWriter w = {0};
+    status = lua_dump(L, chunk_writer, &w, LUA_DUMPFIXED);
+    if (status != 0 || !w.init) {
+        return -LUA_ERROR_INTERNAL;
+    }
+    luaL_pushresult(&w.b);
+    size_t len;
+    const char *chunk = lua_tolstring(L, -1, &len);
+    print_hex("CHUNK ", (const unsigned char *)chunk, len);
+    return 0;
+}
+
 /*
 ** {==================================================================
 ** Read-Eval-Print Loop (REPL)
@@ -424,6 +782,7 @@ static void l_print(lua_State *L) {
 static int pmain(lua_State *L) {
     int argc = (int)lua_tointeger(L, 1);
     char **argv = (char **)lua_touserdata(L, 2);
+    int from_image = lua_toboolean(L, 3);
     int script;
     int args = collectargs(argv, &script);
     luaL_checkversion(L);    /* check that interpreter has correct version */
@@ -431,11 +790,61 @@ static int pmain(lua_State *L) {
         print_usage(argv[script]); /* 'script' has index of bad arg. */
         return 0;
     }
-    luaL_openlibs(L); /* open standard libraries */
-    luaopen_ckb(L);
-    createargtable(L, argv, argc, script); /* create table 'arg' */
-    lua_gc(L, LUA_GCGEN, 0, 0);            /* GC in generational mode */
     int ret;
+    s_print_pool_stats = (args & has_m) != 0;
+    if (args & has_b) {
+        for (int i = 0; i < script; i++) {
+            if (argv[i][1] == 'b') {
+                int percent = 0;
+                for (const char *c = argv[i] + 2;
+                     *c >= '0' && *c <= '9' && percent <= 100; c++) {
+                    percent = percent * 10 + (*c - '0');
+                }
+                pool_start_bump(L, percent);
+            }
+        }
+    }
+    if (args & has_h) {
+        for (int i = 0; i < script; i++) {
+            if (argv[i][1] == 'h') {
+                size_t bytes = 0;
+                for (const char *c = argv[i] + 2; *c >= '0' && *c <= '9';
+                     c++) {
+                    bytes = bytes * 10 + (*c - '0');
+                }
+                start_alloc_profile(L, bytes);
+            }
+        }
+    }
+    if (args & has_s) {
+        ret = dump_image();
+        goto exit;
+    }
+    if (!from_image) {
+        openlibs(L);
+    } else {
+        set_gc_mode(L);
+    }
+    if (args & has_c) {
+        ret = compile_file(L);
+        goto exit;
+    }
+    createargtable(L, argv, argc, script); /* create table 'arg' */
+    if (args & has_p) {
+        start_profile(L);
+    }
+    if (args & has_d) {
+        start_heap_snapshot(L);
+    }
+    if (args & has_k) {
+        for (int i = 0; i < script; i++) {
+            if (argv[i][1] == 'k' && argv[i][2] == 'r') {
+                start_syscall_record();
+            } else if (argv[i][1] == 'k') {
+                start_syscall_trace(argv[i][2] == 't');
+            }
+        }
+    }
     if (args & has_f) {
         enable_fs_access(1);
     }
@@ -449,11 +858,12 @@ static int pmain(lua_State *L) {
         goto exit;
     }
     if (args & has_r || args & has_l) {
-        ret = run_from_file(L, (args & has_r) == has_r);
+        ret = run_from_file(L, (args & has_r) == has_r, args & has_z);
         goto exit;
     }
     ret = load_lua_code_from_cell_data(L);
 exit:
+    print_exit_reports(L);
     lua_pushinteger(L, ret);
     return 1;
 }
@@ -461,8 +871,24 @@ exit:
 int main(int argc, char **argv) {
     // Always enable exit in standalone mode
     s_lua_exit_enabled = 1;
-    int status, result;
-    lua_State *L = luaL_newstate(); /* create state */
+    // In a VM spawned with less memory, the heap ends where the last quarter
+    // of it, left to the stack, starts.
+    size_t memory_limit = ckb_memory_limit();
+    malloc_config(CKB_BRK_MIN, memory_limit > 0
+                                   ? memory_limit - memory_limit / 4
+                                   : CKB_BRK_MAX);
+    int status, result, script;
+    lua_State *L = NULL;
+    // Scripts run on chain have no command line arguments
+    if (argc == 0) {
+        L = load_lua_image_from_cell_data();
+    }
+    int from_image = L != NULL;
+    if (L == NULL && (collectargs(argv, &script) & has_a)) {
+        L = luaL_newstate(); /* create state */
+    } else if (L == NULL) {
+        L = luaL_newstatealloc(pool_alloc, &s_pool);
+    }
     if (L == NULL) {
         l_message(argv[0], "cannot create state: not enough memory");
         return -LUA_ERROR_OUT_OF_MEMORY;
@@ -470,7 +896,8 @@ int main(int argc, char **argv) {
     lua_pushcfunction(L, &pmain);   /* to call 'pmain' in protected mode */
     lua_pushinteger(L, argc);       /* 1st argument */
     lua_pushlightuserdata(L, argv); /* 2nd argument */
-    status = lua_pcall(L, 2, 1, 0);
+    lua_pushboolean(L, from_image); /* 3rd argument */
+    status = lua_pcall(L, 3, 1, 0);
     if (status != LUA_OK) {
         l_message(argv[0], "failed to run lua");
         lua_close(L);
@@ -482,22 +909,75 @@ int main(int argc, char **argv) {
     return result;
 }
 
+// Check the instance passed to an exported function, and make it the running
+// instance (see lua-instance.c).
+static lua_State *enter_instance(void *l) {
+    lua_State *L = l;
+    if (L == NULL) {
+        ckb_exit(LUA_ERROR_INVALID_STATE);
+    }
+    instance_enter(instance_of(L));
+    return L;
+}
+
+// Set up the instance created by lua_create_instance(_from_image).
+static lua_State *init_instance(lua_State *L, instance_t *instance) {
+    if (L == NULL) {
+        instance_leave();
+        return NULL;
+    }
+    *(instance_t **)lua_getextraspace(L) = instance;
+    return L;
+}
+
 // Running malloc inside the embedded lua instance may interfere with the
 // hosting program malloc operations. To avoid such problem, the hosting program
-// should pre-alloc enough memory for exxclusive usage of the lua program. Also
-// note that, creating new lua state requries malloc, thus we configure the
-// memory on initializing lua stete instead of adding a separate function to
-// configure memory bounds after creation.
+// should pre-alloc enough memory for exxclusive usage of the lua program. Each
+// instance has its own heap in this memory, so several instances can be used
+// side by side, and the memory used by one instance is never more than
+// `max - min`.
 __attribute__((visibility("default"))) void *lua_create_instance(
     uintptr_t min, uintptr_t max) {
-    malloc_config(min, max);
-    lua_State *L = luaL_newstate(); /* create state */
+    instance_t *instance = instance_new(min, max);
+    if (instance == NULL) {
+        return NULL;
+    }
+    instance_enter(instance);
+    lua_State *L = init_instance(
+        luaL_newstatealloc(region_alloc, &instance->heap), instance);
     if (L == NULL) {
         return NULL;
     }
-    luaL_openlibs(L); /* open standard libraries */
-    luaopen_ckb(L);
-    lua_gc(L, LUA_GCGEN, 0, 0); /* GC in generational mode */
+    openlibs(L);
+    return (void *)L;
+}
+
+// Build a heap image of an initialized lua instance into `image`, using
+// `scratch` as temporary memory. If `image` is NULL, only the required size is
+// stored into `image_size`. The image is only valid for the same library
+// loaded at the same address, see docs/image.md.
+__attribute__((visibility("default"))) int lua_build_image(
+    void *scratch, size_t scratch_size, void *image, size_t *image_size) {
+    return luaL_makeimage(openlibs, scratch, scratch_size, image, image_size);
+}
+
+// Same as lua_create_instance, but map an image built by lua_build_image in
+// instead of initializing the instance. Returns NULL if the image can not be
+// used by this library.
+__attribute__((visibility("default"))) void *lua_create_instance_from_image(
+    uintptr_t min, uintptr_t max, const void *image, size_t image_size) {
+    instance_t *instance = instance_new(min, max);
+    if (instance == NULL) {
+        return NULL;
+    }
+    instance_enter(instance);
+    lua_State *L = init_instance(
+        luaL_newstatefromimagealloc(image, image_size, region_alloc,
+                                    &instance->heap),
+        instance);
+    if (L != NULL) {
+        set_gc_mode(L); /* the image has the parameters of its builder */
+    }
     return (void *)L;
 }
 
@@ -505,25 +985,389 @@ __attribute__((visibility("default"))) int lua_run_code(void *l,
                                                         const char *code,
                                                         size_t code_size,
                                                         char *name) {
-    lua_State *L = l;
-    if (L == NULL) {
-        ckb_exit(LUA_ERROR_INVALID_STATE);
-    }
+    lua_State *L = enter_instance(l);
     int status = dochunk(L, luaL_loadbuffer(L, code, code_size, name));
     return status;
 }
 
-__attribute__((visibility("default"))) void lua_close_instance(void *L) {
-    if (L == NULL) {
-        ckb_exit(LUA_ERROR_INVALID_STATE);
+// Look up the function `name` in protected mode: the first component of a
+// dotted name is a global or a loaded module, the others are fields.
+static int find_function(lua_State *L) {
+    const char *name = lua_touserdata(L, 1);
+    const char *dot = strchr(name, '.');
+    size_t len = dot ? (size_t)(dot - name) : strlen(name);
+    lua_pushglobaltable(L);
+    lua_pushlstring(L, name, len);
+    if (lua_rawget(L, -2) == LUA_TNIL) {
+        lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+        lua_pushlstring(L, name, len);
+        lua_rawget(L, -2);
+    }
+    while (dot != NULL) {
+        name = dot + 1;
+        dot = strchr(name, '.');
+        len = dot ? (size_t)(dot - name) : strlen(name);
+        if (!lua_istable(L, -1)) {
+            return 0;
+        }
+        lua_pushlstring(L, name, len);
+        lua_rawget(L, -2);
+    }
+    if (!lua_isfunction(L, -1)) {
+        return 0;
+    }
+    return 1;
+}
+
+// Look up the function `name` ("f", "module.f" or "module.table.f") and make
+// it the function called by the next lua_call_function, dropping the results
+// of any previous call. Returns 0, or -LUA_ERROR_INVALID_ARGUMENT if there is
+// no such function.
+__attribute__((visibility("default"))) int lua_find_function(void *l,
+                                                             const char *name) {
+    lua_State *L = enter_instance(l);
+    lua_settop(L, 0);
+    lua_pushcfunction(L, find_function);
+    lua_pushlightuserdata(L, (void *)name);
+    int status = lua_pcall(L, 1, 1, 0);
+    if (status != LUA_OK) {
+        lua_settop(L, 0);
+        return -LUA_ERROR_OUT_OF_MEMORY;
     }
-    lua_close((lua_State *)L);
+    if (lua_isnil(L, 1)) {
+        lua_settop(L, 0);
+        return -LUA_ERROR_INVALID_ARGUMENT;
+    }
+    return 0;
 }
 
-__attribute__((visibility("default"))) void lua_toggle_exit(void *L,
-                                                            int enabled) {
-    if (L == NULL) {
-        ckb_exit(LUA_ERROR_INVALID_STATE);
+static int push_bytes(lua_State *L) {
+    const char *data = lua_touserdata(L, 1);
+    size_t size = (size_t)lua_tointeger(L, 2);
+    lua_pushlstring(L, data, size);
+    return 1;
+}
+
+// Push a byte string, copied from `data`, as the next argument.
+__attribute__((visibility("default"))) int lua_push_bytes_arg(void *l,
+                                                              const void *data,
+                                                              size_t size) {
+    lua_State *L = enter_instance(l);
+    if (!lua_checkstack(L, 3)) {
+        return -LUA_ERROR_OUT_OF_MEMORY;
     }
+    lua_pushcfunction(L, push_bytes);
+    lua_pushlightuserdata(L, (void *)data);
+    lua_pushinteger(L, (lua_Integer)size);
+    if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+        lua_pop(L, 1); /* remove error object */
+        return -LUA_ERROR_OUT_OF_MEMORY;
+    }
+    return 0;
+}
+
+// Push an integer as the next argument.
+__attribute__((visibility("default"))) int lua_push_integer_arg(void *l,
+                                                                int64_t value) {
+    lua_State *L = enter_instance(l);
+    if (!lua_checkstack(L, 1)) {
+        return -LUA_ERROR_OUT_OF_MEMORY;
+    }
+    lua_pushinteger(L, value);
+    return 0;
+}
+
+// Expose `len` bytes of host memory at `ptr` to lua as a byte view, without
+// copying them. The view is set as the global `name`, or, if `name` is NULL,
+// pushed as the next argument of lua_call_function or lua_run_compiled. The
+// memory must stay valid while lua may use the view.
+__attribute__((visibility("default"))) int lua_push_host_buffer(
+    void *l, const char *name, void *ptr, size_t len, int readonly) {
+    lua_State *L = enter_instance(l);
+    if (ptr == NULL && len != 0) {
+        return -LUA_ERROR_INVALID_ARGUMENT;
+    }
+    if (!lua_checkstack(L, 5)) {
+        return -LUA_ERROR_OUT_OF_MEMORY;
+    }
+    lua_pushcfunction(L, new_host_buffer);
+    lua_pushlightuserdata(L, ptr);
+    lua_pushinteger(L, (lua_Integer)len);
+    lua_pushboolean(L, readonly);
+    if (name != NULL) {
+        lua_pushlightuserdata(L, (void *)name);
+    } else {
+        lua_pushnil(L);
+    }
+    if (lua_pcall(L, 4, 1, 0) != LUA_OK) {
+        lua_pop(L, 1); /* remove error object */
+        return -LUA_ERROR_OUT_OF_MEMORY;
+    }
+    if (name != NULL) {
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
+// Register the native function `fn` of the host program as `module.name`, or
+// as the global `name` if `module` is NULL. See lua-host-function.c for its
+// calling convention.
+__attribute__((visibility("default"))) int lua_register_host_function(
+    void *l, const char *module, const char *name, void *fn) {
+    lua_State *L = enter_instance(l);
+    if (name == NULL || fn == NULL) {
+        return -LUA_ERROR_INVALID_ARGUMENT;
+    }
+    if (!lua_checkstack(L, 4)) {
+        return -LUA_ERROR_OUT_OF_MEMORY;
+    }
+    lua_pushcfunction(L, register_host_function);
+    lua_pushlightuserdata(L, fn);
+    lua_pushlightuserdata(L, (void *)name);
+    lua_pushlightuserdata(L, (void *)module);
+    if (lua_pcall(L, 3, 0, 0) != LUA_OK) {
+        lua_pop(L, 1); /* remove error object */
+        return -LUA_ERROR_OUT_OF_MEMORY;
+    }
+    return 0;
+}
+
+// Mount the Simple Lua File System (see docs/fs.md) of `len` bytes at `ptr`,
+// like ckb.mount does for cell data. The files are read in place, so the host
+// must keep the memory alive until it is unmounted and the files opened from
+// it are closed. Returns 0 or -LUA_ERROR_INVALID_ARGUMENT.
+__attribute__((visibility("default"))) int lua_mount_fs_buffer(void *l,
+                                                               const void *ptr,
+                                                               size_t len) {
+    enter_instance(l);
+    if (ptr == NULL || ckb_load_fs((void *)ptr, len) != 0) {
+        return -LUA_ERROR_INVALID_ARGUMENT;
+    }
+    return 0;
+}
+
+// Unmount the file system mounted from `ptr` by lua_mount_fs_buffer. Returns 0
+// or -LUA_ERROR_INVALID_ARGUMENT if it is not mounted.
+__attribute__((visibility("default"))) int lua_unmount_fs_buffer(
+    void *l, const void *ptr) {
+    enter_instance(l);
+    if (ckb_unload_fs(ptr) != 0) {
+        return -LUA_ERROR_INVALID_ARGUMENT;
+    }
+    return 0;
+}
+
+// Call the function found by lua_find_function with the arguments pushed
+// since, keeping `nresults` results to be read by lua_get_*_result. Returns
+// the same as lua_run_code.
+__attribute__((visibility("default"))) int lua_call_function(void *l,
+                                                             int nresults) {
+    lua_State *L = enter_instance(l);
+    if (lua_gettop(L) < 1 || !lua_isfunction(L, 1) || nresults < 0) {
+        return -LUA_ERROR_INVALID_STATE;
+    }
+    if (!lua_checkstack(L, nresults + 1)) {
+        return -LUA_ERROR_OUT_OF_MEMORY;
+    }
+    int status = docall(L, lua_gettop(L) - 1, nresults);
+    if (status != LUA_OK) {
+        status = check_status_and_top_of_stack(L, status);
+        lua_settop(L, 0);
+    }
+    return status;
+}
+
+// Copy result `index` (from 1) of the last lua_call_function, which must be a
+// string, to `buf`. `*size` is the size of `buf` on input, and the length of
+// the string on output; as with partial loading syscalls, at most the size of
+// `buf` is copied. Returns 0, or -LUA_ERROR_INVALID_ARGUMENT.
+__attribute__((visibility("default"))) int lua_get_bytes_result(void *l,
+                                                                int index,
+                                                                void *buf,
+                                                                size_t *size) {
+    lua_State *L = enter_instance(l);
+    if (index < 1 || index > lua_gettop(L) ||
+        lua_type(L, index) != LUA_TSTRING) {
+        return -LUA_ERROR_INVALID_ARGUMENT;
+    }
+    size_t len;
+    const char *s = lua_tolstring(L, index, &len);
+    memcpy(buf, s, len < *size ? len : *size);
+    *size = len;
+    return 0;
+}
+
+// Store result `index` (from 1) of the last lua_call_function, which must be
+// an integer, into `value`. Returns 0, or -LUA_ERROR_INVALID_ARGUMENT.
+__attribute__((visibility("default"))) int lua_get_integer_result(
+    void *l, int index, int64_t *value) {
+    lua_State *L = enter_instance(l);
+    if (index < 1 || index > lua_gettop(L) || !lua_isinteger(L, index)) {
+        return -LUA_ERROR_INVALID_ARGUMENT;
+    }
+    *value = lua_tointeger(L, index);
+    return 0;
+}
+
+// Chunks compiled by lua_compile_code are kept by handle in this table of the
+// registry, so that other references in the registry are not taken for them.
+#define COMPILED_CHUNKS_KEY "_ckb_compiled_chunks"
+
+static int ref_compiled(lua_State *L) {
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, COMPILED_CHUNKS_KEY);
+    lua_insert(L, 1);
+    lua_pushinteger(L, luaL_ref(L, 1));
+    return 1;
+}
+
+// Push the table of compiled chunks, or nil if there is none, and its value
+// at `handle` on top of it. Returns the type of that value: LUA_TFUNCTION if
+// `handle` is one of lua_compile_code.
+static int get_compiled(lua_State *L, int handle) {
+    if (lua_getfield(L, LUA_REGISTRYINDEX, COMPILED_CHUNKS_KEY) !=
+        LUA_TTABLE) {
+        lua_pushnil(L);
+        return LUA_TNIL;
+    }
+    return lua_rawgeti(L, -1, handle);
+}
+
+// Compile `code` (source code or bytecode) once, and keep the compiled chunk
+// in the registry. Returns a positive handle to run it with lua_run_compiled,
+// or a negative number if it can not be compiled.
+__attribute__((visibility("default"))) int lua_compile_code(void *l,
+                                                            const char *code,
+                                                            size_t code_size,
+                                                            char *name) {
+    lua_State *L = enter_instance(l);
+    lua_settop(L, 0);
+    int status = luaL_loadbuffer(L, code, code_size, name);
+    if (status == LUA_OK) {
+        lua_pushcfunction(L, ref_compiled);
+        lua_insert(L, 1);
+        status = lua_pcall(L, 1, 1, 0);
+    }
+    if (status != LUA_OK) {
+        return check_status_and_top_of_stack(L, status);
+    }
+    int handle = (int)lua_tointeger(L, 1);
+    lua_settop(L, 0);
+    return handle;
+}
+
+// Run the chunk compiled by lua_compile_code, with the last `nargs` values
+// pushed by lua_push_*_arg as arguments (the chunk gets them in '...'), and
+// keep `nresults` results to be read by lua_get_*_result. Returns the same as
+// lua_run_code.
+__attribute__((visibility("default"))) int lua_run_compiled(void *l,
+                                                            int handle,
+                                                            int nargs,
+                                                            int nresults) {
+    lua_State *L = enter_instance(l);
+    if (handle <= 0 || nargs < 0 || nargs > lua_gettop(L) || nresults < 0) {
+        return -LUA_ERROR_INVALID_ARGUMENT;
+    }
+    if (!lua_checkstack(L, nresults + 3)) {
+        return -LUA_ERROR_OUT_OF_MEMORY;
+    }
+    if (get_compiled(L, handle) != LUA_TFUNCTION) {
+        lua_pop(L, 2);
+        return -LUA_ERROR_INVALID_ARGUMENT;
+    }
+    lua_remove(L, -2); /* table of compiled chunks */
+    int base = lua_gettop(L) - nargs; /* function index */
+    lua_insert(L, base);
+    if (base > 1) { /* drop results of previous calls */
+        lua_rotate(L, 1, -(base - 1));
+        lua_pop(L, base - 1);
+    }
+    int status = docall(L, nargs, nresults);
+    if (status != LUA_OK) {
+        status = check_status_and_top_of_stack(L, status);
+        lua_settop(L, 0);
+    }
+    return status;
+}
+
+// Release the chunk compiled by lua_compile_code. Does nothing if `handle` is
+// not one of its handles, or was already released.
+__attribute__((visibility("default"))) void lua_free_compiled(void *l,
+                                                              int handle) {
+    lua_State *L = enter_instance(l);
+    if (handle > 0) {
+        int type = get_compiled(L, handle);
+        lua_pop(L, 1);
+        if (type == LUA_TFUNCTION) {
+            luaL_unref(L, -1, handle);
+        }
+        lua_pop(L, 1);
+    }
+}
+
+// Store the bytes used by the lua heap of the instance, the most it has ever
+// used, and its limit. Any of the pointers may be NULL.
+__attribute__((visibility("default"))) void lua_get_instance_memory_usage(
+    void *l, size_t *used, size_t *peak, size_t *limit) {
+    lua_State *L = enter_instance(l);
+    region_t *heap = &instance_of(L)->heap;
+    if (used != NULL) {
+        *used = heap->used;
+    }
+    if (peak != NULL) {
+        *peak = heap->peak;
+    }
+    if (limit != NULL) {
+        *limit = heap->cap;
+    }
+}
+
+// Limit the lua heap of the instance to `limit` bytes, which can not be more
+// than the memory of the instance. Allocations above the limit fail as if the
+// memory was exhausted. Returns 0 or -LUA_ERROR_INVALID_ARGUMENT.
+__attribute__((visibility("default"))) int lua_set_instance_memory_limit(
+    void *l, size_t limit) {
+    lua_State *L = enter_instance(l);
+    region_t *heap = &instance_of(L)->heap;
+    if (limit > (size_t)(heap->limit - instance_heap_base(instance_of(L)))) {
+        return -LUA_ERROR_INVALID_ARGUMENT;
+    }
+    heap->cap = limit;
+    return 0;
+}
+
+// Record the state of the instance, e.g. right after creating it, so that
+// lua_reset_instance can bring it back. The used memory of the instance is
+// copied to the end of its heap, which is that much smaller until the next
+// checkpoint. Returns 0 or -LUA_ERROR_OUT_OF_MEMORY.
+__attribute__((visibility("default"))) int lua_checkpoint_instance(void *l) {
+    lua_State *L = enter_instance(l);
+    lua_settop(L, 0);
+    if (instance_checkpoint(instance_of(L)) != 0) {
+        return -LUA_ERROR_OUT_OF_MEMORY;
+    }
+    return 0;
+}
+
+// Bring the instance back to its state at the last lua_checkpoint_instance,
+// forgetting everything done since (globals, compiled code, mounted file
+// systems, lua_toggle_exit). Returns 0 or -LUA_ERROR_INVALID_STATE if there is
+// no checkpoint.
+__attribute__((visibility("default"))) int lua_reset_instance(void *l) {
+    lua_State *L = enter_instance(l);
+    if (instance_reset(instance_of(L)) != 0) {
+        return -LUA_ERROR_INVALID_STATE;
+    }
+    return 0;
+}
+
+__attribute__((visibility("default"))) void lua_close_instance(void *l) {
+    lua_State *L = enter_instance(l);
+    lua_close(L);
+    instance_leave();
+}
+
+__attribute__((visibility("default"))) void lua_toggle_exit(void *l,
+                                                            int enabled) {
+    enter_instance(l);
     s_lua_exit_enabled = enabled;
 }
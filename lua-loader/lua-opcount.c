@@ -0,0 +1,69 @@
+// Histogram of the opcodes run by the lua VM, in the opcount variant of the
+// Makefile, which builds lualib and the loader with LUAI_OPCOUNT (see
+// luaV_execute in lualib/lvm.c). When the script ends, the executions of each
+// opcode are printed with ckb_debug, followed by the OPCOUNT_TOP_PAIRS pairs
+// of opcodes run most often one after the other, the candidates for
+// superinstructions:
+//
+//   OPCODE GETFIELD 12000
+//   OPCODE_PAIR GETFIELD CALL 3000
+//
+// Nothing is counted or printed in the other builds.
+
+#ifdef LUAI_OPCOUNT
+
+#include "lopnames.h"
+
+#define OPCOUNT_OPCODES (int)(sizeof(opnames) / sizeof(opnames[0]) - 1)
+#define OPCOUNT_TOP_PAIRS 32
+
+typedef struct opcount_pair_t {
+    int op, next;
+    size_t count;
+} opcount_pair_t;
+
+static int s_opcount_printed = 0;
+
+static void print_opcount(void) {
+    if (s_opcount_printed) {
+        return;
+    }
+    s_opcount_printed = 1;
+    char line[64];
+    opcount_pair_t top[OPCOUNT_TOP_PAIRS];
+    int ntop = 0;
+    for (int op = 0; op < OPCOUNT_OPCODES; op++) {
+        size_t count = lua_opcount(op, -1);
+        if (count == 0) {
+            continue;
+        }
+        snprintf_(line, sizeof(line), "OPCODE %s %lu", opnames[op],
+                  (unsigned long)count);
+        ckb_debug(line);
+        // Keep the largest pairs, sorted.
+        for (int next = 0; next < OPCOUNT_OPCODES; next++) {
+            opcount_pair_t pair = {op, next, lua_opcount(op, next)};
+            if (pair.count == 0 || (ntop == OPCOUNT_TOP_PAIRS &&
+                                    pair.count <= top[ntop - 1].count)) {
+                continue;
+            }
+            int i = ntop < OPCOUNT_TOP_PAIRS ? ntop++ : ntop - 1;
+            for (; i > 0 && top[i - 1].count < pair.count; i--) {
+                top[i] = top[i - 1];
+            }
+            top[i] = pair;
+        }
+    }
+    for (int i = 0; i < ntop; i++) {
+        snprintf_(line, sizeof(line), "OPCODE_PAIR %s %s %lu",
+                  opnames[top[i].op], opnames[top[i].next],
+                  (unsigned long)top[i].count);
+        ckb_debug(line);
+    }
+}
+
+#else
+
+static void print_opcount(void) {}
+
+#endif
@@ -0,0 +1,160 @@
+// Scoped cycle timers and counters of lua scripts, in table ckb.perf:
+//
+//   ckb.perf.begin("witness")
+//   ...
+//   local cycles = ckb.perf.finish("witness")
+//   ckb.perf.count("signatures", 2)
+//
+// Timers and counters are kept by name in a fixed table of each state, in its
+// registry, and printed with ckb_debug when the script ends, one line per name
+// with the times the timer was finished, the cycles it measured and the value
+// of the counter:
+//
+//   PERF witness 3 120000 0
+//
+// Names longer than 31 bytes raise an error.
+//
+// A begin nested in another begin of the same name is not timed again.
+//
+// They are only compiled with CKB_LUA_PERF, see the perf variant of the
+// Makefile. Otherwise the functions do nothing and return 0, so that scripts
+// run unchanged in production.
+
+#ifdef CKB_LUA_PERF
+
+#define PERF_MAX_ENTRIES 32
+#define PERF_NAME_SIZE 32
+#define PERF_REGISTRY_KEY "_ckb_perf"
+
+typedef struct perf_entry_t {
+    char name[PERF_NAME_SIZE];
+    int depth;       /* begins not yet finished */
+    uint64_t start;  /* time of the outermost begin */
+    uint64_t calls;  /* finishes of the outermost begin */
+    uint64_t cycles; /* between outermost begins and finishes */
+    int64_t count;
+} perf_entry_t;
+
+typedef struct perf_table_t {
+    perf_entry_t entries[PERF_MAX_ENTRIES];
+    int count;
+} perf_table_t;
+
+// Table of `L`, a userdata in its registry created if `create` is set, or NULL.
+static perf_table_t *perf_table(lua_State *L, int create) {
+    perf_table_t *t = NULL;
+    if (lua_getfield(L, LUA_REGISTRYINDEX, PERF_REGISTRY_KEY) ==
+        LUA_TUSERDATA) {
+        t = lua_touserdata(L, -1);
+    } else if (create) {
+        t = lua_newuserdatauv(L, sizeof(perf_table_t), 0);
+        t->count = 0;
+        lua_setfield(L, LUA_REGISTRYINDEX, PERF_REGISTRY_KEY);
+    }
+    lua_pop(L, 1);
+    return t;
+}
+
+// Entry named by argument 1, created if `create` is set, or NULL.
+static perf_entry_t *perf_entry(lua_State *L, int create) {
+    size_t len;
+    const char *name = luaL_checklstring(L, 1, &len);
+    if (len >= PERF_NAME_SIZE) {
+        luaL_error(L, "perf name '%s' is longer than %d bytes", name,
+                   PERF_NAME_SIZE - 1);
+    }
+    perf_table_t *t = perf_table(L, create);
+    if (t == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < t->count; i++) {
+        perf_entry_t *e = &t->entries[i];
+        if (strncmp(e->name, name, len) == 0 && e->name[len] == '\0') {
+            return e;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    if (t->count == PERF_MAX_ENTRIES) {
+        luaL_error(L, "too many perf names");
+    }
+    perf_entry_t *e = &t->entries[t->count++];
+    memset(e, 0, sizeof(*e));
+    memcpy(e->name, name, len);
+    return e;
+}
+
+static int lua_ckb_perf_begin(lua_State *L) {
+    perf_entry_t *e = perf_entry(L, 1);
+    if (e->depth++ == 0) {
+        e->start = ckb_current_cycles();
+    }
+    return 0;
+}
+
+// Return the cycles since the outermost begin, or 0 for a nested one.
+static int lua_ckb_perf_finish(lua_State *L) {
+    uint64_t now = ckb_current_cycles();
+    perf_entry_t *e = perf_entry(L, 0);
+    if (e == NULL || e->depth == 0) {
+        return luaL_error(L, "perf timer '%s' not started",
+                          lua_tostring(L, 1));
+    }
+    uint64_t cycles = 0;
+    if (--e->depth == 0) {
+        cycles = now - e->start;
+        e->cycles += cycles;
+        e->calls++;
+    }
+    lua_pushinteger(L, (lua_Integer)cycles);
+    return 1;
+}
+
+static int lua_ckb_perf_count(lua_State *L) {
+    lua_Integer n = luaL_optinteger(L, 2, 1);
+    perf_entry(L, 1)->count += n;
+    return 0;
+}
+
+static const luaL_Reg ckb_perf[] = {{"begin", lua_ckb_perf_begin},
+                                    {"finish", lua_ckb_perf_finish},
+                                    {"count", lua_ckb_perf_count},
+                                    {NULL, NULL}};
+
+static void print_perf(lua_State *L) {
+    perf_table_t *t = L != NULL ? perf_table(L, 0) : NULL;
+    if (t == NULL) {
+        return;
+    }
+    char line[PERF_NAME_SIZE + 80];
+    for (int i = 0; i < t->count; i++) {
+        perf_entry_t *e = &t->entries[i];
+        snprintf_(line, sizeof(line), "PERF %s %lu %lu %ld", e->name,
+                  (unsigned long)e->calls, (unsigned long)e->cycles,
+                  (long)e->count);
+        ckb_debug(line);
+    }
+    t->count = 0;
+}
+
+#else
+
+static int lua_ckb_perf_nop(lua_State *L) {
+    lua_pushinteger(L, 0);
+    return 1;
+}
+
+static const luaL_Reg ckb_perf[] = {{"begin", lua_ckb_perf_nop},
+                                    {"finish", lua_ckb_perf_nop},
+                                    {"count", lua_ckb_perf_nop},
+                                    {NULL, NULL}};
+
+static void print_perf(lua_State *L) {}
+
+#endif
+
+static void open_perf(lua_State *L) {
+    luaL_newlib(L, ckb_perf);
+    lua_setfield(L, -2, "perf");
+}
@@ -0,0 +1,335 @@
+// Allocator of the lua state of the standalone loader. Most blocks allocated
+// by lua are small, and of a few sizes (strings, tables, nodes, closures,
+// upvalues, call infos). Blocks of up to POOL_SMALL_MAX bytes are thus kept in
+// free lists by size class, and new ones are cut from chunks allocated with
+// malloc, so that they need neither headers nor coalescing. Larger blocks are
+// allocated with malloc.
+//
+// Free blocks are only reused for their own size class, so a heap fragmented
+// by one class could fail allocations that malloc would satisfy. When malloc
+// fails, the chunks whose blocks are all free are thus given back to it (see
+// pool_trim), and small blocks are cut from free blocks of larger classes.
+//
+// Scripts run once before the whole VM is discarded, so collecting garbage is
+// often wasted work. In bump mode (see pool_start_bump), the collector is
+// stopped and freed blocks are not reused, until the pool has allocated a
+// given part of the heap. The pool then goes back to normal mode and has the
+// collector restart, which frees the garbage left so far.
+
+#define POOL_ALIGN 16
+#define POOL_SMALL_MAX 256
+#define POOL_CLASSES (POOL_SMALL_MAX / POOL_ALIGN)
+#define POOL_CHUNK_SIZE (32 * 1024)
+// Default percentage of the heap allocated in bump mode.
+#define POOL_BUMP_PERCENT 50
+
+typedef struct pool_block_t {
+    struct pool_block_t *next;
+} pool_block_t;
+
+typedef struct pool_chunk_t {
+    char *start;
+    size_t free; /* bytes of free blocks, counted by pool_trim */
+} pool_chunk_t;
+
+typedef struct pool_stats_t {
+    size_t allocs[POOL_CLASSES + 1]; /* by size class, large blocks last */
+    size_t reused;                   /* small blocks from a free list */
+    size_t chunks;                   /* chunks allocated with malloc */
+    size_t released;                 /* chunks given back to malloc */
+    size_t used;                     /* bytes in use, see pool_alloc */
+    size_t peak;                     /* highest value of 'used' */
+    size_t bumped;                   /* bytes allocated in bump mode */
+    int collector_restarted; /* whether bump mode has ended */
+} pool_stats_t;
+
+typedef struct pool_t {
+    char *top, *limit; /* free part of the current chunk */
+    pool_block_t *free[POOL_CLASSES];
+    pool_chunk_t *chunks; /* by address */
+    size_t chunk_count, chunk_capacity;
+    lua_State *bump_state; /* state whose collector is stopped, if any */
+    size_t bump_limit;     /* bytes allocated before leaving bump mode */
+    pool_stats_t stats;
+} pool_t;
+
+static pool_t s_pool;
+
+// Size class of a block of `n` bytes, from 1 to POOL_CLASSES, or 0 if the
+// block is allocated with malloc.
+static int pool_class(size_t n) {
+    return n <= POOL_SMALL_MAX ? (int)((n + POOL_ALIGN - 1) / POOL_ALIGN) : 0;
+}
+
+// Leave bump mode. Called by the allocator, which must not call lua_gc: the
+// collector restarts at its next step.
+static void pool_end_bump(pool_t *p) {
+    lua_gcrestartlater(p->bump_state);
+    p->bump_state = NULL;
+    p->stats.collector_restarted = 1;
+}
+
+static void pool_count(pool_t *p, ptrdiff_t delta) {
+    p->stats.used += delta;
+    if (p->stats.used > p->stats.peak) {
+        p->stats.peak = p->stats.used;
+    }
+    if (p->bump_state != NULL && delta > 0) {
+        p->stats.bumped += delta;
+        if (p->stats.bumped > p->bump_limit) {
+            pool_end_bump(p);
+        }
+    }
+}
+
+// Allocate a chunk with malloc and record it, or return NULL.
+static char *pool_new_chunk(pool_t *p) {
+    if (p->chunk_count == p->chunk_capacity) {
+        size_t capacity = p->chunk_capacity ? 2 * p->chunk_capacity : 64;
+        pool_chunk_t *chunks = realloc(p->chunks, capacity * sizeof(*chunks));
+        if (chunks == NULL) {
+            return NULL;
+        }
+        p->chunks = chunks;
+        p->chunk_capacity = capacity;
+    }
+    char *chunk = malloc(POOL_CHUNK_SIZE);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    size_t i = p->chunk_count++;
+    for (; i > 0 && p->chunks[i - 1].start > chunk; i--) {
+        p->chunks[i] = p->chunks[i - 1];
+    }
+    p->chunks[i].start = chunk;
+    p->stats.chunks++;
+    return chunk;
+}
+
+// Chunk of block `b`.
+static pool_chunk_t *pool_chunk_of(pool_t *p, const char *b) {
+    size_t low = 0, high = p->chunk_count;
+    while (high - low > 1) {
+        size_t middle = (low + high) / 2;
+        if (p->chunks[middle].start <= b) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return &p->chunks[low];
+}
+
+// Give the chunks whose blocks are all free back to malloc. Returns whether
+// there was any. Only run when malloc fails, as it walks the free lists.
+static int pool_trim(pool_t *p) {
+    if (p->chunk_count == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < p->chunk_count; i++) {
+        p->chunks[i].free = 0;
+    }
+    if (p->top < p->limit) {
+        pool_chunk_of(p, p->top)->free += p->limit - p->top;
+    }
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        for (pool_block_t *b = p->free[c]; b != NULL; b = b->next) {
+            pool_chunk_of(p, (char *)b)->free += (size_t)(c + 1) * POOL_ALIGN;
+        }
+    }
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        pool_block_t **b = &p->free[c];
+        while (*b != NULL) {
+            if (pool_chunk_of(p, (char *)*b)->free == POOL_CHUNK_SIZE) {
+                *b = (*b)->next;
+            } else {
+                b = &(*b)->next;
+            }
+        }
+    }
+    if (p->top < p->limit &&
+        pool_chunk_of(p, p->top)->free == POOL_CHUNK_SIZE) {
+        p->top = p->limit = NULL;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < p->chunk_count; i++) {
+        if (p->chunks[i].free == POOL_CHUNK_SIZE) {
+            free(p->chunks[i].start);
+        } else {
+            p->chunks[kept++] = p->chunks[i];
+        }
+    }
+    size_t released = p->chunk_count - kept;
+    p->chunk_count = kept;
+    p->stats.released += released;
+    return released > 0;
+}
+
+// Cut a block of size class `c` from a free block of a larger class, keeping
+// the rest in the free list of its size, or return NULL.
+static void *pool_split(pool_t *p, int c) {
+    for (int larger = c + 1; larger <= POOL_CLASSES; larger++) {
+        pool_block_t *b = p->free[larger - 1];
+        if (b != NULL) {
+            pool_block_t *rest =
+                (pool_block_t *)((char *)b + (size_t)c * POOL_ALIGN);
+            p->free[larger - 1] = b->next;
+            rest->next = p->free[larger - c - 1];
+            p->free[larger - c - 1] = rest;
+            p->stats.reused++;
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// malloc, after giving the empty chunks back to it if it fails.
+static void *pool_malloc(pool_t *p, void *ptr, size_t n) {
+    void *block = realloc(ptr, n);
+    if (block == NULL && pool_trim(p)) {
+        block = realloc(ptr, n);
+    }
+    return block;
+}
+
+static void *pool_take(pool_t *p, int c) {
+    size_t n = (size_t)c * POOL_ALIGN;
+    pool_block_t *b = p->free[c - 1];
+    p->stats.allocs[c - 1]++;
+    if (b != NULL) {
+        p->free[c - 1] = b->next;
+        p->stats.reused++;
+        return b;
+    }
+    if ((size_t)(p->limit - p->top) < n) {
+        char *chunk = pool_new_chunk(p);
+        if (chunk == NULL && pool_trim(p)) {
+            chunk = pool_new_chunk(p);
+        }
+        if (chunk == NULL) {
+            b = pool_split(p, c);
+            if (b == NULL) {
+                p->stats.allocs[c - 1]--;
+            }
+            return b;
+        }
+        size_t rest = p->limit - p->top;
+        if (rest >= POOL_ALIGN) { /* keep the end of the previous chunk */
+            b = (pool_block_t *)p->top;
+            b->next = p->free[rest / POOL_ALIGN - 1];
+            p->free[rest / POOL_ALIGN - 1] = b;
+        }
+        p->top = chunk;
+        p->limit = chunk + POOL_CHUNK_SIZE;
+    }
+    b = (pool_block_t *)p->top;
+    p->top += n;
+    return b;
+}
+
+static void pool_release(pool_t *p, void *ptr, int c) {
+    if (p->bump_state != NULL) {
+        return;
+    }
+    pool_block_t *b = (pool_block_t *)ptr;
+    b->next = p->free[c - 1];
+    p->free[c - 1] = b;
+}
+
+static void *pool_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    pool_t *p = (pool_t *)ud;
+    int oc = ptr == NULL ? -1 : pool_class(osize);
+    int nc = pool_class(nsize);
+    size_t on = oc > 0 ? (size_t)oc * POOL_ALIGN : oc == 0 ? osize : 0;
+    size_t nn = nc > 0 ? (size_t)nc * POOL_ALIGN : nsize;
+    // Blocks freed in bump mode are dropped, and stay in use.
+    size_t freed = p->bump_state == NULL ? on : 0;
+    void *block;
+    if (nsize == 0) {
+        if (oc > 0) {
+            pool_release(p, ptr, oc);
+        } else if (oc == 0 && p->bump_state == NULL) {
+            free(ptr);
+        }
+        pool_count(p, -(ptrdiff_t)freed);
+        return NULL;
+    }
+    if (oc == nc && nc > 0) { /* same size class */
+        return ptr;
+    }
+    if (oc == 0 && nc == 0) {
+        block = pool_malloc(p, ptr, nsize);
+        if (block == NULL) {
+            if (p->bump_state != NULL) {
+                pool_end_bump(p);
+            }
+            return NULL;
+        }
+        p->stats.allocs[POOL_CLASSES]++;
+        pool_count(p, (ptrdiff_t)nn - (ptrdiff_t)on);
+        return block;
+    }
+    if (nc > 0) {
+        block = pool_take(p, nc);
+    } else {
+        block = pool_malloc(p, NULL, nsize);
+        p->stats.allocs[POOL_CLASSES] += block != NULL;
+    }
+    if (block == NULL && p->bump_state != NULL) {
+        // Out of memory: lua collects garbage and tries again, which must
+        // give blocks back to the pool.
+        pool_end_bump(p);
+    }
+    if (block == NULL) {
+        // Shrinking must not fail: keep the block, which can be used as a
+        // block of the smaller size class once freed.
+        return oc >= 0 && nsize <= osize ? ptr : NULL;
+    }
+    if (oc >= 0) {
+        memcpy(block, ptr, osize < nsize ? osize : nsize);
+        if (oc > 0) {
+            pool_release(p, ptr, oc);
+        } else if (p->bump_state == NULL) {
+            free(ptr);
+        }
+    }
+    pool_count(p, (ptrdiff_t)nn - (ptrdiff_t)freed);
+    return block;
+}
+
+// Put the pool of `L` in bump mode until it has allocated `percent` % of the
+// heap (POOL_BUMP_PERCENT if 0). Does nothing if `L` does not use the pool.
+static void pool_start_bump(lua_State *L, int percent) {
+    void *ud;
+    if (lua_getallocf(L, &ud) != pool_alloc) {
+        return;
+    }
+    pool_t *p = (pool_t *)ud;
+    if (percent <= 0 || percent > 100) {
+        percent = POOL_BUMP_PERCENT;
+    }
+    p->bump_limit = (s_brk_max - s_brk_min) / 100 * percent;
+    p->bump_state = L;
+    p->stats.bumped = 0;
+    lua_gc(L, LUA_GCSTOP);
+}
+
+// Print the allocation statistics of the pool, each line prefixed with
+// "POOL ".
+static void print_pool_stats(const pool_t *p) {
+    printf(
+        "POOL used %zu peak %zu chunks %zu reused %zu large %zu released %zu\n",
+        p->stats.used, p->stats.peak, p->stats.chunks, p->stats.reused,
+        p->stats.allocs[POOL_CLASSES], p->stats.released);
+    if (p->bump_state != NULL || p->stats.collector_restarted) {
+        printf("POOL bumped %zu of %zu collector %s\n", p->stats.bumped,
+               p->bump_limit,
+               p->stats.collector_restarted ? "restarted" : "never restarted");
+    }
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        if (p->stats.allocs[c] != 0) {
+            printf("POOL size %d allocs %zu\n", (c + 1) * POOL_ALIGN,
+                   p->stats.allocs[c]);
+        }
+    }
+}
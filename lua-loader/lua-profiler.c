@@ -0,0 +1,278 @@
+// Cycle profiler of the standalone loader, enabled with -p or bit 8 of the lua
+// loader args. Call and return hooks read the cycle counter of the VM and
+// attribute cycles to the nodes of a call tree, each node being a function
+// called through a given stack of functions. Cycles spent in the hooks are
+// not counted.
+//
+// When the script ends, the tree is printed with ckb_debug in the folded
+// stack format of flame graph tools, one line per node with the cycles spent
+// in the function itself (its exclusive cycles):
+//
+//   PROFILE main chunk@main.lua:0;f@main.lua:3;g@main.lua:8 1234
+//
+// followed by the calls, inclusive and exclusive cycles of each function:
+//
+//   PROFILE_FUNCTION g@main.lua:8 3 2000 1234
+//
+// Frames unwound by an error get no return event: they end when the function
+// that caught the error (e.g. pcall) returns. Coroutines are profiled as if
+// their functions were called by the functions resuming them.
+
+#define PROFILE_NAME_SIZE 64
+#define PROFILE_LINE_SIZE 1024
+
+typedef struct profile_function_t {
+    const void *key; /* source of a lua function, or a C function */
+    int line;        /* line where a lua function is defined */
+    char name[PROFILE_NAME_SIZE];
+    uint64_t calls, inclusive, exclusive;
+    struct profile_function_t *next;
+} profile_function_t;
+
+typedef struct profile_node_t {
+    profile_function_t *function;
+    struct profile_node_t *parent, *child, *sibling;
+    uint64_t calls, cycles; /* exclusive cycles */
+} profile_node_t;
+
+typedef struct profile_frame_t {
+    profile_node_t *node;
+    uint64_t start;    /* time of the call */
+    uint64_t children; /* cycles of the calls made by the function */
+} profile_frame_t;
+
+typedef struct profiler_t {
+    lua_State *L;
+    profile_node_t root;
+    profile_function_t *functions;
+    profile_frame_t *frames;
+    int depth, capacity;
+    uint64_t overhead; /* cycles spent in the hooks */
+} profiler_t;
+
+static profiler_t *s_profiler = NULL;
+
+// Name a function "name@source:line", without the characters that separate
+// frames and counts in the folded format.
+static void profile_name(lua_State *L, lua_Debug *ar, char *name) {
+    const char *fname = ar->name;
+    if (fname == NULL) {
+        fname = *ar->what == 'm' ? "main chunk" : "?";
+    }
+    snprintf_(name, PROFILE_NAME_SIZE, "%s@%s:%d", fname, ar->short_src,
+              ar->linedefined);
+    for (char *c = name; *c != '\0'; c++) {
+        if (*c == ' ' || *c == ';') {
+            *c = '_';
+        }
+    }
+}
+
+static profile_function_t *profile_function(profiler_t *p, lua_State *L,
+                                            lua_Debug *ar, const void *key,
+                                            int line) {
+    profile_function_t *f;
+    for (f = p->functions; f != NULL; f = f->next) {
+        if (f->key == key && f->line == line) {
+            return f;
+        }
+    }
+    f = calloc(1, sizeof(profile_function_t));
+    if (f != NULL) {
+        f->key = key;
+        f->line = line;
+        lua_getinfo(L, "n", ar);
+        profile_name(L, ar, f->name);
+        f->next = p->functions;
+        p->functions = f;
+    }
+    return f;
+}
+
+static void profile_call(profiler_t *p, lua_State *L, lua_Debug *ar,
+                         profile_node_t *parent, const void *key, int line,
+                         uint64_t now) {
+    profile_node_t *node;
+    for (node = parent->child; node != NULL; node = node->sibling) {
+        if (node->function->key == key && node->function->line == line) {
+            break;
+        }
+    }
+    if (node == NULL) {
+        profile_function_t *f = profile_function(p, L, ar, key, line);
+        node = f != NULL ? calloc(1, sizeof(profile_node_t)) : NULL;
+        if (node == NULL) {
+            return; /* out of memory, the cycles go to the caller */
+        }
+        node->function = f;
+        node->parent = parent;
+        node->sibling = parent->child;
+        parent->child = node;
+    }
+    if (p->depth == p->capacity) {
+        int capacity = p->capacity * 2 + 16;
+        profile_frame_t *frames =
+            realloc(p->frames, capacity * sizeof(profile_frame_t));
+        if (frames == NULL) {
+            return;
+        }
+        p->frames = frames;
+        p->capacity = capacity;
+    }
+    node->calls++;
+    p->frames[p->depth++] = (profile_frame_t){node, now, 0};
+}
+
+// End the frames above `depth`.
+static void profile_return(profiler_t *p, int depth, uint64_t now) {
+    while (p->depth > depth) {
+        profile_frame_t *frame = &p->frames[--p->depth];
+        uint64_t cycles = now - frame->start;
+        frame->node->cycles += cycles - frame->children;
+        if (p->depth > 0) {
+            p->frames[p->depth - 1].children += cycles;
+        }
+    }
+}
+
+static void profile_hook(lua_State *L, lua_Debug *ar) {
+    profiler_t *p = s_profiler;
+    uint64_t start = ckb_current_cycles();
+    uint64_t now = start - p->overhead;
+    const void *key;
+    int line;
+    lua_getinfo(L, "Sf", ar);
+    if (*ar->what == 'C') {
+        key = (const void *)lua_tocfunction(L, -1);
+        line = -1;
+    } else {
+        key = ar->source;
+        line = ar->linedefined;
+    }
+    lua_pop(L, 1);
+    if (ar->event == LUA_HOOKRET) {
+        // Also end the frames unwound by an error, if any.
+        for (int i = p->depth - 1; i >= 0; i--) {
+            profile_function_t *f = p->frames[i].node->function;
+            if (f->key == key && f->line == line) {
+                profile_return(p, i, now);
+                break;
+            }
+        }
+    } else {
+        if (ar->event == LUA_HOOKTAILCALL && p->depth > 0) {
+            profile_return(p, p->depth - 1, now); /* the caller is gone */
+        }
+        profile_call(p, L, ar,
+                     p->depth > 0 ? p->frames[p->depth - 1].node : &p->root,
+                     key, line, now);
+    }
+    p->overhead += ckb_current_cycles() - start;
+}
+
+static void start_profile(lua_State *L) {
+    s_profiler = calloc(1, sizeof(profiler_t));
+    if (s_profiler == NULL) {
+        printf("Error while starting profiler: not enough memory\n");
+        return;
+    }
+    s_profiler->L = L;
+    lua_sethook(L, profile_hook, LUA_MASKCALL | LUA_MASKRET, 0);
+}
+
+// Print the folded stack of `node`, followed by its exclusive cycles.
+static void print_profile_node(const profile_node_t *node) {
+    char line[PROFILE_LINE_SIZE];
+    const profile_node_t *stack[PROFILE_LINE_SIZE / 2];
+    int depth = 0, len = snprintf_(line, sizeof(line), "PROFILE ");
+    for (; node->parent != NULL && depth < PROFILE_LINE_SIZE / 2;
+         node = node->parent) {
+        stack[depth++] = node;
+    }
+    while (depth > 0 && len < PROFILE_LINE_SIZE) {
+        const profile_node_t *n = stack[--depth];
+        len += snprintf_(line + len, sizeof(line) - len, "%s%s",
+                         n->function->name, depth > 0 ? ";" : "");
+    }
+    if (len < PROFILE_LINE_SIZE) {
+        snprintf_(line + len, sizeof(line) - len, " %lu",
+                  (unsigned long)stack[0]->cycles);
+    }
+    ckb_debug(line);
+}
+
+// Inclusive cycles of `node`, added to the functions it calls, unless they
+// are recursive calls, which are already counted.
+static uint64_t profile_inclusive(profile_node_t *node) {
+    uint64_t cycles = node->cycles;
+    for (profile_node_t *child = node->child; child != NULL;
+         child = child->sibling) {
+        cycles += profile_inclusive(child);
+    }
+    profile_function_t *f = node->function;
+    if (f != NULL) {
+        const profile_node_t *n = node->parent;
+        while (n != NULL && n->function != f) {
+            n = n->parent;
+        }
+        if (n == NULL) {
+            f->inclusive += cycles;
+        }
+        f->exclusive += node->cycles;
+        f->calls += node->calls;
+    }
+    return cycles;
+}
+
+static void free_profile_node(profile_node_t *node) {
+    while (node != NULL) {
+        profile_node_t *sibling = node->sibling;
+        free_profile_node(node->child);
+        free(node);
+        node = sibling;
+    }
+}
+
+// Stop profiling and print the profile, see above. Does nothing if the
+// profiler is not running.
+static void finish_profile(void) {
+    profiler_t *p = s_profiler;
+    if (p == NULL) {
+        return;
+    }
+    s_profiler = NULL;
+    lua_sethook(p->L, NULL, 0, 0);
+    profile_return(p, 0, ckb_current_cycles() - p->overhead);
+    const profile_node_t *node = p->root.child;
+    while (node != NULL) {
+        if (node->cycles != 0) {
+            print_profile_node(node);
+        }
+        if (node->child != NULL) {
+            node = node->child;
+            continue;
+        }
+        while (node != NULL && node->sibling == NULL) {
+            node = node->parent == &p->root ? NULL : node->parent;
+        }
+        if (node != NULL) {
+            node = node->sibling;
+        }
+    }
+    profile_inclusive(&p->root);
+    char line[PROFILE_LINE_SIZE];
+    for (profile_function_t *f = p->functions; f != NULL; f = f->next) {
+        snprintf_(line, sizeof(line), "PROFILE_FUNCTION %s %lu %lu %lu",
+                  f->name, (unsigned long)f->calls,
+                  (unsigned long)f->inclusive, (unsigned long)f->exclusive);
+        ckb_debug(line);
+    }
+    free_profile_node(p->root.child);
+    while (p->functions != NULL) {
+        profile_function_t *f = p->functions;
+        p->functions = f->next;
+        free(f);
+    }
+    free(p->frames);
+    free(p);
+}
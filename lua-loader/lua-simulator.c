@@ -0,0 +1,1132 @@
+// Syscalls of the native build of the lua loader, see lua-loader-sim in the
+// Makefile, which runs on the host the same contracts, on the same mocked
+// transactions, as ckb-debugger does, so that they can be profiled with perf
+// and checked with valgrind or the sanitizers:
+//
+//   build/lua-loader-sim --tx-file tests/test_cases/sample_data1.json
+//       --script-group-type type --script-hash 0xca50...
+//       --read-file script.lua -- -r
+//
+// The options are the ones of ckb-debugger, and the arguments after -- are
+// the ones of the loader. --bin and --max-cycles are ignored, so that the
+// tests can run with CKB-DEBUGGER=lua-loader-sim. The script to run is given
+// by its hash, or by the index and the type (input or output) of the cell it
+// is the lock or the type script of. Without --tx-file, the transaction is
+// empty.
+//
+// Cells, inputs, witnesses, scripts and the transaction are loaded from the
+// mocked transaction (the "mock_info" and "tx" of ckb-debugger), serialized
+// with molecule and hashed with blake2b as on chain. Headers, dep groups,
+// exec, spawn and loading code from cells are not simulated: the run stops
+// with a message when a script needs them. The cycles of ckb_current_cycles
+// are the nanoseconds elapsed since the start.
+//
+// With --replay-file, the syscalls are instead served from a record of them,
+// as printed by the loader with -kr (see lua-syscall-record.c), so that a
+// transaction can run again, bit for bit, without its mocked transaction. The
+// record is looked up by cell, input, header or witness and by offset, not in
+// the order of the calls, so that changes to the loader or lualib that load
+// the same data differently still replay. The run stops with a message when a
+// script loads something that is not in the record.
+//
+// The loader and lualib allocate with the malloc of the host, renamed to
+// ckb_simulator_malloc and so on by the Makefile, which fails once the heap
+// of the VM, given by malloc_config (see lua-simulator.h), is used.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
+#include <time.h>
+
+#include "blake2b.h"
+#include "cJSON.h"
+#include "ckb_consts.h"
+#include "ckb_syscall_apis.h"
+#define MOLECULE_API_DECORATOR static
+#include "blockchain.h"
+
+#define SIM_HASH_SIZE 32
+#define SIM_PRINTF_BUFFER_SIZE 1024
+
+typedef struct sim_cell_t {
+    mol_seg_t output; /* CellOutput */
+    mol_seg_t lock;   /* Script */
+    mol_seg_t type;   /* Script, empty if the cell has no type script */
+    mol_seg_t data;
+    mol_seg_t input; /* CellInput, of the inputs only */
+    uint64_t capacity;
+    int has_header; /* in the mocked transaction */
+    uint8_t data_hash[SIM_HASH_SIZE];
+    uint8_t lock_hash[SIM_HASH_SIZE];
+    uint8_t type_hash[SIM_HASH_SIZE];
+} sim_cell_t;
+
+typedef struct sim_cells_t {
+    sim_cell_t *cells;
+    size_t count;
+} sim_cells_t;
+
+typedef struct sim_group_t {
+    size_t *indices; /* of the cells running the script */
+    size_t count;
+} sim_group_t;
+
+static sim_cells_t s_inputs, s_outputs, s_cell_deps;
+static sim_group_t s_group_inputs, s_group_outputs;
+static mol_seg_t *s_witnesses;
+static size_t s_witness_count;
+static size_t s_header_dep_count;
+static mol_seg_t s_script;
+static uint8_t s_script_hash[SIM_HASH_SIZE];
+static mol_seg_t s_transaction;
+static uint8_t s_tx_hash[SIM_HASH_SIZE];
+static const char *s_read_file = NULL;
+static int s_replaying = 0; /* whether syscalls are served by sim_replay */
+static struct timespec s_start;
+
+static const char *s_empty_tx =
+    "{\"mock_info\": {\"inputs\": [], \"cell_deps\": [], \"header_deps\": []},"
+    " \"tx\": {\"version\": \"0x0\", \"cell_deps\": [], \"header_deps\": [],"
+    " \"inputs\": [], \"outputs\": [], \"outputs_data\": [],"
+    " \"witnesses\": []}}";
+
+static void sim_fail(const char *format, ...) {
+    va_list va;
+    va_start(va, format);
+    fprintf(stderr, "lua-loader-sim: ");
+    vfprintf(stderr, format, va);
+    fprintf(stderr, "\n");
+    va_end(va);
+    exit(EXIT_FAILURE);
+}
+
+static void sim_hash(const void *data, size_t size, uint8_t *hash) {
+    blake2b_state s;
+    ckb_blake2b_init(&s, SIM_HASH_SIZE);
+    blake2b_update(&s, data, size);
+    blake2b_final(&s, hash, SIM_HASH_SIZE);
+}
+
+static cJSON *sim_field(const cJSON *json, const char *name) {
+    cJSON *field = cJSON_GetObjectItem(json, name);
+    if (field == NULL) {
+        sim_fail("no %s in the transaction", name);
+    }
+    return field;
+}
+
+static const char *sim_string(const cJSON *json, const char *name) {
+    cJSON *field = sim_field(json, name);
+    if (!cJSON_IsString(field)) {
+        sim_fail("%s is not a string", name);
+    }
+    return field->valuestring;
+}
+
+static uint64_t sim_number(const cJSON *json, const char *name) {
+    return strtoull(sim_string(json, name), NULL, 16);
+}
+
+static int sim_nibble(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Bytes of the hex string `hex`, with or without a 0x prefix, named `name` in
+// errors. Not with sscanf, which scans the rest of the string at each call,
+// the witnesses of the tests are megabytes long.
+static mol_seg_t sim_hex(const char *hex, const char *name) {
+    if (hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X')) {
+        hex += 2;
+    }
+    size_t length = strlen(hex);
+    if (length % 2 != 0) {
+        sim_fail("%s is not hex", name);
+    }
+    mol_seg_t bytes = {malloc(length / 2 + 1), length / 2};
+    for (size_t i = 0; i < bytes.size; i++) {
+        int high = sim_nibble(hex[2 * i]), low = sim_nibble(hex[2 * i + 1]);
+        if (high < 0 || low < 0) {
+            sim_fail("%s is not hex", name);
+        }
+        bytes.ptr[i] = (uint8_t)(high << 4 | low);
+    }
+    return bytes;
+}
+
+static mol_seg_t sim_bytes(const cJSON *json, const char *name) {
+    return sim_hex(sim_string(json, name), name);
+}
+
+static void sim_hash_hex(const char *hex, const char *name, uint8_t *hash) {
+    mol_seg_t bytes = sim_hex(hex, name);
+    if (bytes.size != SIM_HASH_SIZE) {
+        sim_fail("%s is not a hash", name);
+    }
+    memcpy(hash, bytes.ptr, SIM_HASH_SIZE);
+    free(bytes.ptr);
+}
+
+static void sim_hash_field(const cJSON *json, const char *name,
+                           uint8_t *hash) {
+    sim_hash_hex(sim_string(json, name), name, hash);
+}
+
+static void sim_pack_u32(uint8_t *dst, uint32_t n) {
+    for (int i = 0; i < 4; i++) {
+        dst[i] = (uint8_t)(n >> (8 * i));
+    }
+}
+
+static void sim_pack_u64(uint8_t *dst, uint64_t n) {
+    for (int i = 0; i < 8; i++) {
+        dst[i] = (uint8_t)(n >> (8 * i));
+    }
+}
+
+// Molecule Bytes of `data`.
+static mol_seg_t sim_build_bytes(mol_seg_t data) {
+    mol_seg_t bytes = {malloc(data.size + 4), data.size + 4};
+    sim_pack_u32(bytes.ptr, data.size);
+    memcpy(bytes.ptr + 4, data.ptr, data.size);
+    return bytes;
+}
+
+// Script of `json`, or an empty segment if it is null.
+static mol_seg_t sim_build_script(const cJSON *json) {
+    mol_seg_t script = {NULL, 0};
+    if (json == NULL || cJSON_IsNull(json)) {
+        return script;
+    }
+    const char *hash_types[] = {"data", "type", "data1", "", "data2"};
+    const char *hash_type = sim_string(json, "hash_type");
+    uint8_t t = 0;
+    while (t < 5 && strcmp(hash_types[t], hash_type) != 0) {
+        t++;
+    }
+    if (t == 5) {
+        sim_fail("unknown hash type %s", hash_type);
+    }
+    uint8_t code_hash[SIM_HASH_SIZE];
+    sim_hash_field(json, "code_hash", code_hash);
+    mol_seg_t args = sim_bytes(json, "args");
+    mol_seg_t args_bytes = sim_build_bytes(args);
+    mol_builder_t b;
+    MolBuilder_Script_init(&b);
+    MolBuilder_Script_set_code_hash(&b, code_hash, SIM_HASH_SIZE);
+    MolBuilder_Script_set_hash_type(&b, t);
+    MolBuilder_Script_set_args(&b, args_bytes.ptr, args_bytes.size);
+    mol_seg_res_t res = MolBuilder_Script_build(b);
+    free(args.ptr);
+    free(args_bytes.ptr);
+    return res.seg;
+}
+
+static mol_seg_t sim_build_out_point(const cJSON *json) {
+    uint8_t tx_hash[SIM_HASH_SIZE], index[4];
+    sim_hash_field(json, "tx_hash", tx_hash);
+    sim_pack_u32(index, (uint32_t)sim_number(json, "index"));
+    mol_builder_t b;
+    MolBuilder_OutPoint_init(&b);
+    MolBuilder_OutPoint_set_tx_hash(&b, tx_hash);
+    MolBuilder_OutPoint_set_index(&b, index);
+    return MolBuilder_OutPoint_build(b).seg;
+}
+
+static mol_seg_t sim_build_cell_input(const cJSON *json) {
+    uint8_t since[8];
+    sim_pack_u64(since, sim_number(json, "since"));
+    mol_seg_t out_point =
+        sim_build_out_point(sim_field(json, "previous_output"));
+    mol_builder_t b;
+    MolBuilder_CellInput_init(&b);
+    MolBuilder_CellInput_set_since(&b, since);
+    MolBuilder_CellInput_set_previous_output(&b, out_point.ptr);
+    free(out_point.ptr);
+    return MolBuilder_CellInput_build(b).seg;
+}
+
+static mol_seg_t sim_build_cell_dep(const cJSON *json) {
+    const char *dep_type = sim_string(json, "dep_type");
+    mol_seg_t out_point = sim_build_out_point(sim_field(json, "out_point"));
+    mol_builder_t b;
+    MolBuilder_CellDep_init(&b);
+    MolBuilder_CellDep_set_out_point(&b, out_point.ptr);
+    MolBuilder_CellDep_set_dep_type(&b, strcmp(dep_type, "code") == 0 ? 0 : 1);
+    free(out_point.ptr);
+    return MolBuilder_CellDep_build(b).seg;
+}
+
+// Cell of the CellOutput `output` with `data`.
+static void sim_init_cell(sim_cell_t *cell, const cJSON *output,
+                          mol_seg_t data) {
+    uint8_t capacity[8];
+    cell->capacity = sim_number(output, "capacity");
+    cell->lock = sim_build_script(sim_field(output, "lock"));
+    cell->type = sim_build_script(cJSON_GetObjectItem(output, "type"));
+    cell->data = data;
+    sim_pack_u64(capacity, cell->capacity);
+    mol_builder_t b;
+    MolBuilder_CellOutput_init(&b);
+    MolBuilder_CellOutput_set_capacity(&b, capacity, 8);
+    MolBuilder_CellOutput_set_lock(&b, cell->lock.ptr, cell->lock.size);
+    MolBuilder_CellOutput_set_type_(&b, cell->type.ptr, cell->type.size);
+    cell->output = MolBuilder_CellOutput_build(b).seg;
+    // The hash of empty data is zero on chain.
+    if (data.size > 0) {
+        sim_hash(data.ptr, data.size, cell->data_hash);
+    }
+    sim_hash(cell->lock.ptr, cell->lock.size, cell->lock_hash);
+    if (cell->type.size > 0) {
+        sim_hash(cell->type.ptr, cell->type.size, cell->type_hash);
+    }
+}
+
+// Whether the mocked cell `item` has a header, which is left out or null.
+static int sim_has_header(const cJSON *item) {
+    const cJSON *header = cJSON_GetObjectItem(item, "header");
+    return header != NULL && !cJSON_IsNull(header);
+}
+
+static void sim_init_cells(sim_cells_t *cells, const cJSON *array) {
+    cells->count = cJSON_GetArraySize(array);
+    cells->cells = calloc(cells->count + 1, sizeof(sim_cell_t));
+}
+
+// Load the mocked transaction in `json`, and serialize it.
+static void sim_load_transaction(const cJSON *json) {
+    const cJSON *mock_info = sim_field(json, "mock_info");
+    const cJSON *tx = sim_field(json, "tx");
+    const cJSON *item;
+    size_t i;
+
+    const cJSON *inputs = sim_field(mock_info, "inputs");
+    const cJSON *tx_inputs = sim_field(tx, "inputs");
+    sim_init_cells(&s_inputs, inputs);
+    if ((size_t)cJSON_GetArraySize(tx_inputs) != s_inputs.count) {
+        sim_fail("the inputs of tx and mock_info differ");
+    }
+    i = 0;
+    cJSON_ArrayForEach(item, inputs) {
+        sim_cell_t *cell = &s_inputs.cells[i];
+        sim_init_cell(cell, sim_field(item, "output"), sim_bytes(item, "data"));
+        cell->has_header = sim_has_header(item);
+        cell->input = sim_build_cell_input(cJSON_GetArrayItem(tx_inputs, i));
+        i++;
+    }
+    const cJSON *cell_deps = sim_field(mock_info, "cell_deps");
+    sim_init_cells(&s_cell_deps, cell_deps);
+    i = 0;
+    cJSON_ArrayForEach(item, cell_deps) {
+        sim_cell_t *cell = &s_cell_deps.cells[i++];
+        sim_init_cell(cell, sim_field(item, "output"), sim_bytes(item, "data"));
+        cell->has_header = sim_has_header(item);
+    }
+    const cJSON *outputs = sim_field(tx, "outputs");
+    const cJSON *outputs_data = sim_field(tx, "outputs_data");
+    sim_init_cells(&s_outputs, outputs);
+    if ((size_t)cJSON_GetArraySize(outputs_data) != s_outputs.count) {
+        sim_fail("outputs and outputs_data differ");
+    }
+    i = 0;
+    cJSON_ArrayForEach(item, outputs) {
+        const char *data = cJSON_GetStringValue(
+            cJSON_GetArrayItem(outputs_data, i));
+        sim_init_cell(&s_outputs.cells[i++], item,
+                      sim_hex(data ? data : "", "outputs_data"));
+    }
+    s_header_dep_count =
+        cJSON_GetArraySize(sim_field(mock_info, "header_deps"));
+
+    mol_builder_t b;
+    MolBuilder_CellDepVec_init(&b);
+    cJSON_ArrayForEach(item, sim_field(tx, "cell_deps")) {
+        mol_seg_t cell_dep = sim_build_cell_dep(item);
+        MolBuilder_CellDepVec_push(&b, cell_dep.ptr);
+        free(cell_dep.ptr);
+    }
+    mol_seg_t cell_dep_vec = MolBuilder_CellDepVec_build(b).seg;
+    MolBuilder_Byte32Vec_init(&b);
+    cJSON_ArrayForEach(item, sim_field(tx, "header_deps")) {
+        uint8_t hash[SIM_HASH_SIZE];
+        const char *hex = cJSON_GetStringValue(item);
+        sim_hash_hex(hex ? hex : "", "header_deps", hash);
+        MolBuilder_Byte32Vec_push(&b, hash);
+    }
+    mol_seg_t header_dep_vec = MolBuilder_Byte32Vec_build(b).seg;
+    MolBuilder_CellInputVec_init(&b);
+    for (i = 0; i < s_inputs.count; i++) {
+        MolBuilder_CellInputVec_push(&b, s_inputs.cells[i].input.ptr);
+    }
+    mol_seg_t input_vec = MolBuilder_CellInputVec_build(b).seg;
+    MolBuilder_CellOutputVec_init(&b);
+    for (i = 0; i < s_outputs.count; i++) {
+        MolBuilder_CellOutputVec_push(&b, s_outputs.cells[i].output.ptr,
+                                      s_outputs.cells[i].output.size);
+    }
+    mol_seg_t output_vec = MolBuilder_CellOutputVec_build(b).seg;
+    MolBuilder_BytesVec_init(&b);
+    for (i = 0; i < s_outputs.count; i++) {
+        mol_seg_t bytes = sim_build_bytes(s_outputs.cells[i].data);
+        MolBuilder_BytesVec_push(&b, bytes.ptr, bytes.size);
+        free(bytes.ptr);
+    }
+    mol_seg_t outputs_data_vec = MolBuilder_BytesVec_build(b).seg;
+    uint8_t version[4];
+    sim_pack_u32(version, (uint32_t)sim_number(tx, "version"));
+    MolBuilder_RawTransaction_init(&b);
+    MolBuilder_RawTransaction_set_version(&b, version, 4);
+    MolBuilder_RawTransaction_set_cell_deps(&b, cell_dep_vec.ptr,
+                                            cell_dep_vec.size);
+    MolBuilder_RawTransaction_set_header_deps(&b, header_dep_vec.ptr,
+                                              header_dep_vec.size);
+    MolBuilder_RawTransaction_set_inputs(&b, input_vec.ptr, input_vec.size);
+    MolBuilder_RawTransaction_set_outputs(&b, output_vec.ptr, output_vec.size);
+    MolBuilder_RawTransaction_set_outputs_data(&b, outputs_data_vec.ptr,
+                                               outputs_data_vec.size);
+    mol_seg_t raw = MolBuilder_RawTransaction_build(b).seg;
+    sim_hash(raw.ptr, raw.size, s_tx_hash);
+    free(cell_dep_vec.ptr);
+    free(header_dep_vec.ptr);
+    free(input_vec.ptr);
+    free(output_vec.ptr);
+    free(outputs_data_vec.ptr);
+
+    const cJSON *witnesses = sim_field(tx, "witnesses");
+    s_witness_count = cJSON_GetArraySize(witnesses);
+    s_witnesses = calloc(s_witness_count + 1, sizeof(mol_seg_t));
+    MolBuilder_BytesVec_init(&b);
+    i = 0;
+    cJSON_ArrayForEach(item, witnesses) {
+        const char *hex = cJSON_GetStringValue(item);
+        s_witnesses[i] = sim_hex(hex ? hex : "", "witnesses");
+        mol_seg_t bytes = sim_build_bytes(s_witnesses[i++]);
+        MolBuilder_BytesVec_push(&b, bytes.ptr, bytes.size);
+        free(bytes.ptr);
+    }
+    mol_seg_t witness_vec = MolBuilder_BytesVec_build(b).seg;
+    MolBuilder_Transaction_init(&b);
+    MolBuilder_Transaction_set_raw(&b, raw.ptr, raw.size);
+    MolBuilder_Transaction_set_witnesses(&b, witness_vec.ptr, witness_vec.size);
+    s_transaction = MolBuilder_Transaction_build(b).seg;
+    free(raw.ptr);
+    free(witness_vec.ptr);
+}
+
+static int sim_same_script(mol_seg_t a, mol_seg_t b) {
+    return a.size > 0 && a.size == b.size && memcmp(a.ptr, b.ptr, a.size) == 0;
+}
+
+static void sim_add_group(sim_group_t *group, const sim_cells_t *cells,
+                          int lock) {
+    group->indices = calloc(cells->count + 1, sizeof(size_t));
+    group->count = 0;
+    for (size_t i = 0; i < cells->count; i++) {
+        const sim_cell_t *cell = &cells->cells[i];
+        if (sim_same_script(lock ? cell->lock : cell->type, s_script)) {
+            group->indices[group->count++] = i;
+        }
+    }
+}
+
+// Run the lock (if `lock`) or type script of the cell `cell_index` of
+// `cell_type` ("input" or "output"), or the one of `script_hash` if not NULL.
+static void sim_select_script(int lock, const char *cell_type,
+                              size_t cell_index, const char *script_hash) {
+    if (script_hash != NULL) {
+        uint8_t hash[SIM_HASH_SIZE];
+        sim_hash_hex(script_hash, "--script-hash", hash);
+        const sim_cells_t *cells[] = {&s_inputs, &s_outputs};
+        for (int c = 0; c < 2 && s_script.size == 0; c++) {
+            for (size_t i = 0; i < cells[c]->count; i++) {
+                const sim_cell_t *cell = &cells[c]->cells[i];
+                if (memcmp(lock ? cell->lock_hash : cell->type_hash, hash,
+                           SIM_HASH_SIZE) == 0) {
+                    s_script = lock ? cell->lock : cell->type;
+                    break;
+                }
+            }
+        }
+        if (s_script.size == 0) {
+            sim_fail("no script of hash %s", script_hash);
+        }
+    } else if (s_inputs.count == 0 && s_outputs.count == 0) {
+        // No cells: an always success lock script.
+        cJSON *json = cJSON_Parse(
+            "{\"code_hash\": \"0x00000000000000000000000000000000000000000000"
+            "00000000000000000000\", \"hash_type\": \"data1\", \"args\": "
+            "\"0x\"}");
+        s_script = sim_build_script(json);
+        cJSON_Delete(json);
+    } else {
+        const sim_cells_t *cells =
+            strcmp(cell_type, "output") == 0 ? &s_outputs : &s_inputs;
+        if (cell_index >= cells->count) {
+            sim_fail("no %s %zu", cell_type, cell_index);
+        }
+        const sim_cell_t *cell = &cells->cells[cell_index];
+        s_script = lock ? cell->lock : cell->type;
+        if (s_script.size == 0) {
+            sim_fail("%s %zu has no type script", cell_type, cell_index);
+        }
+    }
+    sim_hash(s_script.ptr, s_script.size, s_script_hash);
+    sim_add_group(&s_group_inputs, &s_inputs, lock);
+    if (!lock) {
+        sim_add_group(&s_group_outputs, &s_outputs, lock);
+    }
+}
+
+static int sim_load(void *addr, uint64_t *len, size_t offset, const void *data,
+                    size_t size) {
+    if (offset > size) {
+        offset = size;
+    }
+    uint64_t full = size - offset;
+    if (addr != NULL && *len > 0) {
+        memcpy(addr, (const uint8_t *)data + offset, *len < full ? *len : full);
+    }
+    *len = full;
+    return CKB_SUCCESS;
+}
+
+// Index of `index` of `source` in the cells or witnesses of the transaction,
+// or -1 if out of bound.
+static long sim_index(size_t index, size_t source) {
+    const sim_group_t *group = NULL;
+    size_t count = 0;
+    switch (source) {
+        case CKB_SOURCE_INPUT:
+            count = s_inputs.count;
+            break;
+        case CKB_SOURCE_OUTPUT:
+            count = s_outputs.count;
+            break;
+        case CKB_SOURCE_CELL_DEP:
+            count = s_cell_deps.count;
+            break;
+        case CKB_SOURCE_GROUP_INPUT:
+            group = &s_group_inputs;
+            break;
+        case CKB_SOURCE_GROUP_OUTPUT:
+            group = &s_group_outputs;
+            break;
+    }
+    if (group != NULL) {
+        return index < group->count ? (long)group->indices[index] : -1;
+    }
+    return index < count ? (long)index : -1;
+}
+
+static const sim_cell_t *sim_cell(size_t index, size_t source) {
+    long i = sim_index(index, source);
+    if (i < 0) {
+        return NULL;
+    }
+    switch (source) {
+        case CKB_SOURCE_OUTPUT:
+        case CKB_SOURCE_GROUP_OUTPUT:
+            return &s_outputs.cells[i];
+        case CKB_SOURCE_CELL_DEP:
+            return &s_cell_deps.cells[i];
+        default:
+            return &s_inputs.cells[i];
+    }
+}
+
+// The data loaded by the syscall `id` from a cell, input, header or witness,
+// or a field of it, in the record of --replay-file.
+typedef struct sim_replay_t {
+    int id;
+    size_t index, source, field;
+    int ret;      /* returned by the calls that failed */
+    int has_size; /* whether a call succeeded */
+    int exact;    /* whether size is the size of the data, or a bound of it */
+    uint64_t size;
+    uint8_t *data;
+    uint8_t *known; /* whether each byte of data is in the record */
+} sim_replay_t;
+
+static sim_replay_t *s_replays = NULL;
+static size_t s_replay_count = 0;
+
+static sim_replay_t *sim_find_replay(int id, size_t index, size_t source,
+                                     size_t field) {
+    for (size_t i = 0; i < s_replay_count; i++) {
+        sim_replay_t *r = &s_replays[i];
+        if (r->id == id && r->index == index && r->source == source &&
+            r->field == field) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+// Read the SYSCALL_RECORD and SYSCALL_DATA lines of the record in `path`,
+// anywhere in the lines, so that the output of ckb-debugger can be given as
+// it is.
+static void sim_read_replay(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        sim_fail("can not read %s", path);
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    sim_replay_t *r = NULL;
+    uint64_t position = 0, end = 0; /* of the data of the last call */
+    while (getline(&line, &capacity, file) >= 0) {
+        const char *record = strstr(line, "SYSCALL_RECORD ");
+        const char *hex = strstr(line, "SYSCALL_DATA ");
+        if (record != NULL) {
+            int id, ret;
+            unsigned long index, source, field, offset, size, length;
+            if (sscanf(record, "SYSCALL_RECORD %d %lu %lu %lu %lu %lu %d %lu",
+                       &id, &index, &source, &field, &offset, &size, &ret,
+                       &length) != 8) {
+                sim_fail("invalid record: %s", record);
+            }
+            r = sim_find_replay(id, index, source, field);
+            if (r == NULL) {
+                s_replays = realloc(s_replays,
+                                    (s_replay_count + 1) * sizeof(*s_replays));
+                r = &s_replays[s_replay_count++];
+                memset(r, 0, sizeof(*r));
+                r->id = id;
+                r->index = index;
+                r->source = source;
+                r->field = field;
+            }
+            if (ret != 0) {
+                r->ret = ret;
+                end = position;
+                continue;
+            }
+            // Past the end of the data, the length is 0 and the offset only
+            // bounds the size of the data.
+            int exact = length > 0 || offset == 0;
+            uint64_t data_size = offset + length;
+            if (!r->has_size) {
+                r->has_size = 1;
+                r->exact = exact;
+                r->size = data_size;
+                r->data = calloc(r->size + 1, 1);
+                r->known = calloc(r->size + 1, 1);
+            } else if (exact ? data_size > r->size ||
+                                   (r->exact && data_size != r->size)
+                             : r->exact && r->size > data_size) {
+                sim_fail("syscall %d index %lu source 0x%lx field %lu loads "
+                         "data of different lengths",
+                         id, index, source, field);
+            } else if (exact || data_size < r->size) {
+                r->exact = r->exact || exact;
+                r->size = data_size < r->size ? data_size : r->size;
+            }
+            position = offset;
+            end = offset + (length < size ? length : size);
+        } else if (hex != NULL && r != NULL) {
+            mol_seg_t bytes = sim_hex(strtok((char *)hex + 13, " \r\n"),
+                                      "SYSCALL_DATA");
+            if (position + bytes.size > end) {
+                sim_fail("too much data for syscall %d", r->id);
+            }
+            memcpy(r->data + position, bytes.ptr, bytes.size);
+            memset(r->known + position, 1, bytes.size);
+            position += bytes.size;
+            free(bytes.ptr);
+        }
+    }
+    free(line);
+    fclose(file);
+    s_replaying = 1;
+}
+
+// Serve the call of the syscall `id` from the record.
+static int sim_replay(int id, void *addr, uint64_t *len, size_t offset,
+                      size_t index, size_t source, size_t field) {
+    const sim_replay_t *r = sim_find_replay(id, index, source, field);
+    if (r == NULL) {
+        sim_fail("syscall %d index %lu source 0x%lx field %lu is not in the "
+                 "record",
+                 id, (unsigned long)index, (unsigned long)source,
+                 (unsigned long)field);
+    }
+    if (!r->has_size) {
+        return r->ret;
+    }
+    if (!r->exact && offset < r->size) {
+        sim_fail("the length of syscall %d index %lu source 0x%lx field %lu "
+                 "is not in the record",
+                 id, (unsigned long)index, (unsigned long)source,
+                 (unsigned long)field);
+    }
+    if (addr != NULL && *len > 0) {
+        uint64_t begin = offset < r->size ? offset : r->size;
+        uint64_t end = begin + *len < r->size ? begin + *len : r->size;
+        for (uint64_t i = begin; i < end; i++) {
+            if (!r->known[i]) {
+                sim_fail("bytes %lu to %lu of syscall %d index %lu source "
+                         "0x%lx field %lu are not in the record",
+                         (unsigned long)begin, (unsigned long)end, id,
+                         (unsigned long)index, (unsigned long)source,
+                         (unsigned long)field);
+            }
+        }
+    }
+    return sim_load(addr, len, offset, r->data, r->size);
+}
+
+static size_t s_heap_used = 0;
+static size_t s_heap_limit = SIZE_MAX;
+
+void ckb_simulator_heap_limit(size_t limit) { s_heap_limit = limit; }
+
+void *ckb_simulator_malloc(size_t size) {
+    if (size > s_heap_limit - s_heap_used) {
+        return NULL;
+    }
+    void *ptr = malloc(size);
+    s_heap_used += ptr != NULL ? malloc_usable_size(ptr) : 0;
+    return ptr;
+}
+
+void ckb_simulator_free(void *ptr) {
+    s_heap_used -= malloc_usable_size(ptr);
+    free(ptr);
+}
+
+void *ckb_simulator_calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    void *ptr = ckb_simulator_malloc(count * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+void *ckb_simulator_realloc(void *ptr, size_t size) {
+    size_t old = ptr != NULL ? malloc_usable_size(ptr) : 0;
+    if (size > old && size - old > s_heap_limit - s_heap_used) {
+        return NULL;
+    }
+    void *block = realloc(ptr, size);
+    if (block != NULL || size == 0) {
+        s_heap_used += (block != NULL ? malloc_usable_size(block) : 0) - old;
+    }
+    return block;
+}
+
+int ckb_exit(int8_t code) {
+    printf("Run result: %d\n", code);
+    fflush(stdout);
+    exit((uint8_t)code);
+    return 0;
+}
+
+int ckb_debug(const char *s) {
+    printf("Script log: %s\n", s);
+    return 0;
+}
+
+int ckb_printf(const char *format, ...) {
+    static char buf[SIM_PRINTF_BUFFER_SIZE];
+    va_list va;
+    va_start(va, format);
+    int ret = vsnprintf(buf, sizeof(buf), format, va);
+    va_end(va);
+    ckb_debug(buf);
+    return ret;
+}
+
+int snprintf_(char *buffer, size_t count, const char *format, ...) {
+    va_list va;
+    va_start(va, format);
+    int ret = vsnprintf(buffer, count, format, va);
+    va_end(va);
+    return ret;
+}
+
+int ckb_load_tx_hash(void *addr, uint64_t *len, size_t offset) {
+    if (s_replaying) {
+        return sim_replay(SYS_ckb_load_tx_hash, addr, len, offset, 0, 0, 0);
+    }
+    return sim_load(addr, len, offset, s_tx_hash, SIM_HASH_SIZE);
+}
+
+int ckb_load_transaction(void *addr, uint64_t *len, size_t offset) {
+    if (s_replaying) {
+        return sim_replay(SYS_ckb_load_transaction, addr, len, offset, 0, 0, 0);
+    }
+    return sim_load(addr, len, offset, s_transaction.ptr, s_transaction.size);
+}
+
+int ckb_load_script_hash(void *addr, uint64_t *len, size_t offset) {
+    if (s_replaying) {
+        return sim_replay(SYS_ckb_load_script_hash, addr, len, offset, 0, 0, 0);
+    }
+    return sim_load(addr, len, offset, s_script_hash, SIM_HASH_SIZE);
+}
+
+int ckb_load_script(void *addr, uint64_t *len, size_t offset) {
+    if (s_replaying) {
+        return sim_replay(SYS_ckb_load_script, addr, len, offset, 0, 0, 0);
+    }
+    return sim_load(addr, len, offset, s_script.ptr, s_script.size);
+}
+
+int ckb_load_cell(void *addr, uint64_t *len, size_t offset, size_t index,
+                  size_t source) {
+    if (s_replaying) {
+        return sim_replay(SYS_ckb_load_cell, addr, len, offset, index, source,
+                          0);
+    }
+    const sim_cell_t *cell = sim_cell(index, source);
+    if (cell == NULL) {
+        return CKB_INDEX_OUT_OF_BOUND;
+    }
+    return sim_load(addr, len, offset, cell->output.ptr, cell->output.size);
+}
+
+int ckb_load_cell_data(void *addr, uint64_t *len, size_t offset, size_t index,
+                       size_t source) {
+    if (s_replaying) {
+        return sim_replay(SYS_ckb_load_cell_data, addr, len, offset, index,
+                          source, 0);
+    }
+    const sim_cell_t *cell = sim_cell(index, source);
+    if (cell == NULL) {
+        return CKB_INDEX_OUT_OF_BOUND;
+    }
+    return sim_load(addr, len, offset, cell->data.ptr, cell->data.size);
+}
+
+int ckb_load_cell_by_field(void *addr, uint64_t *len, size_t offset,
+                           size_t index, size_t source, size_t field) {
+    if (s_replaying) {
+        return sim_replay(SYS_ckb_load_cell_by_field, addr, len, offset, index,
+                          source, field);
+    }
+    const sim_cell_t *cell = sim_cell(index, source);
+    uint8_t capacity[8];
+    if (cell == NULL) {
+        return CKB_INDEX_OUT_OF_BOUND;
+    }
+    switch (field) {
+        case CKB_CELL_FIELD_CAPACITY:
+            sim_pack_u64(capacity, cell->capacity);
+            return sim_load(addr, len, offset, capacity, 8);
+        case CKB_CELL_FIELD_DATA_HASH:
+            return sim_load(addr, len, offset, cell->data_hash, SIM_HASH_SIZE);
+        case CKB_CELL_FIELD_LOCK:
+            return sim_load(addr, len, offset, cell->lock.ptr, cell->lock.size);
+        case CKB_CELL_FIELD_LOCK_HASH:
+            return sim_load(addr, len, offset, cell->lock_hash, SIM_HASH_SIZE);
+        case CKB_CELL_FIELD_TYPE:
+            if (cell->type.size == 0) {
+                return CKB_ITEM_MISSING;
+            }
+            return sim_load(addr, len, offset, cell->type.ptr, cell->type.size);
+        case CKB_CELL_FIELD_TYPE_HASH:
+            if (cell->type.size == 0) {
+                return CKB_ITEM_MISSING;
+            }
+            return sim_load(addr, len, offset, cell->type_hash, SIM_HASH_SIZE);
+        case CKB_CELL_FIELD_OCCUPIED_CAPACITY: {
+            // Capacity, data, and code hash, hash type and args of the
+            // scripts, in shannons.
+            uint64_t bytes = 8 + cell->data.size;
+            const mol_seg_t *scripts[] = {&cell->lock, &cell->type};
+            for (int s = 0; s < 2; s++) {
+                if (scripts[s]->size > 0) {
+                    mol_seg_t args = MolReader_Script_get_args(scripts[s]);
+                    bytes += SIM_HASH_SIZE + 1 + args.size - 4;
+                }
+            }
+            sim_pack_u64(capacity, bytes * 100000000);
+            return sim_load(addr, len, offset, capacity, 8);
+        }
+    }
+    return CKB_INVALID_DATA;
+}
+
+int ckb_load_input(void *addr, uint64_t *len, size_t offset, size_t index,
+                   size_t source) {
+    if (s_replaying) {
+        return sim_replay(SYS_ckb_load_input, addr, len, offset, index, source,
+                          0);
+    }
+    if (source != CKB_SOURCE_INPUT && source != CKB_SOURCE_GROUP_INPUT) {
+        return CKB_INDEX_OUT_OF_BOUND;
+    }
+    const sim_cell_t *cell = sim_cell(index, source);
+    if (cell == NULL) {
+        return CKB_INDEX_OUT_OF_BOUND;
+    }
+    return sim_load(addr, len, offset, cell->input.ptr, cell->input.size);
+}
+
+int ckb_load_input_by_field(void *addr, uint64_t *len, size_t offset,
+                            size_t index, size_t source, size_t field) {
+    if (s_replaying) {
+        return sim_replay(SYS_ckb_load_input_by_field, addr, len, offset, index,
+                          source, field);
+    }
+    if (source != CKB_SOURCE_INPUT && source != CKB_SOURCE_GROUP_INPUT) {
+        return CKB_INDEX_OUT_OF_BOUND;
+    }
+    const sim_cell_t *cell = sim_cell(index, source);
+    if (cell == NULL) {
+        return CKB_INDEX_OUT_OF_BOUND;
+    }
+    switch (field) {
+        case CKB_INPUT_FIELD_OUT_POINT:
+            return sim_load(addr, len, offset, cell->input.ptr + 8, 36);
+        case CKB_INPUT_FIELD_SINCE:
+            return sim_load(addr, len, offset, cell->input.ptr, 8);
+    }
+    return CKB_INVALID_DATA;
+}
+
+int ckb_load_witness(void *addr, uint64_t *len, size_t offset, size_t index,
+                     size_t source) {
+    if (s_replaying) {
+        return sim_replay(SYS_ckb_load_witness, addr, len, offset, index,
+                          source, 0);
+    }
+    long i = source == CKB_SOURCE_CELL_DEP ? -1 : sim_index(index, source);
+    if (i < 0 || (size_t)i >= s_witness_count) {
+        return CKB_INDEX_OUT_OF_BOUND;
+    }
+    return sim_load(addr, len, offset, s_witnesses[i].ptr,
+                    s_witnesses[i].size);
+}
+
+int ckb_load_header(void *addr, uint64_t *len, size_t offset, size_t index,
+                    size_t source) {
+    if (s_replaying) {
+        return sim_replay(SYS_ckb_load_header, addr, len, offset, index, source,
+                          0);
+    }
+    if (source == CKB_SOURCE_HEADER_DEP) {
+        if (index >= s_header_dep_count) {
+            return CKB_INDEX_OUT_OF_BOUND;
+        }
+    } else {
+        const sim_cell_t *cell = sim_cell(index, source);
+        if (cell == NULL || source == CKB_SOURCE_OUTPUT ||
+            source == CKB_SOURCE_GROUP_OUTPUT) {
+            return CKB_INDEX_OUT_OF_BOUND;
+        }
+        if (!cell->has_header) {
+            return CKB_ITEM_MISSING;
+        }
+    }
+    sim_fail("headers are not simulated");
+    return CKB_INDEX_OUT_OF_BOUND;
+}
+
+int ckb_load_header_by_field(void *addr, uint64_t *len, size_t offset,
+                             size_t index, size_t source, size_t field) {
+    if (s_replaying) {
+        return sim_replay(SYS_ckb_load_header_by_field, addr, len, offset,
+                          index, source, field);
+    }
+    return ckb_load_header(addr, len, offset, index, source);
+}
+
+// Version of the VM running the script: VMs of version 0 and 1 for hash types
+// data and data1, and of version 2 for the others (type in the last hard fork,
+// and data2), or when replaying a record without the script.
+static int sim_vm_version(void) {
+    if (s_script.size == 0) {
+        return 2;
+    }
+    mol_seg_t hash_type = MolReader_Script_get_hash_type(&s_script);
+    return *hash_type.ptr == 0 ? 0 : *hash_type.ptr == 2 ? 1 : 2;
+}
+
+int ckb_vm_version() {
+    if (sim_vm_version() == 0) {
+        sim_fail("ckb_vm_version does not exist in VM version 0");
+    }
+    return sim_vm_version();
+}
+
+uint64_t ckb_current_cycles() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - s_start.tv_sec) * 1000000000 +
+           now.tv_nsec - s_start.tv_nsec;
+}
+
+int ckb_exec_cell(const uint8_t *code_hash, uint8_t hash_type, uint32_t offset,
+                  uint32_t length, int argc, const char *argv[]) {
+    sim_fail("exec is not simulated");
+    return CKB_INVALID_DATA;
+}
+
+int ckb_spawn(uint64_t memory_limit, size_t index, size_t source, size_t bounds,
+              int argc, const char *argv[], int8_t *exit_code,
+              uint8_t *content, uint64_t *content_length) {
+    sim_fail("spawn is not simulated");
+    return CKB_INVALID_DATA;
+}
+
+int ckb_spawn_cell(uint64_t memory_limit, const uint8_t *code_hash,
+                   uint8_t hash_type, uint32_t offset, uint32_t length,
+                   int argc, const char *argv[], int8_t *exit_code,
+                   uint8_t *content, uint64_t *content_length) {
+    sim_fail("spawn is not simulated");
+    return CKB_INVALID_DATA;
+}
+
+int ckb_dlopen2(const uint8_t *dep_cell_hash, uint8_t hash_type,
+                uint8_t *aligned_addr, size_t aligned_size, void **handle,
+                size_t *consumed_size) {
+    sim_fail("loading code from cells is not simulated");
+    return CKB_INVALID_DATA;
+}
+
+void *ckb_dlsym(void *handle, const char *symbol) { return NULL; }
+
+int ckb_get_memory_limit() {
+    if (sim_vm_version() < 2) {
+        sim_fail("ckb_get_memory_limit does not exist in VM version %d",
+                 sim_vm_version());
+    }
+    return 8;
+}
+
+int ckb_set_content(uint8_t *content, uint64_t *length) {
+    sim_fail("spawn is not simulated");
+    return CKB_INVALID_DATA;
+}
+
+// Syscalls made with syscall() rather than the functions above: the read of
+// --read-file (9000) and the local files of ckb-debugger (9003 to 9011), see
+// lualib/mocked_stdio.c.
+long ckb_simulator_syscall(long n, long a0, long a1, long a2, long a3, long a4,
+                           long a5) {
+    switch (n) {
+        case 9000: {
+            FILE *file = s_read_file ? fopen(s_read_file, "rb") : NULL;
+            if (file == NULL) {
+                return -1;
+            }
+            long count = (long)fread((void *)a0, 1, (size_t)a1, file);
+            fclose(file);
+            return count;
+        }
+        case 9003:
+            return (long)fopen((const char *)a0, (const char *)a1);
+        case 9004:
+            return (long)freopen((const char *)a0, (const char *)a1,
+                                 (FILE *)a2);
+        case 9005:
+            return (long)fread((void *)a0, (size_t)a1, (size_t)a2, (FILE *)a3);
+        case 9006:
+            return feof((FILE *)a0);
+        case 9007:
+            return ferror((FILE *)a0);
+        case 9008:
+            return fgetc((FILE *)a0);
+        case 9009:
+            return fclose((FILE *)a0);
+        case 9010:
+            return ftell((FILE *)a0);
+        case 9011:
+            return fseek((FILE *)a0, a1, (int)a2);
+    }
+    sim_fail("syscall %ld is not simulated", n);
+    return -1;
+}
+
+int lua_loader_main(int argc, char **argv);
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: lua-loader-sim [--tx-file file] [--script-group-type "
+            "lock|type]\n"
+            "           [--cell-type input|output] [--cell-index n] "
+            "[--script-hash hash]\n"
+            "           [--read-file file] [--replay-file file] "
+            "[-- loader arguments]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    const char *tx_file = NULL, *group_type = "lock", *cell_type = "input";
+    const char *script_hash = NULL, *replay_file = NULL;
+    size_t cell_index = 0;
+    int i;
+    clock_gettime(CLOCK_MONOTONIC, &s_start);
+    for (i = 1; i < argc && strcmp(argv[i], "--") != 0; i++) {
+        // --option value or --option=value
+        char *option = argv[i], *value = strchr(option, '=');
+        if (value != NULL) {
+            *value++ = '\0';
+        } else if (i + 1 < argc) {
+            value = argv[++i];
+        } else {
+            usage();
+        }
+        if (strcmp(option, "--tx-file") == 0) {
+            tx_file = value;
+        } else if (strcmp(option, "--script-group-type") == 0) {
+            group_type = value;
+        } else if (strcmp(option, "--cell-type") == 0) {
+            cell_type = value;
+        } else if (strcmp(option, "--cell-index") == 0) {
+            cell_index = strtoul(value, NULL, 10);
+        } else if (strcmp(option, "--script-hash") == 0) {
+            script_hash = value;
+        } else if (strcmp(option, "--read-file") == 0) {
+            s_read_file = value;
+        } else if (strcmp(option, "--replay-file") == 0) {
+            replay_file = value;
+        } else if (strcmp(option, "--bin") != 0 &&
+                   strcmp(option, "--max-cycles") != 0) {
+            usage();
+        }
+    }
+    const char *text = s_empty_tx;
+    char *contents = NULL;
+    if (tx_file != NULL) {
+        FILE *file = fopen(tx_file, "rb");
+        long size;
+        if (file == NULL || fseek(file, 0, SEEK_END) != 0 ||
+            (size = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0) {
+            sim_fail("can not read %s", tx_file);
+        }
+        contents = malloc(size + 1);
+        contents[fread(contents, 1, size, file)] = '\0';
+        fclose(file);
+        text = contents;
+    }
+    cJSON *json = cJSON_Parse(text);
+    if (json == NULL) {
+        sim_fail("%s is not json", tx_file);
+    }
+    sim_load_transaction(json);
+    cJSON_Delete(json);
+    free(contents);
+    sim_select_script(strcmp(group_type, "lock") == 0, cell_type, cell_index,
+                      script_hash);
+    if (replay_file != NULL) {
+        sim_read_replay(replay_file);
+    }
+    // The arguments of the loader, as given by ckb-debugger.
+    i = i < argc ? i + 1 : argc;
+    return ckb_exit(lua_loader_main(argc - i, argv + i));
+}
@@ -0,0 +1,49 @@
+// Native build of the loader, see lua-simulator.c. The loader is compiled
+// against the C library of the host, and its syscalls are served by
+// lua-simulator.c instead of the scall instruction of ckb-vm.
+
+#ifndef LUA_SIMULATOR_H_
+#define LUA_SIMULATOR_H_
+
+#include <stdint.h>
+
+// lualib/mocked_stdio.h, which includes it on chain, gives way to the stdio.h
+// of the host in the loader.
+#include "../include/ckb_cell_fs.h"
+
+// ckb_syscalls.h only declares the syscalls, see ckb_syscall_apis.h.
+#define CKB_STDLIB_NO_SYSCALL_IMPL 1
+
+long ckb_simulator_syscall(long n, long a0, long a1, long a2, long a3, long a4,
+                           long a5);
+
+#define syscall(n, a, b, c, d, e, f)                                     \
+    ckb_simulator_syscall(n, (long)(a), (long)(b), (long)(c), (long)(d), \
+                          (long)(e), (long)(f))
+
+#define snprintf_ snprintf
+
+// The malloc of the host has no program break: malloc_config only limits the
+// bytes allocated to the heap of the VM, see ckb_simulator_malloc, and its
+// bounds are used for the heap size reported by get_heap_usage and the limit
+// of the bump allocator of lua-pool.c. Instances of the library (see
+// lua-instance.c) can not be created.
+#define CKB_BRK_MIN 0
+#define CKB_BRK_MAX 0x00300000
+static uintptr_t s_program_break = 0;
+static uintptr_t s_brk_min = 0;
+static uintptr_t s_brk_max = 0;
+static struct {
+    int unused;
+} mal;
+
+void ckb_simulator_heap_limit(size_t limit);
+
+static void malloc_config(uintptr_t min, uintptr_t max) {
+    s_brk_min = min;
+    s_brk_max = max;
+    s_program_break = 0;
+    ckb_simulator_heap_limit(max - min);
+}
+
+#endif /* LUA_SIMULATOR_H_ */
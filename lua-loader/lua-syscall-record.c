@@ -0,0 +1,181 @@
+// Record of the syscalls that load data, enabled with -kr or bit 128 of the
+// lua loader args, to replay a transaction without it (see --replay-file in
+// lua-simulator.c). Each call made by the loader or the ckb module is printed
+// with ckb_debug as it returns, with its arguments, its return code and the
+// length of the data:
+//
+//   SYSCALL_RECORD id index source field offset size ret length
+//
+// followed by the bytes it loaded, in SYSCALL_DATA lines of hex. Bytes of the
+// same cell, input, header or witness already in the record are not printed
+// again, so that loading the same data in parts or several times, as the
+// scripts often do, keeps the record small.
+//
+// The syscalls are recorded by wrappers of the functions of ckb_syscalls.h,
+// which this file renames to the wrappers for the rest of the loader, see the
+// end of the file. It is included by lua-ckb.c, before their first use.
+
+#define SYSCALL_RECORD_CHUNK 512 /* bytes per SYSCALL_DATA line */
+#define SYSCALL_RECORD_TARGETS 64 /* data of more targets is always printed */
+
+typedef struct syscall_record_target_t {
+    int id;
+    size_t index, source, field;
+    uint64_t begin, end; /* bytes of the data in the record */
+} syscall_record_target_t;
+
+static int s_syscall_record = 0;
+static syscall_record_target_t s_syscall_record_targets[SYSCALL_RECORD_TARGETS];
+static int s_syscall_record_target_count = 0;
+
+static void start_syscall_record(void) { s_syscall_record = 1; }
+
+// Whether the bytes [begin, end) of the target are to be printed, which
+// extends the bytes of the target in the record.
+static int syscall_record_data(int id, size_t index, size_t source,
+                               size_t field, uint64_t begin, uint64_t end) {
+    syscall_record_target_t *t = NULL;
+    for (int i = 0; i < s_syscall_record_target_count; i++) {
+        syscall_record_target_t *target = &s_syscall_record_targets[i];
+        if (target->id == id && target->index == index &&
+            target->source == source && target->field == field) {
+            t = target;
+            break;
+        }
+    }
+    if (t == NULL) {
+        if (s_syscall_record_target_count == SYSCALL_RECORD_TARGETS) {
+            return 1;
+        }
+        t = &s_syscall_record_targets[s_syscall_record_target_count++];
+        t->id = id;
+        t->index = index;
+        t->source = source;
+        t->field = field;
+        t->begin = t->end = 0;
+    }
+    if (begin >= t->begin && end <= t->end) {
+        return 0;
+    }
+    if (begin <= t->end && end >= t->begin) {
+        t->begin = begin < t->begin ? begin : t->begin;
+        t->end = end > t->end ? end : t->end;
+    } else if (end - begin > t->end - t->begin) {
+        t->begin = begin;
+        t->end = end;
+    }
+    return 1;
+}
+
+// Record the call of syscall `id` that loaded data in `addr` of `size` bytes,
+// or only queried the length of the data if `addr` is NULL, and returned
+// `ret` and `*len`.
+static void record_syscall(int id, const void *addr, uint64_t size,
+                           const uint64_t *len, size_t offset, size_t index,
+                           size_t source, size_t field, int ret) {
+    if (!s_syscall_record) {
+        return;
+    }
+    static const char digits[] = "0123456789abcdef";
+    static char line[2 * SYSCALL_RECORD_CHUNK + 16];
+    uint64_t length = len != NULL ? *len : 0;
+    snprintf_(line, sizeof(line),
+              "SYSCALL_RECORD %d %lu %lu %lu %lu %lu %d %lu", id,
+              (unsigned long)index, (unsigned long)source,
+              (unsigned long)field, (unsigned long)offset, (unsigned long)size,
+              ret, (unsigned long)length);
+    ckb_debug(line);
+    uint64_t bytes = length < size ? length : size;
+    if (ret != 0 || addr == NULL || bytes == 0 ||
+        !syscall_record_data(id, index, source, field, offset,
+                             offset + bytes)) {
+        return;
+    }
+    const uint8_t *data = addr;
+    for (uint64_t i = 0; i < bytes; i += SYSCALL_RECORD_CHUNK) {
+        uint64_t n = bytes - i < SYSCALL_RECORD_CHUNK ? bytes - i
+                                                      : SYSCALL_RECORD_CHUNK;
+        char *c = line + snprintf_(line, sizeof(line), "SYSCALL_DATA ");
+        for (uint64_t j = 0; j < n; j++) {
+            *c++ = digits[data[i + j] >> 4];
+            *c++ = digits[data[i + j] & 0xf];
+        }
+        *c = '\0';
+        ckb_debug(line);
+    }
+}
+
+#define SYSCALL_RECORD3(name, id)                                           \
+    static int record_##name(void *addr, uint64_t *len, size_t offset) {    \
+        uint64_t size = len != NULL ? *len : 0;                             \
+        int ret = ckb_##name(addr, len, offset);                            \
+        record_syscall(id, addr, size, len, offset, 0, 0, 0, ret);          \
+        return ret;                                                         \
+    }
+
+#define SYSCALL_RECORD5(name, id)                                           \
+    static int record_##name(void *addr, uint64_t *len, size_t offset,      \
+                             size_t index, size_t source) {                 \
+        uint64_t size = len != NULL ? *len : 0;                             \
+        int ret = ckb_##name(addr, len, offset, index, source);             \
+        record_syscall(id, addr, size, len, offset, index, source, 0, ret); \
+        return ret;                                                         \
+    }
+
+#define SYSCALL_RECORD6(name, id)                                           \
+    static int record_##name(void *addr, uint64_t *len, size_t offset,      \
+                             size_t index, size_t source, size_t field) {   \
+        uint64_t size = len != NULL ? *len : 0;                             \
+        int ret = ckb_##name(addr, len, offset, index, source, field);      \
+        record_syscall(id, addr, size, len, offset, index, source, field,   \
+                       ret);                                                \
+        return ret;                                                         \
+    }
+
+SYSCALL_RECORD3(load_tx_hash, SYS_ckb_load_tx_hash)
+SYSCALL_RECORD3(load_script_hash, SYS_ckb_load_script_hash)
+SYSCALL_RECORD3(load_script, SYS_ckb_load_script)
+SYSCALL_RECORD3(load_transaction, SYS_ckb_load_transaction)
+SYSCALL_RECORD5(load_cell, SYS_ckb_load_cell)
+SYSCALL_RECORD5(load_input, SYS_ckb_load_input)
+SYSCALL_RECORD5(load_header, SYS_ckb_load_header)
+SYSCALL_RECORD5(load_witness, SYS_ckb_load_witness)
+SYSCALL_RECORD5(load_cell_data, SYS_ckb_load_cell_data)
+SYSCALL_RECORD6(load_cell_by_field, SYS_ckb_load_cell_by_field)
+SYSCALL_RECORD6(load_input_by_field, SYS_ckb_load_input_by_field)
+SYSCALL_RECORD6(load_header_by_field, SYS_ckb_load_header_by_field)
+
+// ckb_look_for_dep_with_hash2 of ckb_syscalls.h, on the recorded syscall.
+static int record_look_for_dep_with_hash2(const uint8_t *code_hash,
+                                          uint8_t hash_type, size_t *index) {
+    size_t field =
+        hash_type == 1 ? CKB_CELL_FIELD_TYPE_HASH : CKB_CELL_FIELD_DATA_HASH;
+    for (size_t current = 0; current < SIZE_MAX; current++) {
+        uint64_t len = 32;
+        uint8_t hash[32];
+        int ret = record_load_cell_by_field(hash, &len, 0, current,
+                                            CKB_SOURCE_CELL_DEP, field);
+        if (ret == CKB_SUCCESS && memcmp(code_hash, hash, 32) == 0) {
+            *index = current;
+            return CKB_SUCCESS;
+        }
+        if (ret != CKB_SUCCESS && ret != CKB_ITEM_MISSING) {
+            break;
+        }
+    }
+    return CKB_INDEX_OUT_OF_BOUND;
+}
+
+#define ckb_load_tx_hash record_load_tx_hash
+#define ckb_load_script_hash record_load_script_hash
+#define ckb_load_script record_load_script
+#define ckb_load_transaction record_load_transaction
+#define ckb_load_cell record_load_cell
+#define ckb_load_input record_load_input
+#define ckb_load_header record_load_header
+#define ckb_load_witness record_load_witness
+#define ckb_load_cell_data record_load_cell_data
+#define ckb_load_cell_by_field record_load_cell_by_field
+#define ckb_load_input_by_field record_load_input_by_field
+#define ckb_load_header_by_field record_load_header_by_field
+#define ckb_look_for_dep_with_hash2 record_look_for_dep_with_hash2
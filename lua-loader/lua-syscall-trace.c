@@ -0,0 +1,189 @@
+// Accounting of the syscalls made by the ckb module, enabled with -k or bit 64
+// of the lua loader args. Every syscall of call_syscall is counted, by
+// syscall and by the cell, input, header or witness (source and index) it
+// loads, with the calls that only ask for the length of the data (queries),
+// the calls that failed, and the bytes loaded. When the script ends, they are
+// printed with ckb_debug, first by syscall then by target:
+//
+//   SYSCALL load_cell_data 2092 calls 6 queries 3 errors 0 bytes 3000
+//   SYSCALL load_cell_data 2092 source 0x1 index 0 calls 4 queries 2 ...
+//
+// so that the same data loaded several times stands out. With -kt, each call
+// is also printed as it is made, with the offset and size asked for, and the
+// length of the data:
+//
+//   SYSCALL_TRACE load_witness source 0x1 index 0 offset 0 size 0 length 85
+
+#define SYSCALL_TRACE_SUMMARY 1
+#define SYSCALL_TRACE_CALLS 2
+#define SYSCALL_MAX_TARGETS 64 /* more targets are counted as "other" */
+
+typedef struct syscall_info_t {
+    const void *function;
+    const char *name;
+    int id;
+} syscall_info_t;
+
+static const syscall_info_t s_syscalls[] = {
+    {(const void *)ckb_load_tx_hash, "load_tx_hash", SYS_ckb_load_tx_hash},
+    {(const void *)ckb_load_script_hash, "load_script_hash",
+     SYS_ckb_load_script_hash},
+    {(const void *)ckb_load_script, "load_script", SYS_ckb_load_script},
+    {(const void *)ckb_load_transaction, "load_transaction",
+     SYS_ckb_load_transaction},
+    {(const void *)ckb_load_cell, "load_cell", SYS_ckb_load_cell},
+    {(const void *)ckb_load_input, "load_input", SYS_ckb_load_input},
+    {(const void *)ckb_load_header, "load_header", SYS_ckb_load_header},
+    {(const void *)ckb_load_witness, "load_witness", SYS_ckb_load_witness},
+    {(const void *)ckb_load_cell_data, "load_cell_data",
+     SYS_ckb_load_cell_data},
+    {(const void *)ckb_load_cell_by_field, "load_cell_by_field",
+     SYS_ckb_load_cell_by_field},
+    {(const void *)ckb_load_input_by_field, "load_input_by_field",
+     SYS_ckb_load_input_by_field},
+    {(const void *)ckb_load_header_by_field, "load_header_by_field",
+     SYS_ckb_load_header_by_field},
+    {NULL, "unknown", 0},
+};
+
+#define SYSCALL_COUNT (int)(sizeof(s_syscalls) / sizeof(s_syscalls[0]))
+
+typedef struct syscall_stats_t {
+    size_t calls, queries, errors;
+    uint64_t bytes;
+} syscall_stats_t;
+
+typedef struct syscall_target_t {
+    int syscall; /* index in s_syscalls */
+    size_t source, index, field;
+    syscall_stats_t stats;
+} syscall_target_t;
+
+static int s_syscall_trace = 0;
+static syscall_stats_t s_syscall_stats[SYSCALL_COUNT];
+static syscall_target_t s_syscall_targets[SYSCALL_MAX_TARGETS];
+static int s_syscall_target_count = 0;
+static syscall_stats_t s_syscall_other_targets;
+
+static void start_syscall_trace(int calls) {
+    s_syscall_trace = SYSCALL_TRACE_SUMMARY | (calls ? SYSCALL_TRACE_CALLS : 0);
+}
+
+static void count_syscall(syscall_stats_t *stats, const void *buf,
+                          uint64_t bytes, int ret) {
+    stats->calls++;
+    if (ret != 0) {
+        stats->errors++;
+    } else if (buf == NULL) {
+        stats->queries++;
+    } else {
+        stats->bytes += bytes;
+    }
+}
+
+static syscall_stats_t *syscall_target(int syscall, size_t source,
+                                       size_t index, size_t field) {
+    for (int i = 0; i < s_syscall_target_count; i++) {
+        syscall_target_t *t = &s_syscall_targets[i];
+        if (t->syscall == syscall && t->source == source &&
+            t->index == index && t->field == field) {
+            return &t->stats;
+        }
+    }
+    if (s_syscall_target_count == SYSCALL_MAX_TARGETS) {
+        return &s_syscall_other_targets;
+    }
+    syscall_target_t *t = &s_syscall_targets[s_syscall_target_count++];
+    t->syscall = syscall;
+    t->source = source;
+    t->index = index;
+    t->field = field;
+    return &t->stats;
+}
+
+// Count the call of `f` that loaded data in `buf` of `size` bytes, or only
+// queried the length of the data if `buf` is NULL, and returned `ret`.
+static void trace_syscall(const struct syscall_function_t *f, const void *buf,
+                          uint64_t size, int ret) {
+    if (!s_syscall_trace) {
+        return;
+    }
+    const void *function = (const void *)f->function.f3;
+    int s = 0;
+    while (s_syscalls[s].function != NULL &&
+           s_syscalls[s].function != function) {
+        s++;
+    }
+    uint64_t length = f->length != NULL ? *f->length : 0;
+    uint64_t bytes = length < size ? length : size;
+    count_syscall(&s_syscall_stats[s], buf, bytes, ret);
+    if (f->num_extra_arguments >= 3) {
+        size_t field = f->num_extra_arguments == 4 ? f->extra_arguments[3]
+                                                   : (size_t)-1;
+        count_syscall(syscall_target(s, f->extra_arguments[2],
+                                     f->extra_arguments[1], field),
+                      buf, bytes, ret);
+    }
+    if (s_syscall_trace & SYSCALL_TRACE_CALLS) {
+        char line[160];
+        int len = snprintf_(line, sizeof(line), "SYSCALL_TRACE %s",
+                            s_syscalls[s].name);
+        if (f->num_extra_arguments >= 3) {
+            len += snprintf_(line + len, sizeof(line) - len,
+                             " source 0x%lx index %lu",
+                             (unsigned long)f->extra_arguments[2],
+                             (unsigned long)f->extra_arguments[1]);
+        }
+        if (f->num_extra_arguments == 4) {
+            len += snprintf_(line + len, sizeof(line) - len, " field %lu",
+                             (unsigned long)f->extra_arguments[3]);
+        }
+        snprintf_(line + len, sizeof(line) - len,
+                  " offset %lu size %lu length %lu ret %d",
+                  (unsigned long)f->extra_arguments[0], (unsigned long)size,
+                  (unsigned long)length, ret);
+        ckb_debug(line);
+    }
+}
+
+static void print_syscall_stats(const char *target,
+                                const syscall_stats_t *stats) {
+    char line[160];
+    snprintf_(line, sizeof(line),
+              "SYSCALL %s calls %lu queries %lu errors %lu bytes %lu", target,
+              (unsigned long)stats->calls, (unsigned long)stats->queries,
+              (unsigned long)stats->errors, (unsigned long)stats->bytes);
+    ckb_debug(line);
+}
+
+// Print the syscall accounting, see above, if enabled.
+static void finish_syscall_trace(void) {
+    if (!s_syscall_trace) {
+        return;
+    }
+    s_syscall_trace = 0;
+    char target[96];
+    for (int s = 0; s < SYSCALL_COUNT; s++) {
+        if (s_syscall_stats[s].calls != 0) {
+            snprintf_(target, sizeof(target), "%s %d", s_syscalls[s].name,
+                      s_syscalls[s].id);
+            print_syscall_stats(target, &s_syscall_stats[s]);
+        }
+    }
+    for (int i = 0; i < s_syscall_target_count; i++) {
+        const syscall_target_t *t = &s_syscall_targets[i];
+        const syscall_info_t *info = &s_syscalls[t->syscall];
+        int len = snprintf_(target, sizeof(target),
+                            "%s %d source 0x%lx index %lu", info->name,
+                            info->id, (unsigned long)t->source,
+                            (unsigned long)t->index);
+        if (t->field != (size_t)-1) {
+            snprintf_(target + len, sizeof(target) - len, " field %lu",
+                      (unsigned long)t->field);
+        }
+        print_syscall_stats(target, &t->stats);
+    }
+    if (s_syscall_other_targets.calls != 0) {
+        print_syscall_stats("other targets", &s_syscall_other_targets);
+    }
+}
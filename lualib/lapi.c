@@ -1021,9 +1021,11 @@ LUA_API int lua_dump(lua_State *L, lua_Writer writer, void *data, int strip) {
     lua_lock(L);
     api_checknelems(L, 1);
     o = s2v(L->top - 1);
-    if (isLfunction(o))
-        status = luaU_dump(L, getproto(o), writer, data, strip);
-    else
+    if (isLfunction(o)) {
+        luaD_loadprotos(L, getproto(o));
+        status = luaU_dump(L, getproto(o), writer, data,
+                           strip & ~LUA_DUMPFIXED, strip & LUA_DUMPFIXED);
+    } else
         status = 1;
     lua_unlock(L);
     return status;
@@ -1045,6 +1047,7 @@ LUA_API int lua_gc(lua_State *L, int what, ...) {
     switch (what) {
         case LUA_GCSTOP: {
             g->gcstp = GCSTPUSR; /* stopped by the user */
+            g->gcrestart = 0;
             break;
         }
         case LUA_GCRESTART: {
@@ -1127,6 +1130,13 @@ LUA_API int lua_gc(lua_State *L, int what, ...) {
     return res;
 }
 
+/*
+** Restart the collector, stopped by 'lua_gc', at its next step. Only sets
+** a flag, so that, unlike 'lua_gc', it can be called by an allocator in the
+** middle of an allocation.
+*/
+LUA_API void lua_gcrestartlater(lua_State *L) { G(L)->gcrestart = 1; }
+
 /*
 ** miscellaneous functions
 */
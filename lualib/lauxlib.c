@@ -22,6 +22,7 @@
 
 #include "lauxlib.h"
 #include "lua.h"
+#include "lualib.h"
 
 #if !defined(MAX_SIZET)
 /* maximum value for size_t */
@@ -995,8 +996,11 @@ static void warnfon(void *ud, const char *message, int tocont) {
     warnfcont(ud, message, tocont);              /* finish processing */
 }
 
-LUALIB_API lua_State *luaL_newstate(void) {
-    lua_State *L = lua_newstate(l_alloc, NULL);
+/*
+** Create a state with the allocator 'f', set up like 'luaL_newstate'.
+*/
+LUALIB_API lua_State *luaL_newstatealloc(lua_Alloc f, void *ud) {
+    lua_State *L = lua_newstate(f, ud);
     if (l_likely(L)) {
         lua_atpanic(L, &panic);
         lua_setwarnf(L, warnfoff, L); /* default is warnings off */
@@ -1004,6 +1008,153 @@ LUALIB_API lua_State *luaL_newstate(void) {
     return L;
 }
 
+LUALIB_API lua_State *luaL_newstate(void) {
+    return luaL_newstatealloc(l_alloc, NULL);
+}
+
+/*
+** {======================================================
+** Heap images
+** =======================================================
+*/
+
+#define IMAGEALIGN 16
+
+/*
+** Heap used to build an image: a bump region where nothing is ever freed,
+** so that building the same state twice gives the same layout.
+*/
+typedef struct ImageBuilder {
+    char *base;
+    char *top;
+    char *limit;
+} ImageBuilder;
+
+/*
+** Heap of a state loaded from an image: blocks in [lo, hi) are not owned
+** by the allocator 'f'.
+*/
+typedef struct ImageHeap {
+    char *lo;
+    char *hi;
+    lua_Alloc f;
+    void *ud;
+} ImageHeap;
+
+static void *l_bumpalloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    ImageBuilder *b = (ImageBuilder *)ud;
+    char *block;
+    if (nsize == 0) return NULL;
+    if (ptr != NULL && nsize <= osize) return ptr; /* shrink in place */
+    nsize = (nsize + IMAGEALIGN - 1) & ~(size_t)(IMAGEALIGN - 1);
+    if ((size_t)(b->limit - b->top) < nsize) return NULL;
+    block = b->top;
+    b->top += nsize;
+    if (ptr != NULL) memcpy(block, ptr, osize);
+    return block;
+}
+
+static void *l_imagealloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    ImageHeap *h = (ImageHeap *)ud;
+    if ((char *)ptr >= h->lo && (char *)ptr < h->hi) { /* image block? */
+        void *block;
+        if (nsize == 0) return NULL; /* never given back */
+        if (nsize <= osize) return ptr;
+        block = h->f(h->ud, NULL, 0, nsize);
+        if (block != NULL) memcpy(block, ptr, osize);
+        return block;
+    }
+    return h->f(h->ud, ptr, osize, nsize);
+}
+
+/*
+** The default seed of 'math.random' comes from the address of the state;
+** reseed it so that the image does not depend on where it was built.
+*/
+static void fixrandomseed(lua_State *L) {
+    if (lua_getglobal(L, LUA_MATHLIBNAME) == LUA_TTABLE &&
+        lua_getfield(L, -1, "randomseed") == LUA_TFUNCTION) {
+        lua_pushinteger(L, 0xBEEFBEEF);
+        lua_call(L, 1, 0);
+        lua_pop(L, 1);
+    } else
+        lua_settop(L, 0);
+}
+
+static int buildimagestate(ImageBuilder *b, char *base, size_t size,
+                           lua_CFunction init, lua_State **pL) {
+    lua_State *L;
+    int status;
+    memset(base, 0, size);
+    b->base = b->top = base;
+    b->limit = base + size;
+    L = lua_newimagestate(l_bumpalloc, b);
+    if (L == NULL) return LUA_ERRMEM;
+    lua_atpanic(L, &panic);
+    lua_setwarnf(L, warnfoff, L);
+    lua_pushcfunction(L, init);
+    status = lua_pcall(L, 0, 0, 0);
+    if (status == LUA_OK) fixrandomseed(L);
+    /* the builder heap is not part of the image */
+    lua_setallocf(L, NULL, NULL);
+    *pL = L;
+    return status;
+}
+
+/*
+** Build the state initialized by 'init' twice in halves of 'scratch' and
+** dump it as a relocatable heap image (see 'lua_dumpimage'). The image
+** can only be loaded by the same binary that made it.
+*/
+LUALIB_API int luaL_makeimage(lua_CFunction init, void *scratch, size_t size,
+                              void *out, size_t *outlen) {
+    ImageBuilder a, b;
+    lua_State *La, *Lb;
+    char *base = (char *)(((size_t)scratch + IMAGEALIGN - 1) &
+                          ~(size_t)(IMAGEALIGN - 1));
+    size_t half;
+    int status;
+    if (size < (size_t)(base - (char *)scratch)) return LUA_ERRMEM;
+    half = ((size - (size_t)(base - (char *)scratch)) / 2) &
+           ~(size_t)(IMAGEALIGN - 1);
+    status = buildimagestate(&a, base, half, init, &La);
+    if (status != LUA_OK) return status;
+    status = buildimagestate(&b, base + half, half, init, &Lb);
+    if (status != LUA_OK) return status;
+    if (a.top - a.base != b.top - b.base) return LUA_ERRRUN;
+    return lua_dumpimage(La, a.base, Lb, b.base, (size_t)(a.top - a.base),
+                         out, outlen);
+}
+
+/*
+** Create a state from an image made by 'luaL_makeimage', whose other
+** blocks are allocated by 'f'. The memory of the image is never given
+** back to 'f'.
+*/
+LUALIB_API lua_State *luaL_newstatefromimagealloc(const void *image,
+                                                  size_t len, lua_Alloc f,
+                                                  void *ud) {
+    size_t size = lua_imagesize(image, len);
+    ImageHeap *h;
+    lua_State *L;
+    if (size == 0) return NULL; /* not an image of this binary */
+    h = (ImageHeap *)f(ud, NULL, 0, sizeof(ImageHeap) + size);
+    if (h == NULL) return NULL;
+    h->lo = (char *)(h + 1);
+    h->hi = h->lo + size;
+    h->f = f;
+    h->ud = ud;
+    L = lua_loadimage(l_imagealloc, h, image, len, h->lo);
+    if (L == NULL) f(ud, h, sizeof(ImageHeap) + size, 0);
+    return L;
+}
+
+LUALIB_API lua_State *luaL_newstatefromimage(const void *image, size_t len) {
+    return luaL_newstatefromimagealloc(image, len, l_alloc, NULL);
+}
+
+/* }====================================================== */
+
 LUALIB_API void luaL_checkversion_(lua_State *L, lua_Number ver, size_t sz) {
     lua_Number v = lua_version(L);
     if (sz != LUAL_NUMSIZES) /* check numeric types */
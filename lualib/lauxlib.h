@@ -87,6 +87,13 @@ LUALIB_API int(luaL_loadbufferx)(lua_State *L, const char *buff, size_t sz,
 LUALIB_API int(luaL_loadstring)(lua_State *L, const char *s);
 
 LUALIB_API lua_State *(luaL_newstate)(void);
+LUALIB_API lua_State *(luaL_newstatealloc)(lua_Alloc f, void *ud);
+LUALIB_API int(luaL_makeimage)(lua_CFunction init, void *scratch, size_t size,
+                               void *out, size_t *outlen);
+LUALIB_API lua_State *(luaL_newstatefromimage)(const void *image, size_t len);
+LUALIB_API lua_State *(luaL_newstatefromimagealloc)(const void *image,
+                                                    size_t len, lua_Alloc f,
+                                                    void *ud);
 
 LUALIB_API lua_Integer(luaL_len)(lua_State *L, int idx);
 
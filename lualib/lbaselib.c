@@ -323,9 +323,20 @@ static int load_aux(lua_State *L, int status, int envidx) {
     }
 }
 
+/*
+** Modes "B" and "L" need memory outliving the loaded chunk, which Lua
+** code cannot provide.
+*/
+static const char *getloadmode(lua_State *L, int arg, const char *def) {
+    const char *mode = luaL_optstring(L, arg, def);
+    luaL_argcheck(L, mode == NULL || strpbrk(mode, "BL") == NULL, arg,
+                  "invalid mode");
+    return mode;
+}
+
 static int luaB_loadfile(lua_State *L) {
     const char *fname = luaL_optstring(L, 1, NULL);
-    const char *mode = luaL_optstring(L, 2, NULL);
+    const char *mode = getloadmode(L, 2, NULL);
     int env = (!lua_isnone(L, 3) ? 3 : 0); /* 'env' index or 0 if no 'env' */
     int status = luaL_loadfilex(L, fname, mode);
     return load_aux(L, status, env);
@@ -369,7 +380,7 @@ static int luaB_load(lua_State *L) {
     int status;
     size_t l;
     const char *s = lua_tolstring(L, 1, &l);
-    const char *mode = luaL_optstring(L, 3, "bt");
+    const char *mode = getloadmode(L, 3, "bt");
     int env = (!lua_isnone(L, 4) ? 4 : 0); /* 'env' index or 0 if no 'env' */
     if (s != NULL) {                       /* loading a string? */
         const char *chunkname = luaL_optstring(L, 2, s);
@@ -914,15 +914,42 @@ static void f_parser(lua_State *L, void *ud) {
     int c = zgetc(p->z); /* read first character */
     if (c == LUA_SIGNATURE[0]) {
         checkmode(L, p->mode, "binary");
-        cl = luaU_undump(L, p->z, p->name);
+        cl = luaU_undump(L, p->z, p->name,
+                         p->mode != NULL && strchr(p->mode, 'B') != NULL);
     } else {
         checkmode(L, p->mode, "text");
-        cl = luaY_parser(L, p->z, &p->buff, &p->dyd, p->name, c);
+#if defined(LUA_NOPARSER)
+        /* the parser is compiled out; only precompiled chunks load */
+        luaO_pushfstring(L,
+                         "attempt to load a text chunk (parser not available, "
+                         "only precompiled chunks can be loaded)");
+        luaD_throw(L, LUA_ERRSYNTAX);
+#else
+        cl = luaY_parser(L, p->z, &p->buff, &p->dyd, p->name, c,
+                         p->mode != NULL && strchr(p->mode, 'L') != NULL);
+#endif
     }
     lua_assert(cl->nupvalues == cl->p->sizeupvalues);
     luaF_initupvals(L, cl);
 }
 
+static void initparser(lua_State *L, Mbuffer *buff, Dyndata *dyd) {
+    dyd->actvar.arr = NULL;
+    dyd->actvar.size = 0;
+    dyd->gt.arr = NULL;
+    dyd->gt.size = 0;
+    dyd->label.arr = NULL;
+    dyd->label.size = 0;
+    luaZ_initbuffer(L, buff);
+}
+
+static void freeparser(lua_State *L, Mbuffer *buff, Dyndata *dyd) {
+    luaZ_freebuffer(L, buff);
+    luaM_freearray(L, dyd->actvar.arr, dyd->actvar.size);
+    luaM_freearray(L, dyd->gt.arr, dyd->gt.size);
+    luaM_freearray(L, dyd->label.arr, dyd->label.size);
+}
+
 int luaD_protectedparser(lua_State *L, ZIO *z, const char *name,
                          const char *mode) {
     struct SParser p;
@@ -931,18 +958,60 @@ int luaD_protectedparser(lua_State *L, ZIO *z, const char *name,
     p.z = z;
     p.name = name;
     p.mode = mode;
-    p.dyd.actvar.arr = NULL;
-    p.dyd.actvar.size = 0;
-    p.dyd.gt.arr = NULL;
-    p.dyd.gt.size = 0;
-    p.dyd.label.arr = NULL;
-    p.dyd.label.size = 0;
-    luaZ_initbuffer(L, &p.buff);
+    initparser(L, &p.buff, &p.dyd);
     status = luaD_pcall(L, f_parser, &p, savestack(L, L->top), L->errfunc);
-    luaZ_freebuffer(L, &p.buff);
-    luaM_freearray(L, p.dyd.actvar.arr, p.dyd.actvar.size);
-    luaM_freearray(L, p.dyd.gt.arr, p.dyd.gt.size);
-    luaM_freearray(L, p.dyd.label.arr, p.dyd.label.size);
+    freeparser(L, &p.buff, &p.dyd);
     decnny(L);
     return status;
 }
+
+#if !defined(LUA_NOPARSER)
+struct SLazy { /* data to 'f_lazyparser' */
+    Proto *f;      /* function owning the nested function */
+    int i;         /* index of the nested function */
+    Mbuffer buff;  /* dynamic structure used by the scanner */
+    Dyndata dyd;   /* dynamic structures used by the parser */
+};
+
+static void f_lazyparser(lua_State *L, void *ud) {
+    struct SLazy *p = cast(struct SLazy *, ud);
+    Proto *np = luaY_lazyparser(L, p->f->p[p->i], &p->buff, &p->dyd);
+    p->f->p[p->i] = np; /* replaces the skimmed prototype */
+    luaC_objbarrier(L, p->f, np);
+}
+#endif
+
+/*
+** Return nested function 'i' of 'f', after loading or compiling it if
+** that was postponed (see 'luaU_loadlazy' and 'luaY_lazyparser').
+*/
+Proto *luaD_loadnested(lua_State *L, Proto *f, int i) {
+    Proto *p = f->p[i];
+    if (p->flag & PF_LAZY) luaU_loadlazy(L, p);
+#if !defined(LUA_NOPARSER)
+    else if (p->flag & PF_UNPARSED) {
+        struct SLazy s;
+        int status;
+        incnny(L); /* cannot yield during parsing */
+        s.f = f;
+        s.i = i;
+        initparser(L, &s.buff, &s.dyd);
+        status =
+            luaD_pcall(L, f_lazyparser, &s, savestack(L, L->top), L->errfunc);
+        freeparser(L, &s.buff, &s.dyd);
+        decnny(L);
+        if (l_unlikely(status != LUA_OK)) luaD_throw(L, status);
+        p = f->p[i];
+    }
+#endif
+    return p;
+}
+
+/*
+** Load or compile all the functions nested in 'f', at any depth, that
+** were postponed, as 'luaU_dump' needs them.
+*/
+void luaD_loadprotos(lua_State *L, Proto *f) {
+    int i;
+    for (i = 0; i < f->sizep; i++) luaD_loadprotos(L, luaD_loadnested(L, f, i));
+}
@@ -49,6 +49,8 @@
 typedef void (*Pfunc)(lua_State *L, void *ud);
 
 LUAI_FUNC void luaD_seterrorobj(lua_State *L, int errcode, StkId oldtop);
+LUAI_FUNC Proto *luaD_loadnested(lua_State *L, Proto *f, int i);
+LUAI_FUNC void luaD_loadprotos(lua_State *L, Proto *f);
 LUAI_FUNC int luaD_protectedparser(lua_State *L, ZIO *z, const char *name,
                                    const char *mode);
 LUAI_FUNC void luaD_hook(lua_State *L, int event, int line, int fTransfer,
@@ -9,6 +9,8 @@
 
 #include <stddef.h>
 
+#include "ldo.h"
+#include "lmem.h"
 #include "lobject.h"
 #include "lprefix.h"
 #include "lstate.h"
@@ -17,9 +19,13 @@
 
 typedef struct {
     lua_State *L;
-    lua_Writer writer;
+    lua_Writer writer; /* NULL to only count bytes */
     void *data;
     int strip;
+    int fixed;     /* dump in LUAC_FIXEDFORMAT */
+    size_t offset; /* number of bytes written so far */
+    l_uint32 *sizes; /* sizes of the nested functions, in dump order */
+    int nsizes;      /* number of nested functions dumped so far */
     int status;
 } DumpState;
 
@@ -33,12 +39,25 @@ typedef struct {
 
 static void dumpBlock(DumpState *D, const void *b, size_t size) {
     if (D->status == 0 && size > 0) {
-        lua_unlock(D->L);
-        D->status = (*D->writer)(D->L, b, size, D->data);
-        lua_lock(D->L);
+        if (D->writer != NULL) {
+            lua_unlock(D->L);
+            D->status = (*D->writer)(D->L, b, size, D->data);
+            lua_lock(D->L);
+        }
+        D->offset += size;
     }
 }
 
+/*
+** Pad the chunk with zeros up to a multiple of 'align' bytes
+*/
+static void dumpAlign(DumpState *D, size_t align) {
+    static const char zeros[sizeof(lua_Number)] = {0};
+    size_t padding = (align - D->offset % align) % align;
+    lua_assert(align <= sizeof(zeros));
+    dumpBlock(D, zeros, padding);
+}
+
 #define dumpVar(D, x) dumpVector(D, &x, 1)
 
 static void dumpByte(DumpState *D, int y) {
@@ -74,11 +93,13 @@ static void dumpString(DumpState *D, const TString *s) {
         const char *str = getstr(s);
         dumpSize(D, size + 1);
         dumpVector(D, str, size);
+        if (D->fixed) dumpByte(D, '\0');
     }
 }
 
 static void dumpCode(DumpState *D, const Proto *f) {
     dumpInt(D, f->sizecode);
+    if (D->fixed) dumpAlign(D, sizeof(Instruction));
     dumpVector(D, f->code, f->sizecode);
 }
 
@@ -114,7 +135,19 @@ static void dumpProtos(DumpState *D, const Proto *f) {
     int i;
     int n = f->sizep;
     dumpInt(D, n);
-    for (i = 0; i < n; i++) dumpFunction(D, f->p[i], f->source);
+    for (i = 0; i < n; i++) {
+        lua_assert(!(f->p[i]->flag & (PF_LAZY | PF_UNPARSED)));
+        if (D->fixed) { /* size (known after counting) and alignment */
+            l_uint32 *size = &D->sizes[D->nsizes++];
+            size_t start;
+            dumpAlign(D, sizeof(*size));
+            dumpVar(D, *size);
+            start = D->offset;
+            dumpFunction(D, f->p[i], f->source);
+            if (D->writer == NULL) *size = cast(l_uint32, D->offset - start);
+        } else
+            dumpFunction(D, f->p[i], f->source);
+    }
 }
 
 static void dumpUpvalues(DumpState *D, const Proto *f) {
@@ -170,7 +203,7 @@ static void dumpFunction(DumpState *D, const Proto *f, TString *psource) {
 static void dumpHeader(DumpState *D) {
     dumpLiteral(D, LUA_SIGNATURE);
     dumpByte(D, LUAC_VERSION);
-    dumpByte(D, LUAC_FORMAT);
+    dumpByte(D, D->fixed ? LUAC_FIXEDFORMAT : LUAC_FORMAT);
     dumpLiteral(D, LUAC_DATA);
     dumpByte(D, sizeof(Instruction));
     dumpByte(D, sizeof(lua_Integer));
@@ -179,19 +212,62 @@ static void dumpHeader(DumpState *D) {
     dumpNumber(D, LUAC_NUM);
 }
 
+static void dumpChunk(DumpState *D, const Proto *f) {
+    dumpHeader(D);
+    dumpByte(D, f->sizeupvalues);
+    dumpFunction(D, f, NULL);
+}
+
+/* number of functions nested in 'f', at any depth */
+static int countProtos(const Proto *f) {
+    int i, n = f->sizep;
+    for (i = 0; i < f->sizep; i++) n += countProtos(f->p[i]);
+    return n;
+}
+
+struct SDump { /* data of 'f_dump' */
+    DumpState D;
+    const Proto *f;
+};
+
+/* dump the chunk, after counting the sizes of its nested functions */
+static void f_dump(lua_State *L, void *ud) {
+    struct SDump *s = cast(struct SDump *, ud);
+    lua_Writer w = s->D.writer;
+    UNUSED(L);
+    if (s->D.sizes != NULL && w != NULL) {
+        s->D.writer = NULL;
+        dumpChunk(&s->D, s->f);
+        s->D.writer = w;
+        s->D.offset = 0;
+        s->D.nsizes = 0;
+    }
+    dumpChunk(&s->D, s->f);
+}
+
 /*
-** dump Lua function as precompiled chunk
+** dump Lua function as precompiled chunk. Its nested functions must be
+** loaded (see 'luaD_loadprotos'). In LUAC_FIXEDFORMAT, the chunk is
+** counted once first to know the sizes of its nested functions; their
+** array is freed even if the writer raises an error.
 */
 int luaU_dump(lua_State *L, const Proto *f, lua_Writer w, void *data,
-              int strip) {
-    DumpState D;
-    D.L = L;
-    D.writer = w;
-    D.data = data;
-    D.strip = strip;
-    D.status = 0;
-    dumpHeader(&D);
-    dumpByte(&D, f->sizeupvalues);
-    dumpFunction(&D, f, NULL);
-    return D.status;
+              int strip, int fixed) {
+    struct SDump s;
+    int nested = fixed ? countProtos(f) : 0;
+    int status;
+    s.f = f;
+    s.D.L = L;
+    s.D.writer = w;
+    s.D.data = data;
+    s.D.strip = strip;
+    s.D.fixed = fixed;
+    s.D.offset = 0;
+    s.D.sizes = (nested > 0) ? luaM_newvector(L, nested, l_uint32) : NULL;
+    s.D.nsizes = 0;
+    s.D.status = 0;
+    status = luaD_pcall(L, f_dump, &s, savestack(L, L->top), L->errfunc);
+    luaM_freearray(L, s.D.sizes, nested);
+    if (l_unlikely(status != LUA_OK)) luaD_throw(L, status);
+    return s.D.status;
 }
@@ -233,19 +233,23 @@ Proto *luaF_newproto(lua_State *L) {
     f->numparams = 0;
     f->is_vararg = 0;
     f->maxstacksize = 0;
+    f->flag = 0;
     f->locvars = NULL;
     f->sizelocvars = 0;
     f->linedefined = 0;
     f->lastlinedefined = 0;
     f->source = NULL;
+    f->lazy = NULL;
+    f->sizelazy = 0;
     return f;
 }
 
 void luaF_freeproto(lua_State *L, Proto *f) {
-    luaM_freearray(L, f->code, f->sizecode);
+    if (!(f->flag & PF_FIXEDCODE)) luaM_freearray(L, f->code, f->sizecode);
     luaM_freearray(L, f->p, f->sizep);
     luaM_freearray(L, f->k, f->sizek);
-    luaM_freearray(L, f->lineinfo, f->sizelineinfo);
+    if (!(f->flag & PF_FIXEDLINE))
+        luaM_freearray(L, f->lineinfo, f->sizelineinfo);
     luaM_freearray(L, f->abslineinfo, f->sizeabslineinfo);
     luaM_freearray(L, f->locvars, f->sizelocvars);
     luaM_freearray(L, f->upvalues, f->sizeupvalues);
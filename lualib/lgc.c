@@ -774,7 +774,10 @@ static void freeobj(lua_State *L, GCObject *o) {
         }
         case LUA_VLNGSTR: {
             TString *ts = gco2ts(o);
-            luaM_freemem(L, ts, sizelstring(ts->u.lnglen));
+            if (isfixedstr(ts))
+                luaM_freemem(L, ts, sizefixedstr);
+            else
+                luaM_freemem(L, ts, sizelstring(ts->u.lnglen));
             break;
         }
         default:
@@ -1613,6 +1616,14 @@ static void incstep(lua_State *L, global_State *g) {
 void luaC_step(lua_State *L) {
     global_State *g = G(L);
     lua_assert(!g->gcemergency);
+    if (g->gcrestart) { /* restart requested by 'lua_gcrestartlater'? */
+        g->gcrestart = 0;
+        if (g->gcstp == GCSTPUSR) {
+            luaE_setdebt(g, 0);
+            g->gcstp = 0;
+            return; /* first step when the new debt is paid */
+        }
+    }
     if (gcrunning(g)) { /* running? */
         if (isdecGCmodegen(g))
             genstep(L, g);
@@ -1657,3 +1668,223 @@ void luaC_fullgc(lua_State *L, int isemergency) {
 }
 
 /* }====================================================== */
+
+/*
+** {======================================================
+** Heap snapshots
+** =======================================================
+*/
+
+/*
+** Objects reached by a heap walk are marked with WALKBIT, which is only
+** used otherwise by the test library (TESTBIT); the collector keeps it.
+*/
+#define WALKBIT TESTBIT
+
+/* bytes allocated for object 'o' and the arrays it owns */
+static size_t objsize(GCObject *o) {
+    switch (o->tt) {
+        case LUA_VSHRSTR:
+            return sizelstring(gco2ts(o)->shrlen);
+        case LUA_VLNGSTR: {
+            TString *ts = gco2ts(o);
+            return isfixedstr(ts) ? sizefixedstr : sizelstring(ts->u.lnglen);
+        }
+        case LUA_VTABLE: {
+            Table *h = gco2t(o);
+            return sizeof(Table) + allocsizenode(h) * sizeof(Node) +
+                   luaH_realasize(h) * sizeof(TValue);
+        }
+        case LUA_VLCL:
+            return sizeLclosure(gco2lcl(o)->nupvalues);
+        case LUA_VCCL:
+            return sizeCclosure(gco2ccl(o)->nupvalues);
+        case LUA_VUSERDATA: {
+            Udata *u = gco2u(o);
+            return sizeudata(u->nuvalue, u->len);
+        }
+        case LUA_VUPVAL:
+            return sizeof(UpVal);
+        case LUA_VPROTO: {
+            Proto *f = gco2p(o);
+            size_t n = sizeof(Proto) + f->sizep * sizeof(Proto *) +
+                       f->sizek * sizeof(TValue) +
+                       f->sizeabslineinfo * sizeof(AbsLineInfo) +
+                       f->sizelocvars * sizeof(LocVar) +
+                       f->sizeupvalues * sizeof(Upvaldesc);
+            if (!(f->flag & PF_FIXEDCODE))
+                n += f->sizecode * sizeof(Instruction);
+            if (!(f->flag & PF_FIXEDLINE)) n += f->sizelineinfo;
+            return n;
+        }
+        case LUA_VTHREAD: {
+            lua_State *th = gco2th(o);
+            size_t n = LUA_EXTRASPACE + sizeof(lua_State) +
+                       th->nci * sizeof(CallInfo);
+            if (th->stack != NULL)
+                n += (stacksize(th) + EXTRA_STACK) * sizeof(StackValue);
+            return n;
+        }
+        default:
+            lua_assert(0);
+            return 0;
+    }
+}
+
+/*
+** Count the objects of the heap and their bytes by type, in arrays of
+** LUA_HEAPTYPES entries: the basic types, then upvalues and prototypes.
+** Dead objects not yet collected are counted too.
+*/
+LUA_API void lua_heapcount(lua_State *L, size_t *counts, size_t *bytes) {
+    global_State *g = G(L);
+    GCObject *lists[4];
+    int i;
+    lists[0] = g->allgc;
+    lists[1] = g->finobj;
+    lists[2] = g->tobefnz;
+    lists[3] = g->fixedgc;
+    memset(counts, 0, LUA_HEAPTYPES * sizeof(size_t));
+    memset(bytes, 0, LUA_HEAPTYPES * sizeof(size_t));
+    for (i = 0; i < 4; i++) {
+        GCObject *o;
+        for (o = lists[i]; o != NULL; o = o->next) {
+            int t = novariant(o->tt);
+            counts[t]++;
+            bytes[t] += objsize(o);
+        }
+    }
+}
+
+typedef struct Walk {
+    global_State *g;
+    GCObject **stack;
+    size_t n, size;
+    size_t bytes;
+} Walk;
+
+/* mark 'o' and push it to be traversed, unless already reached */
+static void walkobject(Walk *w, GCObject *o) {
+    if (o == NULL || testbit(o->marked, WALKBIT)) return;
+    if (w->n == w->size) {
+        size_t size = w->size * 2 + 64;
+        GCObject **stack = (GCObject **)(*w->g->frealloc)(
+            w->g->ud, w->stack, w->size * sizeof(GCObject *),
+            size * sizeof(GCObject *));
+        if (stack == NULL) return; /* not enough memory: leave it out */
+        w->stack = stack;
+        w->size = size;
+    }
+    l_setbit(o->marked, WALKBIT);
+    w->bytes += objsize(o);
+    w->stack[w->n++] = o;
+}
+
+#define walkvalue(w, v) walkobject(w, gcvalueN(v))
+
+#define walkobjectN(w, t)                 \
+    {                                     \
+        if (t) walkobject(w, obj2gco(t)); \
+    }
+
+static void walkchildren(Walk *w, GCObject *o) {
+    int i;
+    switch (o->tt) {
+        case LUA_VTABLE: {
+            Table *h = gco2t(o);
+            Node *n, *limit = gnodelast(h);
+            unsigned int asize = luaH_realasize(h);
+            unsigned int j;
+            walkobjectN(w, h->metatable);
+            for (j = 0; j < asize; j++) walkvalue(w, &h->array[j]);
+            for (n = gnode(h, 0); n < limit; n++) {
+                if (!isempty(gval(n))) {
+                    walkobject(w, gckeyN(n));
+                    walkvalue(w, gval(n));
+                }
+            }
+            break;
+        }
+        case LUA_VUSERDATA: {
+            Udata *u = gco2u(o);
+            walkobjectN(w, u->metatable);
+            for (i = 0; i < u->nuvalue; i++) walkvalue(w, &u->uv[i].uv);
+            break;
+        }
+        case LUA_VLCL: {
+            LClosure *cl = gco2lcl(o);
+            walkobjectN(w, cl->p);
+            for (i = 0; i < cl->nupvalues; i++)
+                walkobjectN(w, cl->upvals[i]);
+            break;
+        }
+        case LUA_VCCL: {
+            CClosure *cl = gco2ccl(o);
+            for (i = 0; i < cl->nupvalues; i++) walkvalue(w, &cl->upvalue[i]);
+            break;
+        }
+        case LUA_VUPVAL:
+            walkvalue(w, gco2upv(o)->v);
+            break;
+        case LUA_VPROTO: {
+            Proto *f = gco2p(o);
+            walkobjectN(w, f->source);
+            for (i = 0; i < f->sizek; i++) walkvalue(w, &f->k[i]);
+            for (i = 0; i < f->sizeupvalues; i++)
+                walkobjectN(w, f->upvalues[i].name);
+            for (i = 0; i < f->sizep; i++) walkobjectN(w, f->p[i]);
+            for (i = 0; i < f->sizelocvars; i++)
+                walkobjectN(w, f->locvars[i].varname);
+            break;
+        }
+        case LUA_VTHREAD: {
+            lua_State *th = gco2th(o);
+            StkId v;
+            UpVal *uv;
+            if (th->stack == NULL) break;
+            for (v = th->stack; v < th->top; v++) walkvalue(w, s2v(v));
+            for (uv = th->openupval; uv != NULL; uv = uv->u.open.next)
+                walkobjectN(w, uv);
+            break;
+        }
+        default: /* strings */
+            break;
+    }
+}
+
+/*
+** Return the bytes of the value on the top of the stack and, if 'deep', of
+** the objects it reaches, leaving out the objects reached by previous heap
+** walks. Objects left out for lack of memory are not counted. Walks do not
+** allocate lua objects; 'lua_heapwalkend' forgets the reached objects.
+*/
+LUA_API size_t lua_heapwalk(lua_State *L, int deep) {
+    Walk w;
+    lua_lock(L);
+    w.g = G(L);
+    w.stack = NULL;
+    w.n = w.size = 0;
+    w.bytes = 0;
+    walkvalue(&w, s2v(L->top - 1));
+    while (deep && w.n > 0) walkchildren(&w, w.stack[--w.n]);
+    (*w.g->frealloc)(w.g->ud, w.stack, w.size * sizeof(GCObject *), 0);
+    lua_unlock(L);
+    return w.bytes;
+}
+
+/* forget the objects reached by heap walks */
+LUA_API void lua_heapwalkend(lua_State *L) {
+    global_State *g = G(L);
+    GCObject *lists[4];
+    int i;
+    lists[0] = g->allgc;
+    lists[1] = g->finobj;
+    lists[2] = g->tobefnz;
+    lists[3] = g->fixedgc;
+    for (i = 0; i < 4; i++) {
+        GCObject *o;
+        for (o = lists[i]; o != NULL; o = o->next) resetbit(o->marked, WALKBIT);
+    }
+}
+
+/* }====================================================== */
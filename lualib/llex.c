@@ -156,6 +156,7 @@ void luaX_setinput(lua_State *L, LexState *ls, ZIO *z, TString *source,
     ls->lastline = 1;
     ls->source = source;
     ls->envn = luaS_newliteral(L, LUA_ENV);            /* get env name */
+    ls->lazy = 0;
     luaZ_resizebuffer(ls->L, ls->buff, LUA_MINBUFFER); /* initialize buffer */
 }
 
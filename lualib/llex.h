@@ -98,6 +98,7 @@ typedef struct LexState {
     struct Dyndata *dyd; /* dynamic structures used by the parser */
     TString *source;     /* current source name */
     TString *envn;       /* environment variable name */
+    int lazy;            /* skim nested function bodies (see 'lazybody') */
 } LexState;
 
 LUAI_FUNC void luaX_init(lua_State *L);
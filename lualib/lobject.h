@@ -372,7 +372,7 @@ typedef struct GCObject {
 typedef struct TString {
     CommonHeader;
     lu_byte extra;  /* reserved words for short strings; "has hash" for longs */
-    lu_byte shrlen; /* length for short strings */
+    lu_byte shrlen; /* length for short strings; "is fixed" for longs */
     unsigned int hash;
     union {
         size_t lnglen;         /* length for long strings */
@@ -382,9 +382,20 @@ typedef struct TString {
 } TString;
 
 /*
-** Get the actual string (array of bytes) from a 'TString'.
+** Fixed strings are long strings with 'shrlen' set to 1. Their bytes are
+** not stored in the object but in a buffer that outlives the state, and
+** 'contents' holds a pointer to them (see 'luaS_newfixedlngstr').
 */
-#define getstr(ts) ((ts)->contents)
+#define isfixedstr(ts) ((ts)->tt == LUA_VLNGSTR && (ts)->shrlen)
+
+/*
+** Get the actual string (array of bytes) from a 'TString'. (A function,
+** as callers may pass expressions with side effects.)
+*/
+l_sinline char *getstr(const TString *ts) {
+    return isfixedstr(ts) ? *cast(char *const *, ts->contents)
+                          : cast_charp(ts->contents);
+}
 
 /* get the actual string (array of bytes) from a Lua value */
 #define svalue(o) getstr(tsvalue(o))
@@ -532,11 +543,23 @@ typedef struct AbsLineInfo {
 /*
 ** Function Prototypes
 */
+/*
+** Bits in 'Proto.flag': arrays loaded in place from a fixed buffer (see
+** 'luaU_undump'), which are not owned by the prototype, and prototypes
+** not loaded yet, whose dumped contents start at 'lazy', or not compiled
+** yet, whose source text is at 'lazy' (see 'lazybody' in lparser.c).
+*/
+#define PF_FIXEDCODE 1 /* 'code' */
+#define PF_FIXEDLINE 2 /* 'lineinfo' */
+#define PF_LAZY 4      /* to be loaded by 'luaU_loadlazy' */
+#define PF_UNPARSED 8  /* to be compiled by 'luaY_lazyparser' */
+
 typedef struct Proto {
     CommonHeader;
     lu_byte numparams; /* number of fixed (named) parameters */
     lu_byte is_vararg;
     lu_byte maxstacksize; /* number of registers needed by this function */
+    lu_byte flag;         /* parts living in a fixed buffer (PF_*) */
     int sizeupvalues;     /* size of 'upvalues' */
     int sizek;            /* size of 'k' */
     int sizecode;
@@ -546,6 +569,7 @@ typedef struct Proto {
     int sizeabslineinfo; /* size of 'abslineinfo' */
     int linedefined;     /* debug information  */
     int lastlinedefined; /* debug information  */
+    int sizelazy;        /* size of 'lazy', if PF_UNPARSED */
     TValue *k;           /* constants used by the function */
     Instruction *code;   /* opcodes */
     struct Proto **p;    /* functions defined inside the function */
@@ -554,6 +578,7 @@ typedef struct Proto {
     AbsLineInfo *abslineinfo; /* idem */
     LocVar *locvars; /* information about local variables (debug information) */
     TString *source; /* used for debug information */
+    const char *lazy; /* dumped function or source, if PF_LAZY/PF_UNPARSED */
     GCObject *gclist;
 } Proto;
 
@@ -905,11 +905,16 @@ static void parlist(LexState *ls) {
     luaK_reserveregs(fs, fs->nactvar); /* reserve registers for parameters */
 }
 
-static void body(LexState *ls, expdesc *e, int ismethod, int line) {
+/*
+** Compile the body of function 'f'. 'e' receives the closure in the
+** enclosing function, unless it is NULL (see 'luaY_lazyparser').
+*/
+static void funcbody(LexState *ls, Proto *f, expdesc *e, int ismethod,
+                     int line) {
     /* body ->  '(' parlist ')' block END */
     FuncState new_fs;
     BlockCnt bl;
-    new_fs.f = addprototype(ls);
+    new_fs.f = f;
     new_fs.f->linedefined = line;
     open_func(ls, &new_fs, &bl);
     checknext(ls, '(');
@@ -922,10 +927,262 @@ static void body(LexState *ls, expdesc *e, int ismethod, int line) {
     statlist(ls);
     new_fs.f->lastlinedefined = ls->linenumber;
     check_match(ls, TK_END, TK_FUNCTION, line);
-    codeclosure(ls, e);
+    if (e != NULL) codeclosure(ls, e);
     close_func(ls);
 }
 
+/*
+** {======================================================================
+** Lazy parsing (mode "L" of 'lua_load'): the body of a nested function is
+** only skimmed, and compiled by 'luaY_lazyparser' when a closure for it
+** is first created. Skimming matches the blocks of the body, raising the
+** same errors as the parser if they do not match, and resolves in the
+** enclosing functions every name the body might use as a variable. That
+** captures a superset of the variables the compiled body captures, so
+** the code of the enclosing functions stays valid. Other syntax errors
+** in the body are only raised when it is compiled, after the code run
+** before. The scanner table of the chunk is kept in the prototype, after
+** the constants of the variables, so that the strings of the body are
+** shared with the rest of the chunk as when it is compiled at once.
+** A body that could capture more than MAXUPVAL variables, or need more
+** in an enclosing function, is compiled at once instead, so that the
+** limit is checked as without mode "L".
+** =======================================================================
+*/
+
+/* position in the input right after the current token */
+#define tokenend(ls) ((ls)->z->p - ((ls)->current != EOZ))
+
+/* size of the input left in the current block after 'tokenend' */
+#define inputleft(ls) (((ls)->current != EOZ) ? (ls)->z->n + 1 : 0)
+
+typedef struct Skim {
+    Proto *f;  /* function being skimmed */
+    int nvars; /* number of variables recorded in 'f->locvars' */
+    int nups;  /* number of upvalues recorded in 'f->upvalues' */
+    int eager; /* compile the body at once (see 'lazyvar') */
+} Skim;
+
+/* whether a function enclosing the skimmed one has all its upvalues */
+static int upvalsfull(FuncState *fs) {
+    for (; fs != NULL; fs = fs->prev)
+        if (fs->nups >= MAXUPVAL) return 1;
+    return 0;
+}
+
+/*
+** Resolve the name 'n' in the functions enclosing the skimmed one and
+** record how: local variables and compile-time constants go into
+** 'locvars' (register in 'startpc', kind in 'endpc') and 'k', upvalues
+** into 'upvalues', at their index in the enclosing function. Globals
+** only need _ENV. Names are a superset of the variables of the body: if
+** they are more than MAXUPVAL, or resolving one could exceed the limit
+** in an enclosing function, the body is to be compiled at once.
+*/
+static void lazyvar(LexState *ls, Skim *sk, TString *n) {
+    lua_State *L = ls->L;
+    FuncState *fs = ls->fs;
+    Proto *f = sk->f;
+    expdesc var;
+    int i;
+    if (sk->eager) return;
+    for (i = 0; i < sk->nvars; i++)
+        if (eqstr(f->locvars[i].varname, n)) return; /* already resolved */
+    for (i = 0; i < f->sizeupvalues; i++)
+        if (eqstr(f->upvalues[i].name, n)) return;
+    if (sk->nvars + sk->nups >= MAXUPVAL || upvalsfull(fs)) {
+        sk->eager = 1;
+        return;
+    }
+    singlevaraux(fs, n, &var, 0);
+    if (var.k == VVOID) /* global name? */
+        lazyvar(ls, sk, ls->envn);
+    else if (var.k == VUPVAL) {
+        int oldsize = f->sizeupvalues;
+        if (var.u.info >= oldsize) {
+            f->upvalues = luaM_reallocvector(L, f->upvalues, oldsize,
+                                             var.u.info + 1, Upvaldesc);
+            f->sizeupvalues = var.u.info + 1;
+            while (oldsize < f->sizeupvalues)
+                f->upvalues[oldsize++].name = NULL;
+        }
+        f->upvalues[var.u.info] = fs->f->upvalues[var.u.info];
+        luaC_objbarrier(L, f, n);
+        sk->nups++;
+    } else { /* local variable or compile-time constant */
+        LocVar *lv;
+        int oldsize = f->sizelocvars;
+        luaM_growvector(L, f->locvars, sk->nvars, f->sizelocvars, LocVar,
+                        SHRT_MAX, "local variables");
+        while (oldsize < f->sizelocvars) f->locvars[oldsize++].varname = NULL;
+        oldsize = f->sizek;
+        luaM_growvector(L, f->k, sk->nvars, f->sizek, TValue, SHRT_MAX,
+                        "local variables");
+        while (oldsize < f->sizek) setnilvalue(&f->k[oldsize++]);
+        lv = &f->locvars[sk->nvars];
+        lv->varname = n;
+        luaC_objbarrier(L, f, n);
+        if (var.k == VLOCAL) {
+            lv->startpc = var.u.var.ridx;
+            lv->endpc = getlocalvardesc(fs, var.u.var.vidx)->vd.kind;
+        } else {
+            TValue *k = &ls->dyd->actvar.arr[var.u.info].k;
+            lv->startpc = 0;
+            lv->endpc = RDKCTC;
+            setobj(L, &f->k[sk->nvars], k);
+            luaC_barrier(L, f, k);
+        }
+        sk->nvars++;
+    }
+}
+
+/*
+** Skim the tokens of a block opened by 'who' at line 'line', up to the
+** token closing it, which is left as the current token.
+*/
+static void skimblock(LexState *ls, Skim *sk, int who, int line) {
+    int closer = (who == TK_REPEAT) ? TK_UNTIL : TK_END;
+    int prev = 0;     /* previous token */
+    int loop = 0;     /* 'while' or 'for' waiting for its 'do' */
+    int loopline = 0;
+    int func = 0;     /* 'function' waiting for its '(' */
+    int funcline = 0; /* line of that 'function', for 'funcstat' */
+    enterlevel(ls);
+    for (;;) {
+        int tk = ls->t.token;
+        int tkline = ls->linenumber;
+        switch (tk) {
+            case TK_END:
+            case TK_UNTIL:
+            case TK_EOS: {
+                if (tk != closer) check_match(ls, closer, who, line);
+                leavelevel(ls);
+                return;
+            }
+            case TK_ELSE:
+            case TK_ELSEIF: {
+                if (who != TK_IF) check_match(ls, closer, who, line);
+                break;
+            }
+            case TK_WHILE:
+            case TK_FOR: {
+                loop = tk;
+                loopline = tkline;
+                break;
+            }
+            case TK_DO: {
+                luaX_next(ls);
+                if (loop) skimblock(ls, sk, loop, loopline);
+                else skimblock(ls, sk, TK_DO, tkline);
+                loop = 0;
+                break;
+            }
+            case TK_IF:
+            case TK_REPEAT: {
+                luaX_next(ls);
+                skimblock(ls, sk, tk, tkline);
+                break;
+            }
+            case TK_FUNCTION: {
+                func = 1;
+                funcline = (prev != TK_LOCAL && luaX_lookahead(ls) == TK_NAME)
+                               ? tkline
+                               : 0;
+                break;
+            }
+            case '(': {
+                if (func) {
+                    func = 0;
+                    luaX_next(ls);
+                    skimblock(ls, sk, TK_FUNCTION,
+                              funcline ? funcline : tkline);
+                }
+                break;
+            }
+            case TK_NAME: {
+                if (prev != '.' && prev != ':' && prev != TK_GOTO &&
+                    prev != TK_DBCOLON)
+                    lazyvar(ls, sk, ls->t.seminfo.ts);
+                break;
+            }
+            default:
+                break;
+        }
+        prev = ls->t.token;
+        luaX_next(ls);
+    }
+}
+
+/*
+** Skim the body of a nested function, recording its source text in a
+** new prototype for 'luaY_lazyparser', and code its closure. The whole
+** chunk must be in one block of the input, which must outlive the
+** function. If the skim asks for it, the body is read again from '(' and
+** compiled at once, without the upvalues the skim added to the enclosing
+** functions.
+*/
+static void lazybody(LexState *ls, expdesc *e, int ismethod, int line) {
+    FuncState *fs = ls->fs;
+    FuncState *efs;
+    const char *start, *blockend;
+    int oldsize;
+    Skim sk;
+    LexState atbody;
+    ZIO zatbody;
+    check(ls, '(');
+    lua_assert(ls->lookahead.token == TK_EOS);
+    start = tokenend(ls) - 1;
+    blockend = tokenend(ls) + inputleft(ls);
+    atbody = *ls;
+    zatbody = *ls->z;
+    for (efs = fs; efs != NULL; efs = efs->prev) efs->skimnups = efs->nups;
+    sk.f = addprototype(ls);
+    sk.nvars = 0;
+    sk.nups = 0;
+    sk.eager = 0;
+    sk.f->flag = PF_UNPARSED;
+    sk.f->linedefined = line;
+    sk.f->lastlinedefined = ls->linenumber; /* line of '(' */
+    sk.f->numparams = cast_byte(ismethod);
+    sk.f->source = ls->source;
+    luaC_objbarrier(ls->L, sk.f, sk.f->source);
+    luaX_next(ls); /* skip '(' */
+    skimblock(ls, &sk, TK_FUNCTION, line);
+    if (tokenend(ls) + inputleft(ls) != blockend)
+        luaX_syntaxerror(ls, "chunk not read at once (needed by mode 'L')");
+    if (sk.eager) {
+        for (efs = fs; efs != NULL; efs = efs->prev) efs->nups = efs->skimnups;
+        *ls->z = zatbody;
+        *ls = atbody;
+        fs->np--; /* drop the skimmed prototype */
+        funcbody(ls, addprototype(ls), e, ismethod, line);
+        return;
+    }
+    sk.f->lazy = start;
+    sk.f->sizelazy = cast_int(tokenend(ls) - start); /* up to 'end' */
+    luaM_shrinkvector(ls->L, sk.f->locvars, sk.f->sizelocvars, sk.nvars,
+                      LocVar);
+    oldsize = sk.f->sizek;
+    luaM_growvector(ls->L, sk.f->k, sk.nvars, sk.f->sizek, TValue, SHRT_MAX,
+                    "local variables");
+    while (oldsize < sk.f->sizek) setnilvalue(&sk.f->k[oldsize++]);
+    luaM_shrinkvector(ls->L, sk.f->k, sk.f->sizek, sk.nvars + 1, TValue);
+    sethvalue(ls->L, &sk.f->k[sk.nvars], ls->h); /* scanner table */
+    luaC_objbarrier(ls->L, sk.f, ls->h);
+    luaX_next(ls); /* skip 'end' */
+    init_exp(e, VRELOC, luaK_codeABx(fs, OP_CLOSURE, 0, fs->np - 1));
+    luaK_exp2nextreg(fs, e); /* fix it at the last register */
+}
+
+/* }====================================================================== */
+
+static void body(LexState *ls, expdesc *e, int ismethod, int line) {
+    if (ls->lazy)
+        lazybody(ls, e, ismethod, line);
+    else
+        funcbody(ls, addprototype(ls), e, ismethod, line);
+}
+
 static int explist(LexState *ls, expdesc *v) {
     /* explist -> expr { ',' expr } */
     int n = 1; /* at least one expression */
@@ -1842,7 +2099,7 @@ static void mainfunc(LexState *ls, FuncState *fs) {
 }
 
 LClosure *luaY_parser(lua_State *L, ZIO *z, Mbuffer *buff, Dyndata *dyd,
-                      const char *name, int firstchar) {
+                      const char *name, int firstchar, int lazy) {
     LexState lexstate;
     FuncState funcstate;
     LClosure *cl = luaF_newLclosure(L, 1); /* create main closure */
@@ -1859,6 +2116,7 @@ LClosure *luaY_parser(lua_State *L, ZIO *z, Mbuffer *buff, Dyndata *dyd,
     lexstate.dyd = dyd;
     dyd->actvar.n = dyd->gt.n = dyd->label.n = 0;
     luaX_setinput(L, &lexstate, z, funcstate.f->source, firstchar);
+    lexstate.lazy = lazy;
     mainfunc(&lexstate, &funcstate);
     lua_assert(!funcstate.prev && funcstate.nups == 1 && !lexstate.fs);
     /* all scopes should be correctly finished */
@@ -1866,3 +2124,65 @@ LClosure *luaY_parser(lua_State *L, ZIO *z, Mbuffer *buff, Dyndata *dyd,
     L->top--;  /* remove scanner's table */
     return cl; /* closure is on the stack, too */
 }
+
+typedef struct LazyS {
+    const char *s;
+    size_t size;
+} LazyS;
+
+static const char *getlazy(lua_State *L, void *ud, size_t *size) {
+    LazyS *ls = cast(LazyS *, ud);
+    UNUSED(L);
+    *size = ls->size;
+    ls->size = 0;
+    return (*size > 0) ? ls->s : NULL;
+}
+
+/*
+** Compile the function 'f' skimmed by 'lazybody' and return the new
+** prototype. Its enclosing function is rebuilt from what 'lazyvar'
+** recorded, which is all that compiling the body can look up there, and
+** strings are created in the scanner table of the chunk.
+*/
+Proto *luaY_lazyparser(lua_State *L, Proto *f, Mbuffer *buff, Dyndata *dyd) {
+    LexState lexstate;
+    FuncState outer;
+    BlockCnt bl;
+    LazyS src;
+    ZIO z;
+    Proto *np;
+    int i;
+    LClosure *cl = luaF_newLclosure(L, 0); /* anchor for the new function */
+    setclLvalue2s(L, L->top, cl);
+    luaD_inctop(L);
+    lexstate.h = hvalue(&f->k[f->sizelocvars]); /* table for scanner */
+    sethvalue2s(L, L->top, lexstate.h);         /* anchor it */
+    luaD_inctop(L);
+    np = cl->p = luaF_newproto(L);
+    luaC_objbarrier(L, cl, np);
+    lexstate.buff = buff;
+    lexstate.dyd = dyd;
+    dyd->actvar.n = dyd->gt.n = dyd->label.n = 0;
+    src.s = f->lazy;
+    src.size = f->sizelazy;
+    luaZ_init(L, &z, getlazy, &src);
+    luaX_setinput(L, &lexstate, &z, f->source, zgetc(&z));
+    lexstate.linenumber = lexstate.lastline = f->lastlinedefined;
+    lexstate.lazy = 1;
+    outer.f = f;
+    open_func(&lexstate, &outer, &bl);
+    outer.nups = cast_byte(f->sizeupvalues);
+    for (i = 0; i < f->sizelocvars; i++) {
+        int vidx = new_localvar(&lexstate, f->locvars[i].varname);
+        Vardesc *vd = getlocalvardesc(&outer, vidx);
+        setobj(L, &vd->k, &f->k[i]);
+        vd->vd.kind = cast_byte(f->locvars[i].endpc);
+        vd->vd.ridx = cast_byte(f->locvars[i].startpc);
+    }
+    outer.nactvar = cast_byte(f->sizelocvars);
+    luaX_next(&lexstate); /* read '(' */
+    funcbody(&lexstate, np, NULL, f->numparams, f->linedefined);
+    lua_assert(lexstate.fs == &outer);
+    L->top -= 2; /* remove closure and scanner's table */
+    return np;
+}
@@ -150,10 +150,14 @@ typedef struct FuncState {
     lu_byte freereg;        /* first free register */
     lu_byte iwthabs;   /* instructions issued since last absolute line info */
     lu_byte needclose; /* function needs to close upvalues when returning */
+    lu_byte skimnups;  /* 'nups' before skimming a lazy body */
 } FuncState;
 
 LUAI_FUNC int luaY_nvarstack(FuncState *fs);
 LUAI_FUNC LClosure *luaY_parser(lua_State *L, ZIO *z, Mbuffer *buff,
-                                Dyndata *dyd, const char *name, int firstchar);
+                                Dyndata *dyd, const char *name, int firstchar,
+                                int lazy);
+LUAI_FUNC Proto *luaY_lazyparser(lua_State *L, Proto *f, Mbuffer *buff,
+                                 Dyndata *dyd);
 
 #endif
@@ -24,6 +24,7 @@
 #include "ltable.h"
 #include "ltm.h"
 #include "lua.h"
+#include "lundump.h"
 
 /*
 ** thread state + extra space
@@ -217,7 +218,9 @@ static void f_luaopen(lua_State *L, void *ud) {
     init_registry(L, g);
     luaS_init(L);
     luaT_init(L);
-    luaX_init(L);
+#if !defined(LUA_NOPARSER)
+    luaX_init(L); /* reserved words are only needed by the lexer */
+#endif
     g->gcstp = 0;              /* allow gc */
     setnilvalue(&g->nilvalue); /* now state is complete */
     luai_userstateopen(L);
@@ -326,7 +329,13 @@ LUA_API int lua_resetthread(lua_State *L) {
     return status;
 }
 
-LUA_API lua_State *lua_newstate(lua_Alloc f, void *ud) {
+/*
+** Seed used by states that will be dumped as heap images: their layout
+** must not depend on where they were built.
+*/
+#define IMAGESEED 0xBEEFBEEF
+
+static lua_State *newstate(lua_Alloc f, void *ud, int fixedseed) {
     int i;
     lua_State *L;
     global_State *g;
@@ -346,7 +355,7 @@ LUA_API lua_State *lua_newstate(lua_Alloc f, void *ud) {
     g->warnf = NULL;
     g->ud_warn = NULL;
     g->mainthread = L;
-    g->seed = luai_makeseed(L);
+    g->seed = fixedseed ? IMAGESEED : luai_makeseed(L);
     g->gcstp = GCSTPGC; /* no GC while building state */
     g->strt.size = g->strt.nuse = 0;
     g->strt.hash = NULL;
@@ -355,6 +364,7 @@ LUA_API lua_State *lua_newstate(lua_Alloc f, void *ud) {
     g->gcstate = GCSpause;
     g->gckind = KGC_INC;
     g->gcstopem = 0;
+    g->gcrestart = 0;
     g->gcemergency = 0;
     g->finobj = g->tobefnz = g->fixedgc = NULL;
     g->firstold1 = g->survival = g->old1 = g->reallyold = NULL;
@@ -381,6 +391,127 @@ LUA_API lua_State *lua_newstate(lua_Alloc f, void *ud) {
     return L;
 }
 
+LUA_API lua_State *lua_newstate(lua_Alloc f, void *ud) {
+    return newstate(f, ud, 0);
+}
+
+/*
+** {======================================================
+** Heap images
+** =======================================================
+*/
+
+/*
+** Create a state suitable for 'lua_dumpimage': built with the same
+** allocations, two such states differ only in their heap addresses.
+*/
+LUA_API lua_State *lua_newimagestate(lua_Alloc f, void *ud) {
+    return newstate(f, ud, 1);
+}
+
+/*
+** Dump the heap of a state as a relocatable image. 'La' and 'Lb' must
+** have been built identically by 'lua_newimagestate' on two heaps 'a' and
+** 'b' of 'size' bytes each; words where the two heaps differ by exactly
+** the distance between them are the pointers to be relocated. Any other
+** difference means the heap content depends on something else than its
+** address, and the dump fails. When 'out' is NULL only the size of the
+** image is stored into 'outlen'.
+*/
+LUA_API int lua_dumpimage(lua_State *La, const void *a, lua_State *Lb,
+                          const void *b, size_t size, void *out,
+                          size_t *outlen) {
+    const size_t *wa = cast(const size_t *, a);
+    const size_t *wb = cast(const size_t *, b);
+    size_t delta = cast_sizet(cast_charp(b) - cast_charp(a));
+    size_t nwords = size / sizeof(size_t);
+    size_t total = sizeof(ImageHeader) + size + imagebitmapsize(size);
+    ImageHeader h;
+    lu_byte *bitmap;
+    size_t i;
+    if (size % sizeof(size_t) != 0 || cast_sizet(a) % sizeof(size_t) != 0 ||
+        cast_charp(La) - cast_charp(a) != cast_charp(Lb) - cast_charp(b))
+        return LUA_ERRRUN;
+    if (out == NULL) {
+        *outlen = total;
+        return LUA_OK;
+    }
+    if (*outlen < total) return LUA_ERRMEM;
+    memcpy(h.signature, LUA_IMAGESIGNATURE, sizeof(h.signature));
+    h.version = LUAC_VERSION;
+    h.wordsize = sizeof(size_t);
+    h.unused[0] = h.unused[1] = 0;
+    h.layout = sizeof(LG);
+    h.anchor = cast_sizet(&lua_newstate);
+    h.base = cast_sizet(a);
+    h.size = size;
+    h.mainthread = cast_sizet(cast_charp(La) - cast_charp(a));
+    memcpy(out, &h, sizeof(h));
+    memcpy(cast_charp(out) + sizeof(h), a, size);
+    bitmap = cast(lu_byte *, out) + sizeof(h) + size;
+    memset(bitmap, 0, imagebitmapsize(size));
+    for (i = 0; i < nwords; i++) {
+        if (wa[i] == wb[i]) continue;
+        if (wb[i] - wa[i] != delta) return LUA_ERRRUN;
+        bitmap[i / 8] |= cast_byte(1u << (i % 8));
+    }
+    *outlen = total;
+    return LUA_OK;
+}
+
+/*
+** Check whether 'image' can be loaded by this binary and return the size
+** of the heap it needs, or 0 if it cannot be loaded.
+*/
+LUA_API size_t lua_imagesize(const void *image, size_t len) {
+    ImageHeader h;
+    if (len < sizeof(h)) return 0;
+    memcpy(&h, image, sizeof(h));
+    if (memcmp(h.signature, LUA_IMAGESIGNATURE, sizeof(h.signature)) != 0 ||
+        h.version != LUAC_VERSION || h.wordsize != sizeof(size_t) ||
+        h.layout != sizeof(LG) || h.anchor != cast_sizet(&lua_newstate) ||
+        h.mainthread >= h.size ||
+        len - sizeof(h) < h.size + imagebitmapsize(h.size))
+        return 0;
+    return h.size;
+}
+
+/*
+** Create a state from a heap image. The image is copied into 'heap',
+** which must be word aligned and have at least 'lua_imagesize' bytes, and
+** its pointers are relocated to the new address. Blocks inside 'heap'
+** were not allocated by 'f', so 'f' must not give them back to the
+** system when Lua frees or reallocates them.
+*/
+LUA_API lua_State *lua_loadimage(lua_Alloc f, void *ud, const void *image,
+                                 size_t len, void *heap) {
+    ImageHeader h;
+    const lu_byte *bitmap;
+    size_t *words = cast(size_t *, heap);
+    size_t delta, nwords, i;
+    lua_State *L;
+    if (lua_imagesize(image, len) == 0 ||
+        cast_sizet(heap) % sizeof(size_t) != 0)
+        return NULL;
+    memcpy(&h, image, sizeof(h));
+    memcpy(heap, cast_charp(image) + sizeof(h), h.size);
+    bitmap = cast(const lu_byte *, image) + sizeof(h) + h.size;
+    delta = cast_sizet(heap) - h.base;
+    nwords = h.size / sizeof(size_t);
+    for (i = 0; i < nwords; i += 8) {
+        lu_byte bits = bitmap[i / 8];
+        size_t j;
+        for (j = i; bits != 0; j++, bits >>= 1)
+            if (bits & 1) words[j] += delta;
+    }
+    L = cast(lua_State *, cast_charp(heap) + h.mainthread);
+    G(L)->frealloc = f;
+    G(L)->ud = ud;
+    return L;
+}
+
+/* }====================================================== */
+
 LUA_API void lua_close(lua_State *L) {
     lua_lock(L);
     L = G(L)->mainthread; /* only the main thread can be closed */
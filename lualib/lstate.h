@@ -245,6 +245,7 @@ typedef struct global_State {
     lu_byte genminormul; /* control for minor generational collections */
     lu_byte genmajormul; /* control for major generational collections */
     lu_byte gcstp;       /* control whether GC is running */
+    lu_byte gcrestart;   /* true if the GC must restart at its next step */
     lu_byte gcemergency; /* true if this is an emergency collection */
     lu_byte gcpause;     /* size of pause between successive GCs */
     lu_byte gcstepmul;   /* GC "speed" */
@@ -360,6 +361,28 @@ union GCUnion {
 */
 #define obj2gco(v) check_exp((v)->tt >= LUA_TSTRING, &(cast_u(v)->gc))
 
+/*
+** Header of a heap image (see 'lua_dumpimage'). It is followed by 'size'
+** bytes of heap and by a relocation bitmap with one bit for each word of
+** the heap; words with their bit set point into the heap itself.
+*/
+typedef struct ImageHeader {
+    char signature[4]; /* LUA_IMAGESIGNATURE */
+    lu_byte version;   /* LUAC_VERSION */
+    lu_byte wordsize;  /* sizeof(size_t) */
+    lu_byte unused[2];
+    size_t layout;     /* size of the main block, to detect other layouts */
+    size_t anchor;     /* address of 'lua_newstate' in the dumping binary */
+    size_t base;       /* heap address when the image was dumped */
+    size_t size;       /* size of the heap */
+    size_t mainthread; /* offset of the main thread in the heap */
+} ImageHeader;
+
+#define LUA_IMAGESIGNATURE "\x1bLim"
+
+/* size of the relocation bitmap of a heap with 's' bytes */
+#define imagebitmapsize(s) (((s) / sizeof(size_t) + 7) / 8)
+
 /* actual number of total bytes allocated */
 #define gettotalbytes(g) cast(lu_mem, (g)->totalbytes + (g)->GCdebt)
 
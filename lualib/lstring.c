@@ -135,7 +135,8 @@ static TString *createstrobj(lua_State *L, size_t l, int tag, unsigned int h) {
     ts = gco2ts(o);
     ts->hash = h;
     ts->extra = 0;
-    getstr(ts)[l] = '\0'; /* ending 0 */
+    ts->shrlen = 0;       /* not fixed, if long */
+    ts->contents[l] = '\0'; /* ending 0 */
     return ts;
 }
 
@@ -145,6 +146,23 @@ TString *luaS_createlngstrobj(lua_State *L, size_t l) {
     return ts;
 }
 
+/*
+** Creates a long string without copying its contents: 's' must point to
+** 'l' bytes followed by a '\0', which stay valid and unchanged as long as
+** the state is alive.
+*/
+TString *luaS_newfixedlngstr(lua_State *L, const char *s, size_t l) {
+    GCObject *o = luaC_newobj(L, LUA_VLNGSTR, sizefixedstr);
+    TString *ts = gco2ts(o);
+    lua_assert(s[l] == '\0');
+    ts->hash = G(L)->seed;
+    ts->extra = 0;
+    ts->shrlen = 1; /* fixed */
+    ts->u.lnglen = l;
+    *cast(const char **, ts->contents) = s;
+    return ts;
+}
+
 void luaS_remove(lua_State *L, TString *ts) {
     stringtable *tb = &G(L)->strt;
     TString **p = &tb->hash[lmod(ts->hash, tb->size)];
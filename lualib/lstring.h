@@ -23,6 +23,9 @@
 */
 #define sizelstring(l) (offsetof(TString, contents) + ((l) + 1) * sizeof(char))
 
+/* size of a fixed string, which only keeps a pointer to its contents */
+#define sizefixedstr (offsetof(TString, contents) + sizeof(char *))
+
 #define luaS_newliteral(L, s) \
     (luaS_newlstr(L, "" s, (sizeof(s) / sizeof(char)) - 1))
 
@@ -47,5 +50,6 @@ LUAI_FUNC Udata *luaS_newudata(lua_State *L, size_t s, int nuvalue);
 LUAI_FUNC TString *luaS_newlstr(lua_State *L, const char *str, size_t l);
 LUAI_FUNC TString *luaS_new(lua_State *L, const char *str);
 LUAI_FUNC TString *luaS_createlngstrobj(lua_State *L, size_t l);
+LUAI_FUNC TString *luaS_newfixedlngstr(lua_State *L, const char *s, size_t l);
 
 #endif
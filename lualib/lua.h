@@ -135,6 +135,30 @@ LUA_API int(lua_resetthread)(lua_State *L);
 
 LUA_API lua_CFunction(lua_atpanic)(lua_State *L, lua_CFunction panicf);
 
+/*
+** heap images of initialized states
+*/
+LUA_API lua_State *(lua_newimagestate)(lua_Alloc f, void *ud);
+LUA_API int(lua_dumpimage)(lua_State *La, const void *a, lua_State *Lb,
+                           const void *b, size_t size, void *out,
+                           size_t *outlen);
+LUA_API size_t(lua_imagesize)(const void *image, size_t len);
+LUA_API lua_State *(lua_loadimage)(lua_Alloc f, void *ud, const void *image,
+                                   size_t len, void *heap);
+
+/*
+** heap snapshots (see 'lua_heapcount' and 'lua_heapwalk')
+*/
+#define LUA_HEAPTYPES (LUA_NUMTYPES + 2) /* types, upvalues, prototypes */
+
+LUA_API void(lua_heapcount)(lua_State *L, size_t *counts, size_t *bytes);
+LUA_API size_t(lua_heapwalk)(lua_State *L, int deep);
+LUA_API void(lua_heapwalkend)(lua_State *L);
+
+#if defined(LUAI_OPCOUNT)
+LUA_API size_t(lua_opcount)(int op, int next); /* see lvm.c */
+#endif
+
 LUA_API lua_Number(lua_version)(lua_State *L);
 
 /*
@@ -256,9 +280,25 @@ LUA_API int(lua_pcallk)(lua_State *L, int nargs, int nresults, int errfunc,
                         lua_KContext ctx, lua_KFunction k);
 #define lua_pcall(L, n, r, f) lua_pcallk(L, (n), (r), (f), 0, NULL)
 
+/*
+** Besides "b" and "t", 'mode' may contain "B": the memory returned by
+** 'reader' stays valid and unchanged as long as the state is alive, so
+** binary chunks can be used in place instead of being copied; and "L":
+** the bodies of nested functions in text chunks are compiled when first
+** used, which needs the same guarantee as "B" and the whole chunk
+** returned by a single call to 'reader'. With "L", syntax errors inside
+** a body, other than unmatched blocks, are raised when it is compiled,
+** after the code of the chunk run until then, rather than by 'lua_load'.
+*/
 LUA_API int(lua_load)(lua_State *L, lua_Reader reader, void *dt,
                       const char *chunkname, const char *mode);
 
+/*
+** 'strip' is a boolean, optionally or'ed with LUA_DUMPFIXED to dump in a
+** format that mode "B" of 'lua_load' uses in place as much as possible.
+*/
+#define LUA_DUMPFIXED 2
+
 LUA_API int(lua_dump)(lua_State *L, lua_Writer writer, void *data, int strip);
 
 /*
@@ -295,6 +335,7 @@ LUA_API void(lua_warning)(lua_State *L, const char *msg, int tocont);
 #define LUA_GCINC 11
 
 LUA_API int(lua_gc)(lua_State *L, int what, ...);
+LUA_API void(lua_gcrestartlater)(lua_State *L);
 
 /*
 ** miscellaneous functions
@@ -15,6 +15,7 @@
 
 #include "lauxlib.h"
 #include "ldebug.h"
+#include "ldo.h"
 #include "lobject.h"
 #include "lopcodes.h"
 #include "lopnames.h"
@@ -32,6 +33,7 @@ static void PrintFunction(const Proto* f, int full);
 static int listing = 0;                 /* list bytecodes? */
 static int dumping = 1;                 /* dump bytecodes? */
 static int stripping = 0;               /* strip debug information? */
+static int fixed = 0;                   /* dump for loading in place? */
 static char Output[] = {OUTPUT};        /* default output file name */
 static const char* output = Output;     /* actual output file name */
 static const char* progname = PROGNAME; /* actual program name */
@@ -56,6 +58,7 @@ static void usage(const char* message) {
     fprintf(stderr,
             "usage: %s [options] [filenames]\n"
             "Available options are:\n"
+            "  -F       dump in the format for loading in place\n"
             "  -l       list (use -l -l for full listing)\n"
             "  -o name  output to file 'name' (default is \"%s\")\n"
             "  -p       parse only\n"
@@ -83,6 +86,8 @@ static int doargs(int argc, char* argv[]) {
             break;
         } else if (IS("-")) /* end of options; use stdin */
             break;
+        else if (IS("-F")) /* dump for loading in place */
+            fixed = 1;
         else if (IS("-l")) /* list */
             ++listing;
         else if (IS("-o")) /* output file */
@@ -161,6 +166,9 @@ static int pmain(lua_State* L) {
     for (i = 0; i < argc; i++) {
         const char* filename = IS("-") ? NULL : argv[i];
         if (luaL_loadfile(L, filename) != LUA_OK) fatal(lua_tostring(L, -1));
+        lua_lock(L);
+        luaD_loadprotos(L, toproto(L, -1)); /* 'luaU_dump' needs them all */
+        lua_unlock(L);
     }
     f = combine(L, argc);
     if (listing) luaU_print(f, listing > 1);
@@ -168,7 +176,7 @@ static int pmain(lua_State* L) {
         FILE* D = (output == NULL) ? stdout : fopen(output, "wb");
         if (D == NULL) cannot("open");
         lua_lock(L);
-        luaU_dump(L, f, writer, D, stripping);
+        luaU_dump(L, f, writer, D, stripping, fixed);
         lua_unlock(L);
         if (ferror(D)) cannot("write");
         if (fclose(D)) cannot("close");
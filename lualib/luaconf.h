@@ -40,6 +40,13 @@
 */
 /* #define LUA_USE_C89 */
 
+/*
+@@ LUA_NOPARSER removes the compiler (lparser.c, llex.c and lcode.c)
+** from the core. Only precompiled chunks can be loaded then; loading a
+** text chunk raises a syntax error.
+*/
+/* #define LUA_NOPARSER */
+
 /*
 ** By default, Lua on Windows use (some) specific Windows features
 */
@@ -30,6 +30,9 @@ typedef struct {
     lua_State *L;
     ZIO *Z;
     const char *name;
+    int fixed;       /* can the chunk be used in place? (mode "B") */
+    int fixedformat; /* is the chunk in LUAC_FIXEDFORMAT? */
+    size_t offset;   /* number of bytes read so far */
 } LoadState;
 
 static l_noret error(LoadState *S, const char *why) {
@@ -45,6 +48,7 @@ static l_noret error(LoadState *S, const char *why) {
 
 static void loadBlock(LoadState *S, void *b, size_t size) {
     if (luaZ_read(S->Z, b, size) != 0) error(S, "truncated chunk");
+    S->offset += size;
 }
 
 #define loadVar(S, x) loadVector(S, &x, 1)
@@ -52,9 +56,42 @@ static void loadBlock(LoadState *S, void *b, size_t size) {
 static lu_byte loadByte(LoadState *S) {
     int b = zgetc(S->Z);
     if (b == EOZ) error(S, "truncated chunk");
+    S->offset++;
     return cast_byte(b);
 }
 
+/*
+** When loading in place, return the address of the next 'size' bytes of
+** the chunk and skip them, if they are contiguous in the memory returned
+** by the reader and aligned to 'align'. Otherwise return NULL, and the
+** caller copies them as usual.
+*/
+static const char *getFixedBlock(LoadState *S, size_t size, size_t align) {
+    ZIO *z = S->Z;
+    const char *b;
+    if (!S->fixed || size == 0) return NULL;
+    if (z->n == 0) { /* current block consumed? */
+        if (luaZ_fill(z) == EOZ) return NULL;
+        z->n++; /* 'luaZ_fill' consumed first byte; put it back */
+        z->p--;
+    }
+    b = z->p;
+    if (z->n < size || point2uint(b) % align != 0) return NULL;
+    z->n -= size;
+    z->p += size;
+    S->offset += size;
+    return b;
+}
+
+/*
+** Skip the padding aligning the next field of a chunk in LUAC_FIXEDFORMAT
+*/
+static void loadAlign(LoadState *S, size_t align) {
+    size_t padding = (align - S->offset % align) % align;
+    while (padding-- > 0)
+        if (loadByte(S) != 0) error(S, "bad padding");
+}
+
 static size_t loadUnsigned(LoadState *S, size_t limit) {
     size_t x = 0;
     int b;
@@ -89,6 +126,7 @@ static lua_Integer loadInteger(LoadState *S) {
 static TString *loadStringN(LoadState *S, Proto *p) {
     lua_State *L = S->L;
     TString *ts;
+    const char *s;
     size_t size = loadSize(S);
     if (size == 0) /* no string? */
         return NULL;
@@ -96,6 +134,12 @@ static TString *loadStringN(LoadState *S, Proto *p) {
         char buff[LUAI_MAXSHORTLEN];
         loadVector(S, buff, size);          /* load string into buffer */
         ts = luaS_newlstr(L, buff, size);   /* create string */
+    } else if (S->fixedformat &&          /* long string usable in place? */
+               (s = getFixedBlock(S, size + 1, 1)) != NULL) {
+        if (s[size] != '\0') error(S, "bad format for string");
+        ts = luaS_newfixedlngstr(L, s, size);
+        luaC_objbarrier(L, p, ts);
+        return ts; /* '\0' already skipped */
     } else {                                /* long string */
         ts = luaS_createlngstrobj(L, size); /* create string */
         setsvalue2s(L, L->top, ts); /* anchor it ('loadVector' can GC) */
@@ -104,6 +148,8 @@ static TString *loadStringN(LoadState *S, Proto *p) {
         L->top--;                        /* pop string */
     }
     luaC_objbarrier(L, p, ts);
+    if (S->fixedformat && loadByte(S) != '\0')
+        error(S, "bad format for string");
     return ts;
 }
 
@@ -118,9 +164,18 @@ static TString *loadString(LoadState *S, Proto *p) {
 
 static void loadCode(LoadState *S, Proto *f) {
     int n = loadInt(S);
-    f->code = luaM_newvectorchecked(S->L, n, Instruction);
-    f->sizecode = n;
-    loadVector(S, f->code, n);
+    const char *b;
+    if (S->fixedformat) loadAlign(S, sizeof(Instruction));
+    b = getFixedBlock(S, n * sizeof(Instruction), sizeof(Instruction));
+    if (b != NULL) { /* use code in place */
+        f->code = cast(Instruction *, b);
+        f->flag |= PF_FIXEDCODE;
+        f->sizecode = n;
+    } else {
+        f->code = luaM_newvectorchecked(S->L, n, Instruction);
+        f->sizecode = n;
+        loadVector(S, f->code, n);
+    }
 }
 
 static void loadFunction(LoadState *S, Proto *f, TString *psource);
@@ -169,6 +224,19 @@ static void loadProtos(LoadState *S, Proto *f) {
     for (i = 0; i < n; i++) {
         f->p[i] = luaF_newproto(S->L);
         luaC_objbarrier(S->L, f, f->p[i]);
+        if (S->fixedformat) {
+            l_uint32 size;
+            const char *b;
+            loadAlign(S, sizeof(size));
+            loadVar(S, size);
+            b = getFixedBlock(S, size, 1);
+            if (b != NULL) { /* load it when a closure is created */
+                f->p[i]->flag = PF_LAZY;
+                f->p[i]->lazy = b;
+                f->p[i]->source = f->source; /* parent's source, for now */
+                continue;
+            }
+        }
         loadFunction(S, f->p[i], f->source);
     }
 }
@@ -195,10 +263,18 @@ static void loadUpvalues(LoadState *S, Proto *f) {
 
 static void loadDebug(LoadState *S, Proto *f) {
     int i, n;
+    const char *b;
     n = loadInt(S);
-    f->lineinfo = luaM_newvectorchecked(S->L, n, ls_byte);
-    f->sizelineinfo = n;
-    loadVector(S, f->lineinfo, n);
+    b = getFixedBlock(S, n, 1);
+    if (b != NULL) { /* use line information in place */
+        f->lineinfo = cast(ls_byte *, b);
+        f->flag |= PF_FIXEDLINE;
+        f->sizelineinfo = n;
+    } else {
+        f->lineinfo = luaM_newvectorchecked(S->L, n, ls_byte);
+        f->sizelineinfo = n;
+        loadVector(S, f->lineinfo, n);
+    }
     n = loadInt(S);
     f->abslineinfo = luaM_newvectorchecked(S->L, n, AbsLineInfo);
     f->sizeabslineinfo = n;
@@ -253,7 +329,16 @@ static void checkHeader(LoadState *S) {
     /* skip 1st char (already read and checked) */
     checkliteral(S, &LUA_SIGNATURE[1], "not a binary chunk");
     if (loadByte(S) != LUAC_VERSION) error(S, "version mismatch");
-    if (loadByte(S) != LUAC_FORMAT) error(S, "format mismatch");
+    switch (loadByte(S)) {
+        case LUAC_FORMAT:
+            S->fixedformat = 0;
+            break;
+        case LUAC_FIXEDFORMAT:
+            S->fixedformat = 1;
+            break;
+        default:
+            error(S, "format mismatch");
+    }
     checkliteral(S, LUAC_DATA, "corrupted chunk");
     checksize(S, Instruction);
     checksize(S, lua_Integer);
@@ -262,10 +347,97 @@ static void checkHeader(LoadState *S) {
     if (loadNumber(S) != LUAC_NUM) error(S, "float format mismatch");
 }
 
+typedef struct LazyLoad {
+    LoadState S;
+    Proto *f;
+    const char *b; /* dumped function */
+    size_t size;   /* its size, or 0 once given to the ZIO */
+} LazyLoad;
+
+static const char *getLazy(lua_State *L, void *ud, size_t *size) {
+    LazyLoad *ll = cast(LazyLoad *, ud);
+    UNUSED(L);
+    if (ll->size == 0) return NULL;
+    *size = ll->size;
+    ll->size = 0;
+    return ll->b;
+}
+
+static void f_loadlazy(lua_State *L, void *ud) {
+    LazyLoad *ll = cast(LazyLoad *, ud);
+    loadFunction(&ll->S, ll->f, ll->f->source);
+    luai_verifycode(L, ll->f);
+}
+
+/*
+** Release what a failed 'luaU_loadlazy' loaded, so that the prototype is
+** consistent and can be loaded again.
+*/
+static void resetlazy(lua_State *L, Proto *f, TString *psource) {
+    if (!(f->flag & PF_FIXEDCODE)) luaM_freearray(L, f->code, f->sizecode);
+    luaM_freearray(L, f->p, f->sizep);
+    luaM_freearray(L, f->k, f->sizek);
+    if (!(f->flag & PF_FIXEDLINE))
+        luaM_freearray(L, f->lineinfo, f->sizelineinfo);
+    luaM_freearray(L, f->abslineinfo, f->sizeabslineinfo);
+    luaM_freearray(L, f->locvars, f->sizelocvars);
+    luaM_freearray(L, f->upvalues, f->sizeupvalues);
+    f->code = NULL;
+    f->sizecode = 0;
+    f->p = NULL;
+    f->sizep = 0;
+    f->k = NULL;
+    f->sizek = 0;
+    f->lineinfo = NULL;
+    f->sizelineinfo = 0;
+    f->abslineinfo = NULL;
+    f->sizeabslineinfo = 0;
+    f->locvars = NULL;
+    f->sizelocvars = 0;
+    f->upvalues = NULL;
+    f->sizeupvalues = 0;
+    f->flag = PF_LAZY;
+    f->source = psource;
+}
+
+/*
+** Load a nested function skipped by 'loadProtos'. Its dumped contents
+** are preceded by their size.
+*/
+void luaU_loadlazy(lua_State *L, Proto *f) {
+    LazyLoad ll;
+    ZIO z;
+    l_uint32 size;
+    TString *psource = f->source;
+    int status;
+    lua_assert(f->flag == PF_LAZY);
+    memcpy(&size, f->lazy - sizeof(size), sizeof(size));
+    ll.f = f;
+    ll.b = f->lazy;
+    ll.size = size;
+    luaZ_init(L, &z, getLazy, &ll);
+    ll.S.L = L;
+    ll.S.Z = &z;
+    ll.S.name = "binary string";
+    ll.S.fixed = 1;
+    ll.S.fixedformat = 1;
+    ll.S.offset = 0; /* functions start aligned */
+    f->flag = 0;
+    status = luaD_rawrunprotected(L, f_loadlazy, &ll);
+    if (l_unlikely(status != LUA_OK)) {
+        resetlazy(L, f, psource);
+        luaD_throw(L, status);
+    }
+    f->lazy = NULL;
+}
+
 /*
-** Load precompiled chunk.
+** Load precompiled chunk. If 'fixed', the memory holding the chunk outlives
+** the state, and code, line information and (in LUAC_FIXEDFORMAT) long
+** strings are used in place instead of being copied to the heap; nested
+** functions (in LUAC_FIXEDFORMAT) are only loaded when first needed.
 */
-LClosure *luaU_undump(lua_State *L, ZIO *Z, const char *name) {
+LClosure *luaU_undump(lua_State *L, ZIO *Z, const char *name, int fixed) {
     LoadState S;
     LClosure *cl;
     if (*name == '@' || *name == '=')
@@ -276,6 +448,8 @@ LClosure *luaU_undump(lua_State *L, ZIO *Z, const char *name) {
         S.name = name;
     S.L = L;
     S.Z = Z;
+    S.fixed = fixed;
+    S.offset = 1; /* 1st char already read */
     checkHeader(&S);
     cl = luaF_newLclosure(L, loadByte(&S));
     setclLvalue2s(L, L->top, cl);
@@ -25,11 +25,21 @@
 
 #define LUAC_FORMAT 0 /* this is the official format */
 
+/*
+** Format for loading in place: like the official one, but code arrays are
+** aligned (relative to the start of the chunk), strings end with a '\0',
+** and nested functions are preceded by their size, so that they can be
+** skipped and loaded later.
+*/
+#define LUAC_FIXEDFORMAT 1
+
 /* load one chunk; from lundump.c */
-LUAI_FUNC LClosure* luaU_undump(lua_State* L, ZIO* Z, const char* name);
+LUAI_FUNC LClosure* luaU_undump(lua_State* L, ZIO* Z, const char* name,
+                                int fixed);
+LUAI_FUNC void luaU_loadlazy(lua_State* L, Proto* f);
 
 /* dump one chunk; from ldump.c */
 LUAI_FUNC int luaU_dump(lua_State* L, const Proto* f, lua_Writer w, void* data,
-                        int strip);
+                        int strip, int fixed);
 
 #endif
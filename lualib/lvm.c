@@ -41,6 +41,34 @@
 #endif
 #endif
 
+/*
+** With LUAI_OPCOUNT, count the executions of each opcode as it is
+** fetched, and with LUAI_OPCOUNT >= 2 also the executions of each
+** opcode right after another one (across calls and returns too), to
+** find candidates for superinstructions. See 'lua_opcount'.
+*/
+#if defined(LUAI_OPCOUNT)
+static size_t opcount[NUM_OPCODES];
+#if LUAI_OPCOUNT >= 2
+static size_t oppaircount[NUM_OPCODES][NUM_OPCODES];
+static int lastop = -1;
+#define countpair(o)                               \
+    {                                              \
+        if (lastop >= 0) oppaircount[lastop][o]++; \
+        lastop = (o);                              \
+    }
+#else
+#define countpair(o) ((void)0)
+#endif
+#define countop(o)    \
+    {                 \
+        opcount[o]++; \
+        countpair(o); \
+    }
+#else
+#define countop(o) ((void)0)
+#endif
+
 /* limit for table tag-method chains (to avoid infinite loops) */
 #define MAXTAGLOOP 2000
 
@@ -1128,6 +1156,7 @@ void luaV_finishOp(lua_State *L) {
             updatebase(ci);               /* correct stack */                \
         }                                                                    \
         i = *(pc++);                                                         \
+        countop(GET_OPCODE(i));                                              \
         ra = RA(i); /* WARNING: any stack reallocation invalidates 'ra' */   \
     }
 
@@ -1801,6 +1830,11 @@ returning: /* trap already set */
             }
             vmcase(OP_CLOSURE) {
                 Proto *p = cl->p->p[GETARG_Bx(i)];
+                if (l_unlikely(p->flag & (PF_LAZY | PF_UNPARSED))) {
+                    Protect(p = luaD_loadnested(L, cl->p, GETARG_Bx(i)));
+                    updatebase(ci); /* loading can reallocate the stack */
+                    ra = RA(i);
+                }
                 halfProtect(pushclosure(L, p, cl->upvals, base, ra));
                 checkGC(L, ra + 1);
                 vmbreak;
@@ -1828,3 +1862,19 @@ returning: /* trap already set */
 }
 
 /* }================================================================== */
+
+#if defined(LUAI_OPCOUNT)
+/*
+** Executions of opcode 'op', or of opcode 'next' right after 'op' if
+** 'next' is not negative (always 0 unless LUAI_OPCOUNT >= 2).
+*/
+LUA_API size_t lua_opcount(int op, int next) {
+    if (op < 0 || op >= NUM_OPCODES || next >= NUM_OPCODES) return 0;
+    if (next < 0) return opcount[op];
+#if LUAI_OPCOUNT >= 2
+    return oppaircount[op][next];
+#else
+    return 0;
+#endif
+}
+#endif
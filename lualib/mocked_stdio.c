@@ -17,6 +17,15 @@ static int s_fs_access_enabled = 0;
 void enable_fs_access(int b) { s_fs_access_enabled = b; }
 int fs_access_enabled() { return s_fs_access_enabled; }
 
+#ifdef CKB_SIMULATOR
+/* Served by lua-loader/lua-simulator.c in the native build. */
+long ckb_simulator_syscall(long n, long a0, long a1, long a2, long a3, long a4,
+                           long a5);
+
+#define ckb_syscall(n, a, b, c, d, e, f)                                 \
+    ckb_simulator_syscall(n, (long)(a), (long)(b), (long)(c), (long)(d), \
+                          (long)(e), (long)(f))
+#else
 #define memory_barrier() asm volatile("fence" ::: "memory")
 
 static inline long __internal_syscall(long n, long _a0, long _a1, long _a2,
@@ -50,6 +59,7 @@ static inline long __internal_syscall(long n, long _a0, long _a1, long _a2,
 #define ckb_syscall(n, a, b, c, d, e, f)                              \
     __internal_syscall(n, (long)(a), (long)(b), (long)(c), (long)(d), \
                        (long)(e), (long)(f))
+#endif
 
 #define NOT_IMPL(name)                                                 \
     do {                                                               \
@@ -59,6 +69,9 @@ static inline long __internal_syscall(long n, long _a0, long _a1, long _a2,
 
 FILE *allocfile() {
     FILE *file = malloc(sizeof(FILE));
+    if (file == 0) {
+        return 0;
+    }
     file->file = 0;
     file->offset = 0;
     return file;
@@ -66,6 +79,9 @@ FILE *allocfile() {
 
 void freefile(FILE *file) {
     file->file->rc -= 1;
+    if (file->file->rc == 0) {
+        free((void *)file->file);
+    }
     free((void *)file);
 }
 
@@ -126,6 +142,7 @@ FILE *fopen(const char *path, const char *mode) {
 
     int ret = ckb_get_file(path, &file->file);
     if (ret != 0) {
+        free((void *)file);
         return 0;
     }
     return file;
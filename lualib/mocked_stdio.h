@@ -7,6 +7,60 @@
 
 #include "../include/ckb_cell_fs.h"
 
+#ifdef CKB_SIMULATOR
+/*
+** The native build on top of the syscall simulator (see lua-loader-sim in the
+** Makefile) also links the C library, whose stdio the simulator reads its
+** transaction with, so the functions of mocked_stdio.c get other names there.
+*/
+#define stdin ckb_stdin
+#define stdout ckb_stdout
+#define stderr ckb_stderr
+#define remove ckb_remove
+#define rename ckb_rename
+#define tmpfile ckb_tmpfile
+#define tmpnam ckb_tmpnam
+#define tempnam ckb_tempnam
+#define fclose ckb_fclose
+#define fflush ckb_fflush
+#define fopen ckb_fopen
+#define freopen ckb_freopen
+#define setbuf ckb_setbuf
+#define setvbuf ckb_setvbuf
+#define fprintf ckb_fprintf
+#define sprintf ckb_sprintf
+#define vfprintf ckb_vfprintf
+#define vprintf ckb_vprintf
+#define vsprintf ckb_vsprintf
+#define fscanf ckb_fscanf
+#define scanf ckb_scanf
+#define sscanf ckb_sscanf
+#define fgetc ckb_fgetc
+#define getc ckb_getc
+#define getchar ckb_getchar
+#define fputc ckb_fputc
+#define putc ckb_putc
+#define putchar ckb_putchar
+#define fgets ckb_fgets
+#define gets ckb_gets
+#define getline ckb_getline
+#define fputs ckb_fputs
+#define puts ckb_puts
+#define ungetc ckb_ungetc
+#define fread ckb_fread
+#define fwrite ckb_fwrite
+#define fseek ckb_fseek
+#define ftell ckb_ftell
+#define rewind ckb_rewind
+#define clearerr ckb_clearerr
+#define feof ckb_feof
+#define ferror ckb_ferror
+#define perror ckb_perror
+#define fileno ckb_fileno
+#define popen ckb_popen
+#define pclose ckb_pclose
+#endif
+
 #define BUFSIZ 512
 #define EOF (-1)
 #define SEEK_SET 0
@@ -22,9 +76,9 @@ typedef struct FILE {
     uint32_t offset;
 } FILE;
 
-FILE *stdin;
-FILE *stdout;
-FILE *stderr;
+extern FILE *stdin;
+extern FILE *stdout;
+extern FILE *stderr;
 
 int remove(const char *__filename);
 
@@ -0,0 +1,21 @@
+#!/usr/bin/env bash
+# Run a workload of the benchmark suite with ckb-debugger, keeping its output
+# in a log file, and print "name cycles peak": the cycles it consumed and the
+# peak of its lua heap, printed by lua-loader with -m.
+#
+# Usage: bench.sh name log_file ckb-debugger-arguments...
+
+set -euo pipefail
+
+name="$1"
+log="$2"
+shift 2
+
+RUST_LOG=debug "${CKB_DEBUGGER:-ckb-debugger}" "$@" > "$log" 2>&1 || true
+if ! grep -q 'Run result: 0' "$log"; then
+  echo "$name failed, see $log" >&2
+  exit 1
+fi
+cycles="$(sed -n 's/^\(All\|Total\) cycles[a-z ]*: \([0-9]*\).*/\2/p' "$log" | head -1)"
+peak="$(sed -n 's/.*POOL used [0-9]* peak \([0-9]*\).*/\1/p' "$log" | head -1)"
+echo "$name ${cycles:?no cycles in $log} ${peak:-0}"
@@ -0,0 +1,45 @@
+#!/usr/bin/env bash
+# Compare the results of the benchmark suite with the baselines, both made of
+# "name cycles peak" lines, and fail if the cycles or the peak heap of a
+# workload grew by more than the threshold, in percent, or has no baseline.
+#
+# Usage: compare.sh baselines results threshold
+
+set -euo pipefail
+
+awk -v threshold="$3" '
+function delta(now, base) {
+  return base > 0 ? (now - base) * 100 / base : 0
+}
+FNR == NR {
+  if ($0 !~ /^#/ && NF == 3) {
+    cycles[$1] = $2
+    peak[$1] = $3
+  }
+  next
+}
+{
+  if (!($1 in cycles)) {
+    printf "%-16s cycles %12d peak %9d NO BASELINE\n", $1, $2, $3
+    missing++
+    next
+  }
+  dc = delta($2, cycles[$1])
+  dp = delta($3, peak[$1])
+  status = dc > threshold || dp > threshold ? "REGRESSION" : "ok"
+  printf "%-16s cycles %12d %+7.2f%% peak %9d %+7.2f%% %s\n", $1, $2, dc, $3, dp, status
+  if (status != "ok") {
+    failed++
+  }
+}
+END {
+  if (missing > 0) {
+    printf "%d workloads have no baseline, record them with make baselines\n", missing
+  }
+  if (failed > 0) {
+    printf "%d workloads regressed by more than %s%%\n", failed, threshold
+  }
+  if (missing > 0 || failed > 0) {
+    exit 1
+  }
+}' "$1" "$2"
@@ -0,0 +1,31 @@
+-- Module MODULE_INDEX of the require_fs workload, a copy is generated for each
+-- index by the Makefile.
+local M = {}
+
+local FIELDS = {"capacity", "lock", "type", "data", "since", "index"}
+
+function M.index() return MODULE_INDEX end
+
+function M.new(values)
+    local cell = {}
+    for i, field in ipairs(FIELDS) do cell[field] = values[i] or 0 end
+    return setmetatable(cell, {__index = M})
+end
+
+function M:total()
+    local total = 0
+    for _, field in ipairs(FIELDS) do
+        if type(self[field]) == "number" then total = total + self[field] end
+    end
+    return total
+end
+
+function M:describe()
+    local parts = {}
+    for _, field in ipairs(FIELDS) do
+        parts[#parts + 1] = field .. "=" .. tostring(self[field])
+    end
+    return table.concat(parts, ",")
+end
+
+return M
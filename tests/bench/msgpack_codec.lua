@@ -0,0 +1,25 @@
+-- Encode and decode a batch of records with the msgpack module of the tests.
+package.path = "../test_cases/?.lua;" .. package.path
+local msgpack = require("msgpack")
+
+local records = {}
+for i = 1, 64 do
+    records[i] = {
+        id = i,
+        name = "cell_" .. i,
+        capacity = i * 100000000,
+        ratio = i / 3,
+        tags = {"sudt", "lock", i % 2 == 0},
+        args = string.rep(string.char(i % 256), 32)
+    }
+end
+
+for _ = 1, 8 do
+    local bytes = assert(msgpack.encode(records))
+    local decoded = assert(msgpack.decode(bytes))
+    assert(#decoded == #records)
+    for i, record in ipairs(decoded) do
+        assert(record.id == records[i].id and record.name == records[i].name)
+        assert(record.args == records[i].args)
+    end
+end
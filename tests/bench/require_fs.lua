@@ -0,0 +1,4 @@
+-- Mount the lua file system that the Makefile puts in the data of the first
+-- output, and require its modules through its main.lua.
+assert(ckb.mount(ckb.SOURCE_OUTPUT, 0) == nil)
+require("main")
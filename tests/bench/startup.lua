@@ -0,0 +1 @@
+-- Startup of an empty script: only the loader and the standard libraries run.
@@ -0,0 +1,17 @@
+-- Hash the first witness piece by piece with 32-bit FNV-1a in pure lua, as a
+-- lock checking a message over a large witness would.
+local PIECE_SIZE = 4096
+
+local length, err = ckb.load_witness(0, ckb.SOURCE_INPUT, 0)
+assert(not err and length > 0)
+local hash = 0x811c9dc5
+for offset = 0, length - 1, PIECE_SIZE do
+    local piece, err = ckb.load_witness(0, ckb.SOURCE_INPUT,
+                                        math.min(PIECE_SIZE, length - offset),
+                                        offset)
+    assert(not err)
+    for i = 1, #piece do
+        hash = ((hash ~ piece:byte(i)) * 0x01000193) & 0xffffffff
+    end
+end
+print(string.format("witness length %d hash %08x", length, hash))
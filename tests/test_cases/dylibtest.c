@@ -28,6 +28,11 @@ enum ErrorCode {
 
 uint8_t code_buff[MAX_CODE_SIZE] __attribute__((aligned(RISCV_PGSIZE)));
 
+// Optional script args after the shared library, selecting a benchmark to run
+// instead of the tests: <benchmark, 1 byte> <iterations, 1 byte>.
+#define BENCHMARK_ARGS_SIZE 2
+uint8_t benchmark_args[BENCHMARK_ARGS_SIZE];
+
 int get_dylib_handle(void** handle) {
     unsigned char script[MAX_SCRIPT_SIZE];
     uint64_t len = MAX_SCRIPT_SIZE;
@@ -51,7 +56,7 @@ int get_dylib_handle(void** handle) {
 
     // The script arguments are in the following format
     // <reserved args, 2 bytes> <code hash of the share library, 32 bytes>
-    // <hash type of shared library, 1 byte>
+    // <hash type of shared library, 1 byte> [<benchmark args, 2 bytes>]
     mol_seg_t args_seg = MolReader_Script_get_args(&script_seg);
     mol_seg_t args_bytes_seg = MolReader_Bytes_raw_bytes(&args_seg);
 
@@ -63,6 +68,13 @@ int get_dylib_handle(void** handle) {
     uint8_t* code_hash = args_bytes_seg.ptr + RESERVED_ARGS_SIZE;
     uint8_t hash_type =
         *(args_bytes_seg.ptr + RESERVED_ARGS_SIZE + BLAKE2B_BLOCK_SIZE);
+    if (args_bytes_seg.size >= RESERVED_ARGS_SIZE + BLAKE2B_BLOCK_SIZE +
+                                   HASH_TYPE_SIZE + BENCHMARK_ARGS_SIZE) {
+        memcpy(benchmark_args,
+               args_bytes_seg.ptr + RESERVED_ARGS_SIZE + BLAKE2B_BLOCK_SIZE +
+                   HASH_TYPE_SIZE,
+               BENCHMARK_ARGS_SIZE);
+    }
 
     size_t code_buff_size = MAX_CODE_SIZE;
     size_t consumed_size = 0;
@@ -105,6 +117,35 @@ typedef int (*EvaluateLuaCodeFuncType)(void* l, const char* code,
                                        size_t code_size, char* name);
 typedef void (*CloseLuaInstanceFuncType)(void* l);
 typedef void (*ToggleExitFuncType)(void* l, int enabled);
+typedef int (*BuildImageFuncType)(void* scratch, size_t scratch_size,
+                                  void* image, size_t* image_size);
+typedef void* (*CreateLuaInstanceFromImageFuncType)(uintptr_t min,
+                                                    uintptr_t max,
+                                                    const void* image,
+                                                    size_t image_size);
+typedef int (*FindFunctionFuncType)(void* l, const char* name);
+typedef int (*PushBytesArgFuncType)(void* l, const void* data, size_t size);
+typedef int (*PushIntegerArgFuncType)(void* l, int64_t value);
+typedef int (*PushHostBufferFuncType)(void* l, const char* name, void* ptr,
+                                      size_t len, int readonly);
+typedef int (*RegisterHostFunctionFuncType)(void* l, const char* module,
+                                            const char* name, void* fn);
+typedef int (*MountFsBufferFuncType)(void* l, const void* ptr, size_t len);
+typedef int (*UnmountFsBufferFuncType)(void* l, const void* ptr);
+typedef int (*CallFunctionFuncType)(void* l, int nresults);
+typedef int (*GetBytesResultFuncType)(void* l, int index, void* buf,
+                                      size_t* size);
+typedef int (*GetIntegerResultFuncType)(void* l, int index, int64_t* value);
+typedef int (*CompileCodeFuncType)(void* l, const char* code, size_t code_size,
+                                   char* name);
+typedef int (*RunCompiledFuncType)(void* l, int handle, int nargs,
+                                   int nresults);
+typedef void (*FreeCompiledFuncType)(void* l, int handle);
+typedef void (*GetInstanceMemoryUsageFuncType)(void* l, size_t* used,
+                                               size_t* peak, size_t* limit);
+typedef int (*SetInstanceMemoryLimitFuncType)(void* l, size_t limit);
+typedef int (*CheckpointInstanceFuncType)(void* l);
+typedef int (*ResetInstanceFuncType)(void* l);
 
 void run_lua_test_code(void* handle, int n) {
     CreateLuaInstanceFuncType create_func =
@@ -212,6 +253,620 @@ void test_exit_script(void* handle) {
     close_func(l);
 }
 
+void test_image(void* handle) {
+    BuildImageFuncType build_image_func =
+        must_load_function(handle, "lua_build_image");
+    CreateLuaInstanceFromImageFuncType create_from_image_func =
+        must_load_function(handle, "lua_create_instance_from_image");
+    EvaluateLuaCodeFuncType evaluate_func =
+        must_load_function(handle, "lua_run_code");
+    CloseLuaInstanceFuncType close_func =
+        must_load_function(handle, "lua_close_instance");
+
+    printf("Running test %s\n", __func__);
+
+    const size_t mem_size = 1024 * 512;
+    uint8_t mem[mem_size];
+    static uint8_t image[1024 * 64];
+    size_t image_size = sizeof(image);
+
+    // The instance memory is free before creating the instance, use it as
+    // scratch memory to build the image.
+    int ret = build_image_func(mem, mem_size, image, &image_size);
+    if (ret != 0) {
+        printf("building image failed: %d\n", ret);
+        ckb_exit(-1);
+    }
+    printf("image size %zu\n", image_size);
+
+    size_t i = 0;
+    do {
+        void* l = create_from_image_func(
+            (uintptr_t)mem, (uintptr_t)(mem + mem_size), image, image_size);
+        if (l == NULL) {
+            printf("creating lua instance from image failed\n");
+            ckb_exit(-1);
+        }
+        const char* code =
+            "assert(ckb.SOURCE_INPUT ~= nil)\n"
+            "assert(string.format('%d', 42) == '42')\n"
+            "local t = {}\n"
+            "for i = 1, 1000 do t[i] = tostring(i) end\n"
+            "collectgarbage()\n"
+            "assert(table.concat(t):len() == 2893)";
+        size_t code_size = strlen(code);
+        ret = evaluate_func(l, code, code_size, "image test");
+        if (ret != 0) {
+            printf("evaluating lua code failed: %d\n", ret);
+            ckb_exit(-1);
+        }
+        close_func(l);
+        i++;
+    } while (i < 10);
+}
+
+void test_call_function(void* handle) {
+    CreateLuaInstanceFuncType create_func =
+        must_load_function(handle, "lua_create_instance");
+    EvaluateLuaCodeFuncType evaluate_func =
+        must_load_function(handle, "lua_run_code");
+    CloseLuaInstanceFuncType close_func =
+        must_load_function(handle, "lua_close_instance");
+    FindFunctionFuncType find_func =
+        must_load_function(handle, "lua_find_function");
+    PushBytesArgFuncType push_bytes_func =
+        must_load_function(handle, "lua_push_bytes_arg");
+    PushIntegerArgFuncType push_integer_func =
+        must_load_function(handle, "lua_push_integer_arg");
+    CallFunctionFuncType call_func =
+        must_load_function(handle, "lua_call_function");
+    GetBytesResultFuncType get_bytes_func =
+        must_load_function(handle, "lua_get_bytes_result");
+    GetIntegerResultFuncType get_integer_func =
+        must_load_function(handle, "lua_get_integer_result");
+
+    printf("Running test %s\n", __func__);
+
+    const size_t mem_size = 1024 * 512;
+    uint8_t mem[mem_size];
+
+    void* l = create_func((uintptr_t)mem, (uintptr_t)(mem + mem_size));
+    if (l == NULL) {
+        printf("creating lua instance failed\n");
+        ckb_exit(-1);
+    }
+    const char* code =
+        "function repeat_bytes(s, n) return s:rep(n), #s * n end\n"
+        "package.loaded.codec = {\n"
+        "  le = {\n"
+        "    u32 = function(s) return string.unpack('<I4', s) end\n"
+        "  },\n"
+        "  fail = function() error('failed') end,\n"
+        "  exit = function(code) ckb.exit_script(code) end\n"
+        "}";
+    int ret = evaluate_func(l, code, strlen(code), "call function test");
+    if (ret != 0) {
+        printf("evaluating lua code failed: %d\n", ret);
+        ckb_exit(-1);
+    }
+
+    // A global function, with a binary string argument.
+    const uint8_t bytes[] = {0xab, 0x00, 0xcd};
+    char buf[16];
+    size_t size = sizeof(buf);
+    int64_t value = 0;
+    if (find_func(l, "repeat_bytes") != 0 ||
+        push_bytes_func(l, bytes, sizeof(bytes)) != 0 ||
+        push_integer_func(l, 3) != 0 || call_func(l, 2) != 0 ||
+        get_bytes_func(l, 1, buf, &size) != 0 ||
+        get_integer_func(l, 2, &value) != 0) {
+        printf("calling repeat_bytes failed\n");
+        ckb_exit(-1);
+    }
+    if (size != 9 || value != 9 || memcmp(buf + 3, bytes, sizeof(bytes))) {
+        printf("unexpected results from repeat_bytes\n");
+        ckb_exit(-1);
+    }
+    // Results are truncated to the buffer size, but the full size is returned.
+    size = 4;
+    if (get_bytes_func(l, 1, buf, &size) != 0 || size != 9) {
+        printf("getting truncated result failed\n");
+        ckb_exit(-1);
+    }
+    // Results of the wrong type are refused.
+    if (get_integer_func(l, 1, &value) >= 0 ||
+        get_bytes_func(l, 3, buf, &size) >= 0) {
+        printf("getting results of wrong type should fail\n");
+        ckb_exit(-1);
+    }
+
+    // Functions in a module, called many times without reparsing anything.
+    const uint8_t le[] = {0x78, 0x56, 0x34, 0x12};
+    for (int i = 0; i < 100; i++) {
+        if (find_func(l, "codec.le.u32") != 0 ||
+            push_bytes_func(l, le, sizeof(le)) != 0 || call_func(l, 1) != 0 ||
+            get_integer_func(l, 1, &value) != 0 || value != 0x12345678) {
+            printf("calling codec.le.u32 failed\n");
+            ckb_exit(-1);
+        }
+    }
+
+    if (find_func(l, "codec.missing") >= 0 ||
+        find_func(l, "repeat_bytes.x") >= 0 || find_func(l, "nothing") >= 0) {
+        printf("finding missing functions should fail\n");
+        ckb_exit(-1);
+    }
+    if (find_func(l, "codec.fail") != 0 || call_func(l, 0) >= 0) {
+        printf("calling codec.fail should fail\n");
+        ckb_exit(-1);
+    }
+    if (find_func(l, "codec.exit") != 0 || push_integer_func(l, 42) != 0 ||
+        call_func(l, 0) != 42) {
+        printf("calling codec.exit should return 42\n");
+        ckb_exit(-1);
+    }
+    close_func(l);
+}
+
+void test_host_buffer(void* handle) {
+    CreateLuaInstanceFuncType create_func =
+        must_load_function(handle, "lua_create_instance");
+    EvaluateLuaCodeFuncType evaluate_func =
+        must_load_function(handle, "lua_run_code");
+    CloseLuaInstanceFuncType close_func =
+        must_load_function(handle, "lua_close_instance");
+    PushHostBufferFuncType push_host_buffer_func =
+        must_load_function(handle, "lua_push_host_buffer");
+    FindFunctionFuncType find_func =
+        must_load_function(handle, "lua_find_function");
+    PushBytesArgFuncType push_bytes_func =
+        must_load_function(handle, "lua_push_bytes_arg");
+    CallFunctionFuncType call_func =
+        must_load_function(handle, "lua_call_function");
+
+    printf("Running test %s\n", __func__);
+
+    const size_t mem_size = 1024 * 512;
+    uint8_t mem[mem_size];
+
+    void* l = create_func((uintptr_t)mem, (uintptr_t)(mem + mem_size));
+    if (l == NULL) {
+        printf("creating lua instance failed\n");
+        ckb_exit(-1);
+    }
+    uint8_t witness[] = {0x78, 0x56, 0x34, 0x12, 0xff, 0xff,
+                         0xff, 0xff, 0x80, 0x01, 0x02, 0x03};
+    if (push_host_buffer_func(l, "witness", witness, sizeof(witness), 1) !=
+        0) {
+        printf("pushing host buffer failed\n");
+        ckb_exit(-1);
+    }
+    const char* code =
+        "assert(#witness == 12 and witness[1] == 0x78)\n"
+        "assert(witness:u32(1) == 0x12345678 and witness:u16(3) == 0x1234)\n"
+        "assert(witness:i32(5) == -1 and witness:u32(5) == 0xffffffff)\n"
+        "assert(witness:i8(9) == -128 and witness:u64(5) == "
+        "0x03020180ffffffff)\n"
+        "assert(witness:sub(-3) == '\\1\\2\\3' and witness[13] == nil)\n"
+        "assert(not pcall(witness.u32, witness, 10))\n"
+        "assert(not pcall(witness.write, witness, 1, 'a'))\n"
+        "function fill(out, s) out:write(1, s); out[#s + 1] = 0 end";
+    int ret = evaluate_func(l, code, strlen(code), "host buffer test");
+    if (ret != 0) {
+        printf("evaluating lua code failed: %d\n", ret);
+        ckb_exit(-1);
+    }
+    // Lua writes to the host memory in place.
+    char out[8] = {0};
+    if (find_func(l, "fill") != 0 ||
+        push_host_buffer_func(l, NULL, out, sizeof(out), 0) != 0 ||
+        push_bytes_func(l, "hello", 5) != 0 || call_func(l, 0) != 0 ||
+        strcmp(out, "hello") != 0) {
+        printf("writing to host buffer failed\n");
+        ckb_exit(-1);
+    }
+    close_func(l);
+}
+
+// A host function xoring its arguments, all of the size of the first one.
+int host_xor(int nargs, const void* const* args, const size_t* arg_sizes,
+             void* result, size_t* result_size) {
+    if (nargs == 0 || arg_sizes[0] > *result_size) {
+        return 1;
+    }
+    memcpy(result, args[0], arg_sizes[0]);
+    for (int i = 1; i < nargs; i++) {
+        if (arg_sizes[i] != arg_sizes[0]) {
+            return 2;
+        }
+        for (size_t j = 0; j < arg_sizes[i]; j++) {
+            ((uint8_t*)result)[j] ^= ((const uint8_t*)args[i])[j];
+        }
+    }
+    *result_size = arg_sizes[0];
+    return 0;
+}
+
+void test_host_function(void* handle) {
+    CreateLuaInstanceFuncType create_func =
+        must_load_function(handle, "lua_create_instance");
+    EvaluateLuaCodeFuncType evaluate_func =
+        must_load_function(handle, "lua_run_code");
+    CloseLuaInstanceFuncType close_func =
+        must_load_function(handle, "lua_close_instance");
+    RegisterHostFunctionFuncType register_func =
+        must_load_function(handle, "lua_register_host_function");
+    PushHostBufferFuncType push_host_buffer_func =
+        must_load_function(handle, "lua_push_host_buffer");
+
+    printf("Running test %s\n", __func__);
+
+    const size_t mem_size = 1024 * 512;
+    uint8_t mem[mem_size];
+
+    void* l = create_func((uintptr_t)mem, (uintptr_t)(mem + mem_size));
+    if (l == NULL) {
+        printf("creating lua instance failed\n");
+        ckb_exit(-1);
+    }
+    uint8_t key[] = {0xff, 0x0f};
+    if (register_func(l, NULL, "xor", host_xor) != 0 ||
+        register_func(l, "crypto", "xor", host_xor) != 0 ||
+        register_func(l, "ckb", "xor", host_xor) != 0 ||
+        push_host_buffer_func(l, "key", key, sizeof(key), 1) != 0) {
+        printf("registering host functions failed\n");
+        ckb_exit(-1);
+    }
+    const char* code =
+        "assert(xor('\\1\\2', '\\3\\4') == '\\2\\6')\n"
+        "assert(crypto.xor(key, '\\15\\15') == '\\240\\0')\n"
+        "assert(require('crypto') == crypto and ckb.xor(1) == "
+        "'\\1\\0\\0\\0\\0\\0\\0\\0')\n"
+        "local result, err = xor('a', 'bc')\n"
+        "assert(result == nil and err == 2)\n"
+        "assert(not pcall(xor, {}))";
+    int ret = evaluate_func(l, code, strlen(code), "host function test");
+    if (ret != 0) {
+        printf("evaluating lua code failed: %d\n", ret);
+        ckb_exit(-1);
+    }
+    close_func(l);
+}
+
+void test_compile_code(void* handle) {
+    CreateLuaInstanceFuncType create_func =
+        must_load_function(handle, "lua_create_instance");
+    CloseLuaInstanceFuncType close_func =
+        must_load_function(handle, "lua_close_instance");
+    CompileCodeFuncType compile_func =
+        must_load_function(handle, "lua_compile_code");
+    RunCompiledFuncType run_compiled_func =
+        must_load_function(handle, "lua_run_compiled");
+    FreeCompiledFuncType free_compiled_func =
+        must_load_function(handle, "lua_free_compiled");
+    PushBytesArgFuncType push_bytes_func =
+        must_load_function(handle, "lua_push_bytes_arg");
+    PushIntegerArgFuncType push_integer_func =
+        must_load_function(handle, "lua_push_integer_arg");
+    GetIntegerResultFuncType get_integer_func =
+        must_load_function(handle, "lua_get_integer_result");
+
+    printf("Running test %s\n", __func__);
+
+    const size_t mem_size = 1024 * 512;
+    uint8_t mem[mem_size];
+
+    void* l = create_func((uintptr_t)mem, (uintptr_t)(mem + mem_size));
+    if (l == NULL) {
+        printf("creating lua instance failed\n");
+        ckb_exit(-1);
+    }
+    const char* code =
+        "local data, min = ...\n"
+        "local n = 0\n"
+        "for i = 1, #data do n = n + data:byte(i) end\n"
+        "if n < min then ckb.exit_script(1) end\n"
+        "return n";
+    int compiled = compile_func(l, code, strlen(code), "compile test");
+    if (compiled <= 0) {
+        printf("compiling lua code failed: %d\n", compiled);
+        ckb_exit(-1);
+    }
+    for (int i = 0; i < 100; i++) {
+        uint8_t data[] = {1, 2, (uint8_t)i};
+        int64_t value = 0;
+        if (push_bytes_func(l, data, sizeof(data)) != 0 ||
+            push_integer_func(l, 0) != 0 ||
+            run_compiled_func(l, compiled, 2, 1) != 0 ||
+            get_integer_func(l, 1, &value) != 0 || value != 3 + i) {
+            printf("running compiled code failed\n");
+            ckb_exit(-1);
+        }
+    }
+    if (push_bytes_func(l, "", 0) != 0 || push_integer_func(l, 1) != 0 ||
+        run_compiled_func(l, compiled, 2, 1) != 1) {
+        printf("running compiled code should return 1\n");
+        ckb_exit(-1);
+    }
+    if (compile_func(l, "invalid lua code here", 21, "invalid") >= 0) {
+        printf("compiling invalid lua code should fail\n");
+        ckb_exit(-1);
+    }
+    // Handles that lua_compile_code did not return, such as the references
+    // of the registry, are not released.
+    for (int other = -1; other < compiled + 8; other++) {
+        if (other != compiled) {
+            free_compiled_func(l, other);
+        }
+    }
+    if (push_bytes_func(l, "", 0) != 0 || push_integer_func(l, 0) != 0 ||
+        run_compiled_func(l, compiled, 2, 1) != 0) {
+        printf("freeing other handles released compiled code\n");
+        ckb_exit(-1);
+    }
+    free_compiled_func(l, compiled);
+    if (run_compiled_func(l, compiled, 0, 0) >= 0) {
+        printf("running freed code should fail\n");
+        ckb_exit(-1);
+    }
+    close_func(l);
+}
+
+// A rule checking every input of a group, as run by a script for each input.
+static const char* benchmark_code =
+    "local data = string.rep('\\x2a', 64)\n"
+    "local sum, xor = 0, 0\n"
+    "for i = 1, #data, 4 do\n"
+    "  local v = string.unpack('<I4', data, i)\n"
+    "  sum = (sum + v) & 0xffffffff\n"
+    "  xor = xor ~ v\n"
+    "end\n"
+    "local function check(cond, msg)\n"
+    "  if not cond then error(msg) end\n"
+    "end\n"
+    "check(#data % 4 == 0, 'data length')\n"
+    "check(sum ~= 0, 'sum')\n"
+    "check(xor == 0, 'xor')\n"
+    "local fields = {}\n"
+    "for k, v in pairs({capacity = 100, lock = 'a', type = 'b'}) do\n"
+    "  fields[#fields + 1] = k .. '=' .. tostring(v)\n"
+    "end\n"
+    "table.sort(fields)\n"
+    "check(table.concat(fields, ',') == 'capacity=100,lock=a,type=b', "
+    "'fields')\n"
+    "return sum\n";
+
+// Run benchmark_code `iterations` times, either with lua_run_code (benchmark
+// 1) or compiled once with lua_compile_code and run with lua_run_compiled
+// (benchmark 2). The cycles of the script are compared by the rust tests.
+void run_benchmark(void* handle, int benchmark, int iterations) {
+    CreateLuaInstanceFuncType create_func =
+        must_load_function(handle, "lua_create_instance");
+    EvaluateLuaCodeFuncType evaluate_func =
+        must_load_function(handle, "lua_run_code");
+    CompileCodeFuncType compile_func =
+        must_load_function(handle, "lua_compile_code");
+    RunCompiledFuncType run_compiled_func =
+        must_load_function(handle, "lua_run_compiled");
+
+    printf("Running benchmark %d for %d iterations\n", benchmark, iterations);
+
+    const size_t mem_size = 1024 * 512;
+    uint8_t mem[mem_size];
+
+    void* l = create_func((uintptr_t)mem, (uintptr_t)(mem + mem_size));
+    if (l == NULL) {
+        printf("creating lua instance failed\n");
+        ckb_exit(-1);
+    }
+    size_t code_size = strlen(benchmark_code);
+    int compiled = 0;
+    if (benchmark == 2) {
+        compiled = compile_func(l, benchmark_code, code_size, "benchmark");
+        if (compiled <= 0) {
+            ckb_exit(-1);
+        }
+    }
+    for (int i = 0; i < iterations; i++) {
+        int ret;
+        if (benchmark == 2) {
+            ret = run_compiled_func(l, compiled, 0, 0);
+        } else {
+            ret = evaluate_func(l, benchmark_code, code_size, "benchmark");
+        }
+        if (ret != 0) {
+            printf("running benchmark failed: %d\n", ret);
+            ckb_exit(-1);
+        }
+    }
+    ckb_exit(0);
+}
+
+void test_instances(void* handle) {
+    CreateLuaInstanceFuncType create_func =
+        must_load_function(handle, "lua_create_instance");
+    EvaluateLuaCodeFuncType evaluate_func =
+        must_load_function(handle, "lua_run_code");
+    CloseLuaInstanceFuncType close_func =
+        must_load_function(handle, "lua_close_instance");
+    GetInstanceMemoryUsageFuncType get_usage_func =
+        must_load_function(handle, "lua_get_instance_memory_usage");
+    SetInstanceMemoryLimitFuncType set_limit_func =
+        must_load_function(handle, "lua_set_instance_memory_limit");
+
+    printf("Running test %s\n", __func__);
+
+    const size_t mem_size = 1024 * 256;
+    uint8_t mem1[mem_size];
+    uint8_t mem2[mem_size];
+
+    void* l1 = create_func((uintptr_t)mem1, (uintptr_t)(mem1 + mem_size));
+    void* l2 = create_func((uintptr_t)mem2, (uintptr_t)(mem2 + mem_size));
+    if (l1 == NULL || l2 == NULL) {
+        printf("creating lua instances failed\n");
+        ckb_exit(-1);
+    }
+
+    // Instances run alternately, each with its own globals and heap.
+    const char* set_code = "x = string.rep('a', 1000)";
+    const char* check_code = "assert(x == nil)";
+    const char* check_code2 = "assert(#x == 1000)";
+    if (evaluate_func(l1, set_code, strlen(set_code), "set") != 0 ||
+        evaluate_func(l2, check_code, strlen(check_code), "check") != 0 ||
+        evaluate_func(l1, check_code2, strlen(check_code2), "check") != 0) {
+        printf("lua instances are not isolated\n");
+        ckb_exit(-1);
+    }
+
+    size_t used, peak, limit;
+    get_usage_func(l1, &used, &peak, &limit);
+    if (used == 0 || peak < used || limit < used) {
+        printf("getting memory usage failed\n");
+        ckb_exit(-1);
+    }
+    printf("instance memory: used %zu, peak %zu, limit %zu\n", used, peak,
+           limit);
+
+    if (set_limit_func(l2, mem_size * 2) == 0) {
+        printf("memory limit larger than the instance should be refused\n");
+        ckb_exit(-1);
+    }
+    get_usage_func(l2, &used, &peak, &limit);
+    if (set_limit_func(l2, used + 4096) != 0) {
+        printf("setting memory limit failed\n");
+        ckb_exit(-1);
+    }
+    const char* big_code = "y = string.rep('b', 16384)";
+    if (evaluate_func(l2, big_code, strlen(big_code), "big") >= 0) {
+        printf("allocation over the memory limit should fail\n");
+        ckb_exit(-1);
+    }
+    if (set_limit_func(l2, limit) != 0 ||
+        evaluate_func(l2, big_code, strlen(big_code), "big") != 0) {
+        printf("allocation after raising the memory limit failed\n");
+        ckb_exit(-1);
+    }
+
+    close_func(l1);
+    close_func(l2);
+}
+
+void test_reset_instance(void* handle) {
+    CreateLuaInstanceFuncType create_func =
+        must_load_function(handle, "lua_create_instance");
+    EvaluateLuaCodeFuncType evaluate_func =
+        must_load_function(handle, "lua_run_code");
+    CloseLuaInstanceFuncType close_func =
+        must_load_function(handle, "lua_close_instance");
+    CheckpointInstanceFuncType checkpoint_func =
+        must_load_function(handle, "lua_checkpoint_instance");
+    ResetInstanceFuncType reset_func =
+        must_load_function(handle, "lua_reset_instance");
+
+    printf("Running test %s\n", __func__);
+
+    const size_t mem_size = 1024 * 512;
+    uint8_t mem[mem_size];
+
+    void* l = create_func((uintptr_t)mem, (uintptr_t)(mem + mem_size));
+    if (l == NULL) {
+        printf("creating lua instance failed\n");
+        ckb_exit(-1);
+    }
+    if (reset_func(l) >= 0) {
+        printf("resetting an instance without checkpoint should fail\n");
+        ckb_exit(-1);
+    }
+    if (checkpoint_func(l) != 0) {
+        printf("checkpointing lua instance failed\n");
+        ckb_exit(-1);
+    }
+    // Every snippet starts from the state right after initialization, even
+    // if the previous one changed globals and standard modules.
+    const char* code =
+        "assert(x == nil and string.upper ~= nil)\n"
+        "x = {} for i = 1, 1000 do x[i] = tostring(i) end\n"
+        "string.upper = nil ckb = nil";
+    for (int i = 0; i < 10; i++) {
+        int ret = evaluate_func(l, code, strlen(code), "snippet");
+        if (ret != 0) {
+            printf("evaluating lua code failed: %d\n", ret);
+            ckb_exit(-1);
+        }
+        if (reset_func(l) != 0) {
+            printf("resetting lua instance failed\n");
+            ckb_exit(-1);
+        }
+    }
+    close_func(l);
+}
+
+// Pack a Simple Lua File System with one file (see docs/fs.md) into `buf`.
+static size_t pack_fs(uint8_t* buf, const char* name, const char* content) {
+    uint32_t name_size = strlen(name) + 1;
+    uint32_t content_size = strlen(content);
+    uint32_t header[5] = {1, 0, name_size, name_size, content_size};
+    memcpy(buf, header, sizeof(header));
+    memcpy(buf + sizeof(header), name, name_size);
+    memcpy(buf + sizeof(header) + name_size, content, content_size);
+    return sizeof(header) + name_size + content_size;
+}
+
+void test_mount_fs_buffer(void* handle) {
+    CreateLuaInstanceFuncType create_func =
+        must_load_function(handle, "lua_create_instance");
+    EvaluateLuaCodeFuncType evaluate_func =
+        must_load_function(handle, "lua_run_code");
+    CloseLuaInstanceFuncType close_func =
+        must_load_function(handle, "lua_close_instance");
+    MountFsBufferFuncType mount_func =
+        must_load_function(handle, "lua_mount_fs_buffer");
+    UnmountFsBufferFuncType unmount_func =
+        must_load_function(handle, "lua_unmount_fs_buffer");
+
+    printf("Running test %s\n", __func__);
+
+    const size_t mem_size = 1024 * 512;
+    uint8_t mem[mem_size];
+
+    void* l = create_func((uintptr_t)mem, (uintptr_t)(mem + mem_size));
+    if (l == NULL) {
+        printf("creating lua instance failed\n");
+        ckb_exit(-1);
+    }
+
+    uint8_t fs[256];
+    size_t fs_size = pack_fs(fs, "mymodule.lua",
+                             "return { magic = function() return 42 end }");
+    if (mount_func(l, fs, fs_size - 1) >= 0) {
+        printf("mounting a truncated file system should fail\n");
+        ckb_exit(-1);
+    }
+    if (mount_func(l, fs, fs_size) != 0) {
+        printf("mounting file system failed\n");
+        ckb_exit(-1);
+    }
+    const char* code = "assert(require('mymodule').magic() == 42)";
+    int ret = evaluate_func(l, code, strlen(code), "mounted");
+    if (ret != 0) {
+        printf("requiring module from mounted file system failed: %d\n", ret);
+        ckb_exit(-1);
+    }
+    if (unmount_func(l, fs) != 0 || unmount_func(l, fs) >= 0) {
+        printf("unmounting file system failed\n");
+        ckb_exit(-1);
+    }
+    code =
+        "package.loaded.mymodule = nil\n"
+        "assert(not pcall(require, 'mymodule'))";
+    ret = evaluate_func(l, code, strlen(code), "unmounted");
+    if (ret != 0) {
+        printf("module still found after unmounting: %d\n", ret);
+        ckb_exit(-1);
+    }
+    close_func(l);
+}
+
 void test_exit(void* handle) {
     CreateLuaInstanceFuncType create_func =
         must_load_function(handle, "lua_create_instance");
@@ -258,6 +913,10 @@ int main(int argc, char* argv[]) {
     void* handle;
     must_get_dylib_handle(&handle);
 
+    if (benchmark_args[0] != 0) {
+        run_benchmark(handle, benchmark_args[0], benchmark_args[1]);
+    }
+
     // Ensure no memory leak.
     int n = 100;
     run_lua_test_code(handle, n);
@@ -266,6 +925,22 @@ int main(int argc, char* argv[]) {
 
     test_exit_script(handle);
 
+    test_image(handle);
+
+    test_call_function(handle);
+
+    test_compile_code(handle);
+
+    test_host_buffer(handle);
+
+    test_host_function(handle);
+
+    test_instances(handle);
+
+    test_reset_instance(handle);
+
+    test_mount_fs_buffer(handle);
+
     // Must be the last test to run, as it will stop the execution.
     test_exit(handle);
 }
@@ -0,0 +1,6 @@
+-- Closing the last handle of a file of the file system must free the file:
+-- the heap runs out long before the end of the loop if it does not.
+assert(ckb.mount(2, 0) == nil)
+for _ = 1, 300000 do
+    assert(io.open("mymodule.lua")):close()
+end
@@ -0,0 +1,8 @@
+-- Opening a file that is not in the file system must not leak its handle:
+-- the heap runs out long before the end of the loop if it does, and fopen
+-- then fails for the files that are there too.
+assert(ckb.mount(2, 0) == nil)
+for _ = 1, 300000 do
+    assert(io.open("missing.lua") == nil)
+end
+assert(io.open("mymodule.lua")):close()
@@ -0,0 +1,24 @@
+big = {}
+for i = 1, 1000 do
+  big[i] = tostring(i)
+end
+
+local snapshot = ckb.heap_snapshot()
+local tables, total = snapshot:match("type table (%d+) %d+\n.*total %d+ (%d+)\n")
+if not tables or tonumber(tables) < 1 or tonumber(total) <= 0 then
+  print("unexpected heap snapshot:\n" .. snapshot)
+  ckb.exit(1)
+end
+
+-- big is the largest root, and retains at least its strings
+local root, bytes = snapshot:match("root (%S+) (%d+)\n")
+if root ~= "_G.big" or tonumber(bytes) < 1000 * 16 then
+  print("unexpected largest root:\n" .. snapshot)
+  ckb.exit(1)
+end
+
+big = nil
+if ckb.heap_snapshot():find("root _G.big ") then
+  print("collected global still retained")
+  ckb.exit(1)
+end
@@ -0,0 +1,21 @@
+local limit = ckb.get_memory_limit()
+if limit <= 0 or limit % (512 * 1024) ~= 0 then
+  print("unexpected memory limit " .. limit)
+  ckb.exit(1)
+end
+
+local used, peak, size = ckb.get_heap_usage()
+if used <= 0 or peak < used or size < used or size >= limit then
+  print("unexpected heap usage " .. used .. " " .. peak .. " " .. size)
+  ckb.exit(1)
+end
+
+local t = {}
+for i = 1, 10000 do
+  t[i] = tostring(i)
+end
+local used2, peak2 = ckb.get_heap_usage()
+if used2 <= used or peak2 < used2 then
+  print("heap usage did not grow: " .. used2 .. " " .. peak2)
+  ckb.exit(1)
+end
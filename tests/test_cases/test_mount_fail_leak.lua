@@ -0,0 +1,9 @@
+-- Mounting a cell that is not a file system must not keep its data: the heap
+-- runs out long before the end of the loop if it does, and mounting the file
+-- system in the output cell then fails too.
+local err = ckb.mount(1, 0)
+assert(err ~= nil)
+for _ = 1, 300000 do
+    assert(ckb.mount(1, 0) == err)
+end
+assert(ckb.mount(2, 0) == nil)
@@ -0,0 +1,36 @@
+-- Timers and counters of ckb.perf: they measure cycles with the perf variant
+-- of lua-loader, and do nothing with the others.
+local start = ckb.current_cycles()
+if start <= 0 then
+  print("unexpected cycles " .. start)
+  ckb.exit(1)
+end
+
+local t = {}
+for i = 1, 100 do
+  ckb.perf.begin("fill")
+  ckb.perf.begin("fill")
+  t[i] = tostring(i)
+  if ckb.perf.finish("fill") ~= 0 then
+    print("nested timer measured cycles")
+    ckb.exit(1)
+  end
+  ckb.perf.finish("fill")
+  ckb.perf.count("items")
+end
+ckb.perf.count("items", 100)
+
+if ckb.current_cycles() <= start then
+  print("cycles did not grow")
+  ckb.exit(1)
+end
+
+-- Only the perf variant raises errors, on timers not started and names of
+-- more than 31 bytes.
+if not pcall(ckb.perf.finish, "none") then
+  ckb.perf.count(string.rep("x", 31))
+  if pcall(ckb.perf.count, string.rep("x", 32)) then
+    print("perf name too long")
+    ckb.exit(1)
+  end
+end
@@ -28,7 +28,7 @@ fn debug_printer(script: &Byte32, msg: &str) {
     println!("{:?}: {}", str, msg);
 }
 
-fn gen_tx(dummy: &mut DummyDataLoader) -> TransactionView {
+fn gen_tx(dummy: &mut DummyDataLoader, extra_args: &[u8]) -> TransactionView {
     let mut rng = <StdRng as SeedableRng>::from_seed([42u8; 32]);
 
     // setup lib_ckb_lua dep
@@ -104,10 +104,13 @@ fn gen_tx(dummy: &mut DummyDataLoader) -> TransactionView {
     };
     let out_point = OutPoint::new(previous_tx_hash, 0);
 
-    let mut buf = BytesMut::with_capacity(2 + lib_ckb_lua_cell_data_hash.as_slice().len() + 1);
+    let mut buf = BytesMut::with_capacity(
+        2 + lib_ckb_lua_cell_data_hash.as_slice().len() + 1 + extra_args.len(),
+    );
     buf.extend_from_slice(&[0x00u8; 2]);
     buf.extend_from_slice(lib_ckb_lua_cell_data_hash.as_slice());
     buf.put_u8(ScriptHashType::Data1.into());
+    buf.extend_from_slice(extra_args);
     let args = buf.freeze();
 
     let script = Script::new_builder()
@@ -185,10 +188,11 @@ fn build_resolved_tx(data_loader: &DummyDataLoader, tx: &TransactionView) -> Res
     }
 }
 
-#[test]
-fn run_dylib_tests() {
+// Runs dylibtest with `extra_args` appended to its script args, and returns
+// the cycles used.
+fn run_dylibtest(extra_args: &[u8]) -> u64 {
     let mut data_loader = DummyDataLoader::new();
-    let tx = gen_tx(&mut data_loader);
+    let tx = gen_tx(&mut data_loader, extra_args);
     let resolved_tx = build_resolved_tx(&data_loader, &tx);
     let consensus = gen_consensus();
     let tx_env = gen_tx_env();
@@ -196,5 +200,31 @@ fn run_dylib_tests() {
         TransactionScriptsVerifier::new(&resolved_tx, &consensus, &data_loader, &tx_env);
     verifier.set_debug_printer(debug_printer);
     let verify_result = verifier.verify(MAX_CYCLES);
-    verify_result.expect("pass verification");
+    verify_result.expect("pass verification")
+}
+
+#[test]
+fn run_dylib_tests() {
+    run_dylibtest(&[]);
+}
+
+// Compares the cycles used per iteration to run the same chunk with
+// lua_run_code, which parses it every time, and with lua_run_compiled, which
+// runs the chunk compiled once by lua_compile_code.
+#[test]
+fn bench_compiled_code() {
+    let cycles_per_iteration = |benchmark: u8| {
+        let once = run_dylibtest(&[benchmark, 1]);
+        let many = run_dylibtest(&[benchmark, 101]);
+        (many - once) / 100
+    };
+    let run_code = cycles_per_iteration(1);
+    let run_compiled = cycles_per_iteration(2);
+    println!(
+        "cycles per iteration: lua_run_code {}, lua_run_compiled {}, saved {}",
+        run_code,
+        run_compiled,
+        run_code.saturating_sub(run_compiled)
+    );
+    assert!(run_compiled < run_code);
 }